@@ -67,7 +67,9 @@ extern "C" {
 #define HTTP_CODE_METHOD_NOT_ALLOWED    (405)
 #define HTTP_CODE_REQUEST_TIME_OUT      (408)
 #define HTTP_CODE_GONE                  (410)
+#define HTTP_CODE_PAYLOAD_TOO_LARGE     (413)
 #define HTTP_CODE_REQUEST_URI_TOO_LONG  (414)
+#define HTTP_CODE_RANGE_NOT_SATISFIABLE (416)
 #define HTTP_CODE_LOCKED                (423)
 #define HTTP_CODE_INTERNAL_SERVER_ERROR (500)
 #define HTTP_CODE_NOT_IMPLEMENTED       (501)
@@ -113,7 +115,14 @@ extern const char *ad_http_get_request_header(ad_conn_t *conn, const char *name)
 extern off_t ad_http_get_content_length(ad_conn_t *conn);
 extern size_t ad_http_get_content_length_stored(ad_conn_t *conn);
 extern void *ad_http_get_content(ad_conn_t *conn, size_t maxsize, size_t *storedsize);
+extern int ad_http_get_content_fd(ad_conn_t *conn);
+extern const void *ad_http_get_content_map(ad_conn_t *conn, size_t *size);
+extern const char *ad_http_get_query_param(ad_conn_t *conn, const char *name);
+extern const char *ad_http_get_form_param(ad_conn_t *conn, const char *name);
+extern const char *ad_http_get_cookie(ad_conn_t *conn, const char *name);
 extern int ad_http_is_keepalive_request(ad_conn_t *conn);
+extern int ad_http_accepts_encoding(ad_conn_t *conn, const char *coding);
+extern int ad_http_match_etag(ad_conn_t *conn, const char *etag);
 
 extern int ad_http_set_response_header(ad_conn_t *conn, const char *name, const char *value);
 extern const char *ad_http_get_response_header(ad_conn_t *conn, const char *name);
@@ -123,6 +132,7 @@ extern int ad_http_set_response_content(ad_conn_t *conn, const char *contenttype
 extern size_t ad_http_response(ad_conn_t *conn, int code, const char *contenttype, const void *data, off_t size);
 extern size_t ad_http_send_header(ad_conn_t *conn);
 extern size_t ad_http_send_data(ad_conn_t *conn, const void *data, size_t size);
+extern size_t ad_http_send_file(ad_conn_t *conn, struct evbuffer_file_segment *seg, off_t offset, off_t length);
 extern size_t ad_http_send_chunk(ad_conn_t *conn, const void *data, size_t size);
 
 extern const char *ad_http_get_reason(int code);
@@ -130,6 +140,7 @@ extern const char *ad_http_get_reason(int code);
 /*---------------------------------------------------------------------------*\
 |                            DATA STRUCTURES                                  |
 \*---------------------------------------------------------------------------*/
+
 struct ad_http_s {
     // HTTP Request
     struct {
@@ -149,6 +160,23 @@ struct ad_http_s {
         char *domain;         /*!< domain name ex) www.domain.com (no port number) */
         off_t contentlength;  /*!< value of Content-Length header.*/
         size_t bodyin;        /*!< bytes moved to in-buff */
+        size_t headersize;    /*!< bytes of request line and headers */
+        bool expect;          /*!< client waits for 100 Continue to send body */
+        bool streaming;       /*!< hooks take the body as it arrives */
+
+        // spooled body - when it's larger than http.spool_size.
+        struct {
+            int fd;           /*!< unlinked file of the body. -1 if not spooled */
+            off_t size;       /*!< bytes written to the file */
+            off_t off;        /*!< bytes read by ad_http_get_content() */
+            void *map;        /*!< mapping by ad_http_get_content_map() */
+            size_t maplen;    /*!< length of the mapping */
+        } spool;
+
+        // parsed parameters - built on first access.
+        struct ad_http_kvlist_s *queryparams;  /*!< by ad_http_get_query_param() */
+        struct ad_http_kvlist_s *formparams;   /*!< by ad_http_get_form_param() */
+        struct ad_http_kvlist_s *cookies;      /*!< by ad_http_get_cookie() */
     } request;
 
     // HTTP Response
@@ -162,9 +190,30 @@ struct ad_http_s {
         qlisttbl_t *headers;    /*!< response header entries */
         off_t contentlength;    /*!< content length in response */
         size_t bodyout;         /*!< bytes added to out-buffer */
+        struct z_stream_s *zstream;  /*!< compressor if the body is compressed */
     } response;
+
+    struct ad_http_ext_s *ext;  /*!< state of the HTTP modules. internal use only */
 };
 
+/*---------------------------------------------------------------------------*\
+|                             INTERNAL USE ONLY                               |
+\*---------------------------------------------------------------------------*/
+#ifndef _DOXYGEN_SKIP
+/* Per-request state slots of the HTTP modules. */
+enum ad_http_userdata_e {
+    AD_HTTP_USERDATA_ROUTER = 0,    /* ad_http_router() */
+    AD_HTTP_USERDATA_CACHE,         /* ad_http_cache() */
+    AD_HTTP_USERDATA_MULTIPART,     /* ad_http_multipart() */
+    AD_HTTP_NUM_USERDATA,
+};
+
+extern int ad_http_set_userdata(ad_conn_t *conn, int index, const void *userdata,
+                                ad_userdata_free_cb free_cb);
+extern void *ad_http_get_userdata(ad_conn_t *conn, int index);
+extern int ad_http_set_tee(ad_conn_t *conn, struct evbuffer *tee);
+#endif /* _DOXYGEN_SKIP */
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,98 @@
+/******************************************************************************
+ * libasyncd
+ *
+ * Copyright (c) 2014 Seungyoung Kim.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *****************************************************************************/
+
+/**
+ * ad_http_multipart header file
+ *
+ * @file ad_http_multipart.h
+ */
+
+
+#ifndef _AD_HTTP_MULTIPART_H
+#define _AD_HTTP_MULTIPART_H
+
+#include "ad_server.h"
+#include "ad_http_handler.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*----------------------------------------------------------------------------*\
+|                                 TYPEDEFS                                     |
+\*----------------------------------------------------------------------------*/
+typedef struct ad_http_multipart_s ad_http_multipart_t;
+typedef struct ad_http_part_s ad_http_part_t;
+
+/*!< Part events */
+#define AD_HTTP_PART_BEGIN  (1)         /*!< headers of a part are in */
+#define AD_HTTP_PART_DATA   (1 << 1)    /*!< data of the part */
+#define AD_HTTP_PART_END    (1 << 2)    /*!< end of the part */
+#define AD_HTTP_PART_ABORT  (1 << 3)    /*!< with END, request ended in the part */
+
+/**
+ * Part callback. data and size are set on AD_HTTP_PART_DATA only. The
+ * data points into the in-buffer and is valid during the call. A part
+ * always gets AD_HTTP_PART_END once it has begun, with AD_HTTP_PART_ABORT
+ * if the request is over before the part is complete.
+ *
+ * @return AD_OK to go on. Anything else stops the request, which is
+ *         answered with "400 Bad Request" unless the callback has responded.
+ */
+typedef int (*ad_http_part_cb)(short event, ad_conn_t *conn, ad_http_part_t *part,
+                               const void *data, size_t size, void *userdata);
+
+/*----------------------------------------------------------------------------*\
+|                             PUBLIC FUNCTIONS                                 |
+\*----------------------------------------------------------------------------*/
+extern ad_http_multipart_t *ad_http_multipart_new(ad_http_part_cb cb, void *userdata);
+extern void ad_http_multipart_free(ad_http_multipart_t *mp);
+extern int ad_http_multipart(short event, ad_conn_t *conn, void *userdata);
+
+/*---------------------------------------------------------------------------*\
+|                            DATA STRUCTURES                                  |
+\*---------------------------------------------------------------------------*/
+
+/**
+ * Part of a multipart/form-data body.
+ */
+struct ad_http_part_s {
+    qlisttbl_t *headers;    /*!< part header entries */
+    const char *name;       /*!< form field name. NULL if not given */
+    const char *filename;   /*!< file name. NULL if the part is not a file */
+    const char *contenttype;/*!< Content-Type of the part. NULL if not given */
+    off_t size;             /*!< bytes of the data so far */
+    int index;              /*!< sequence of the part, starting from 0 */
+    void *userdata;         /*!< for the callback to keep its state */
+};
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /*_AD_HTTP_MULTIPART_H */
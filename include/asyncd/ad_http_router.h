@@ -0,0 +1,74 @@
+/******************************************************************************
+ * libasyncd
+ *
+ * Copyright (c) 2014 Seungyoung Kim.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *****************************************************************************/
+
+/**
+ * ad_http_router header file
+ *
+ * @file ad_http_router.h
+ */
+
+#ifndef _AD_HTTP_ROUTER_H
+#define _AD_HTTP_ROUTER_H
+
+#include "ad_server.h"
+#include "ad_http_handler.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define AD_HTTP_MAX_PARAMS (8)  /* max path parameters in a route */
+
+/*----------------------------------------------------------------------------*\
+|                                 TYPEDEFS                                     |
+\*----------------------------------------------------------------------------*/
+typedef struct ad_http_router_s ad_http_router_t;
+typedef struct ad_http_vhost_s ad_http_vhost_t;
+
+/*----------------------------------------------------------------------------*\
+|                             PUBLIC FUNCTIONS                                 |
+\*----------------------------------------------------------------------------*/
+extern ad_http_router_t *ad_http_router_new(void);
+extern int ad_http_router_add(ad_http_router_t *router, const char *method,
+                              const char *path, ad_callback cb, void *userdata);
+extern void ad_http_router_free(ad_http_router_t *router);
+extern int ad_http_router(short event, ad_conn_t *conn, void *userdata);
+
+extern const char *ad_http_get_param(ad_conn_t *conn, const char *name, size_t *len);
+
+extern ad_http_vhost_t *ad_http_vhost_new(void);
+extern int ad_http_vhost_register_hook(ad_http_vhost_t *vhost, const char *hostname,
+                                       ad_callback cb, void *userdata);
+extern void ad_http_vhost_free(ad_http_vhost_t *vhost);
+extern int ad_http_vhost(short event, ad_conn_t *conn, void *userdata);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /*_AD_HTTP_ROUTER_H */
@@ -0,0 +1,61 @@
+/******************************************************************************
+ * libasyncd
+ *
+ * Copyright (c) 2014 Seungyoung Kim.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *****************************************************************************/
+
+/**
+ * ad_http_static header file
+ *
+ * @file ad_http_static.h
+ */
+
+#ifndef _AD_HTTP_STATIC_H
+#define _AD_HTTP_STATIC_H
+
+#include "ad_server.h"
+#include "ad_http_handler.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*----------------------------------------------------------------------------*\
+|                                 TYPEDEFS                                     |
+\*----------------------------------------------------------------------------*/
+typedef struct ad_http_static_s ad_http_static_t;
+
+/*----------------------------------------------------------------------------*\
+|                             PUBLIC FUNCTIONS                                 |
+\*----------------------------------------------------------------------------*/
+extern ad_http_static_t *ad_http_static_new(const char *rootdir, size_t maxfiles);
+extern void ad_http_static_free(ad_http_static_t *files);
+extern int ad_http_static(short event, ad_conn_t *conn, void *userdata);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /*_AD_HTTP_STATIC_H */
@@ -35,6 +35,8 @@
 #ifndef _AD_SERVER_H
 #define _AD_SERVER_H
 
+#include <stdint.h>
+#include <sys/types.h>
 #include <event2/event.h>
 #include <event2/buffer.h>
 #include <event2/bufferevent.h>
@@ -50,6 +52,16 @@ extern "C" {
 \*---------------------------------------------------------------------------*/
 typedef struct ad_server_s ad_server_t;
 typedef struct ad_conn_s ad_conn_t;
+typedef struct ad_listener_s ad_listener_t;
+typedef struct ad_conn_token_s ad_conn_token_t;
+typedef struct ad_pool_s ad_pool_t;
+typedef struct ad_msgq_s ad_msgq_t;
+typedef struct ad_prefork_s ad_prefork_t;
+typedef struct ad_worker_stats_s ad_worker_stats_t;
+typedef struct ad_shmstats_s ad_shmstats_t;
+typedef struct ad_sslcache_s ad_sslcache_t;
+typedef struct ad_sni_s ad_sni_t;
+typedef struct ad_handshake_s ad_handshake_t;
 
 /*
  * Return values of user callback.
@@ -86,6 +98,13 @@ enum ad_log_e {
                                                                             \
         { "server.backlog",     "128" },                                    \
                                                                             \
+        /* Use already bound socket instead of binding on addr/port. */    \
+        { "server.listen_fd",   "-1" },                                     \
+                                                                            \
+        /* Use sockets passed by systemd (LISTEN_FDS) if there are.         \
+         * Passed sockets are assigned to listeners in the added order. */  \
+        { "server.socket_activation", "0" },                                \
+                                                                            \
         /* Set read timeout seconds. 0 means no timeout. */                 \
         { "server.timeout",     "0" },                                      \
                                                                             \
@@ -94,6 +113,23 @@ enum ad_log_e {
         { "server.ssl_cert", "/usr/local/etc/ad_server/ad_server.crt" },    \
         { "server.ssl_pkey", "/usr/local/etc/ad_server/ad_server.key" },    \
                                                                             \
+        /* Max number of cached TLS sessions. 0 to leave it to OpenSSL. */  \
+        { "server.ssl_session_cache", "20480" },                            \
+                                                                            \
+        /* Seconds a TLS session can be resumed. */                         \
+        { "server.ssl_session_timeout", "300" },                            \
+                                                                            \
+        /* Seconds to rotate session ticket keys. 0 disables tickets. */    \
+        { "server.ssl_ticket_rotate", "3600" },                             \
+                                                                            \
+        /* Hand TLS records to the kernel (kTLS) after handshake if the     \
+         * kernel and OpenSSL support it. Allows sendfile() over SSL. */    \
+        { "server.ssl_ktls", "0" },                                         \
+                                                                            \
+        /* Number of threads doing TLS handshakes off the loop.             \
+         * 0 to do handshakes in the loop. */                               \
+        { "server.ssl_handshake_threads", "0" },                            \
+                                                                            \
         /* Enable or disable request pipelining, this change AD_DONE's behavior */ \
         { "server.request_pipelining", "1" },                               \
                                                                             \
@@ -103,6 +139,81 @@ enum ad_log_e {
         /* Collect resources after stop */                                  \
         { "server.free_on_stop", "1" },                                     \
                                                                             \
+        /* Max seconds to wait for in-flight requests on stop. */          \
+        { "server.drain_timeout", "10" },                                   \
+                                                                            \
+        /* Unix socket path for hot restart. Empty string to disable.       \
+         * A new process takes over listening sockets from the old one     \
+         * through this socket and the old one drains. */                  \
+        { "server.handoff_path", "" },                                      \
+                                                                            \
+        /* Number of threads for ad_conn_offload(). 0 to disable. */        \
+        { "server.offload_threads", "0" },                                  \
+                                                                            \
+        /* Max number of connections per server loop. Accepting pauses    \
+         * at the limit and resumes as connections close. 0 for no limit. */ \
+        { "server.max_connections", "0" },                                  \
+                                                                            \
+        /* Max number of connections of all worker processes.              \
+         * 0 for no limit. */                                               \
+        { "server.max_connections_global", "0" },                           \
+                                                                            \
+        /* Bytes buffered by connections before the server stops          \
+         * accepting and answers new HTTP requests with 503.               \
+         * 0 for no limit. */                                               \
+        { "server.mem_limit", "0" },                                        \
+                                                                            \
+        /* Bytes buffered by connections before the largest ones are        \
+         * closed. 0 for no limit. */                                       \
+        { "server.mem_hard_limit", "0" },                                   \
+                                                                            \
+        /* Size of the message queue for ad_server_post(). Rounded up to a  \
+         * power of 2, up to 1048576. */                                    \
+        { "server.msgq_size", "1024" },                                     \
+                                                                            \
+        /* Number of worker processes. 0 to run in a single process.       \
+         * Workers are forked after binding and restarted on crash. */     \
+        { "server.workers", "0" },                                          \
+                                                                            \
+        /* Shared memory name for worker stats ex) "/ad_server".           \
+         * Empty string to keep it private to the server processes. */     \
+        { "server.stats_shm", "" },                                         \
+                                                                            \
+        /* Call the hooks with AD_HTTP_REQ_HEADER_DONE when the headers    \
+         * of a request are in and the body is still to come. Needed by    \
+         * hooks which check the headers first or take the body as it      \
+         * arrives, like ad_http_multipart(). */                            \
+        { "http.header_phase",  "0" },                                      \
+                                                                            \
+        /* Add ETag from the hash of the body to responses made with        \
+         * ad_http_response(), and answer matching If-None-Match with 304. */ \
+        { "http.etag",          "0" },                                      \
+                                                                            \
+        /* Compress HTTP responses with gzip or deflate when the client     \
+         * accepts it. */                                                   \
+        { "http.compress",      "0" },                                      \
+                                                                            \
+        /* Compression level from 1(fastest) to 9(smallest). */             \
+        { "http.compress_level", "6" },                                     \
+                                                                            \
+        /* Min Content-Length to compress. Chunked responses are            \
+         * compressed regardless. */                                        \
+        { "http.compress_min_size", "1024" },                               \
+                                                                            \
+        /* Content types to compress, comma separated. A type ending        \
+         * with '/' matches all its subtypes. */                            \
+        { "http.compress_types", "text/,application/json,"                  \
+          "application/javascript,application/xml,image/svg+xml" },         \
+                                                                            \
+        /* Request bodies larger than this are written to an unlinked      \
+         * temporary file instead of being kept in memory, from the read   \
+         * after the headers on. 0 to disable. */                          \
+        { "http.spool_size",    "0" },                                      \
+                                                                            \
+        /* Directory of the spool files. Empty to use memfd_create()       \
+         * where available, which is backed by memory and swap. */         \
+        { "http.spool_dir",     "" },                                       \
+                                                                            \
         /* End of array marker. Do not remove */                            \
         { "", "_END_" }                                                     \
 };
@@ -117,6 +228,17 @@ enum ad_log_e {
 typedef int (*ad_callback)(short event, ad_conn_t *conn, void *userdata);
 typedef void (*ad_userdata_free_cb)(ad_conn_t *conn, void *userdata);
 
+/**
+ * Offload callback prototypes. See ad_conn_offload().
+ */
+typedef void (*ad_job_cb)(void *arg);
+typedef int (*ad_done_cb)(ad_conn_t *conn, void *arg);
+
+/**
+ * Message callback prototype. See ad_server_post().
+ */
+typedef void (*ad_msg_cb)(ad_server_t *server, void *arg);
+
 /**
  * Event types
  */
@@ -126,6 +248,7 @@ typedef void (*ad_userdata_free_cb)(ad_conn_t *conn, void *userdata);
 #define AD_EVENT_CLOSE    (1 << 3)   /*!< Call before closing. */
 #define AD_EVENT_TIMEOUT  (1 << 4)   /*!< Timeout indicator, this flag will be set with AD_EVENT_CLOSE. */
 #define AD_EVENT_SHUTDOWN (1 << 5)   /*!< Shutdown indicator, this flag will be set with AD_EVENT_CLOSE. */
+#define AD_EVENT_RESUME   (1 << 6)   /*!< Resume indicator, this flag will be set with AD_EVENT_READ. */
 
 /**
  * Defaults
@@ -146,11 +269,78 @@ struct ad_server_s {
     qhashtbl_t *options;            /*!< server options */
     qhashtbl_t *stats;              /*!< internal statistics */
     qlist_t *hooks;                 /*!< list of registered hooks */
-    struct evconnlistener *listener; /*!< listener */
+    struct evconnlistener *listener; /*!< listener of the default(first) one */
+    ad_listener_t *listeners;       /*!< list of listeners */
+    struct evconnlistener *handoff; /*!< hot restart channel */
     struct event_base *evbase;      /*!< event base */
     SSL_CTX *sslctx;                /*!< SSL connection support */
+    ad_sslcache_t *sslcache;        /*!< SSL session cache and ticket keys */
+    ad_sni_t *sni;                  /*!< SSL contexts by hostname */
+    ad_pool_t *pool;                /*!< offload thread pool */
+    ad_pool_t *hspool;              /*!< TLS handshake thread pool */
 
     struct bufferevent *notify_buffer; /*!< internal notification channel */
+    int notifyfd;                      /*!< writing end of notification channel */
+    int notified;                      /*!< set while a wakeup is pending */
+    ad_msgq_t *msgq;                   /*!< messages to the loop, lock-free ring */
+    ad_conn_token_t *resumeq;          /*!< resumed connections, lock-free stack */
+    ad_handshake_t *handshakeq;        /*!< finished handshakes, lock-free stack */
+
+    ad_conn_t *conns;               /*!< list of live connections */
+    size_t nconns;                  /*!< number of live connections */
+    bool draining;                  /*!< set while stopping, no new requests */
+
+    size_t max_conns;               /*!< see "server.max_connections" */
+    size_t max_conns_global;        /*!< see "server.max_connections_global" */
+    bool accept_backoff;            /*!< set while backing off accept errors */
+    struct event *accept_event;     /*!< resumes accepting */
+    int spare_fd;                   /*!< reserved to shed connections on EMFILE */
+
+    size_t mem;                     /*!< bytes buffered by the connections */
+    size_t mem_limit;               /*!< see "server.mem_limit" */
+    size_t mem_hard_limit;          /*!< see "server.mem_hard_limit" */
+    bool mem_pressure;              /*!< set while over mem_limit */
+    struct event *mem_event;        /*!< closes the largest connections */
+
+    ad_prefork_t *prefork;          /*!< worker processes. NULL in single process */
+    ad_shmstats_t *shmstats;        /*!< shared stats of all processes */
+    ad_worker_stats_t *mystats;     /*!< this process's slot in shmstats */
+};
+
+/**
+ * Per-process counters. See ad_server_get_shmstats().
+ */
+struct ad_worker_stats_s {
+    pid_t pid;                  /*!< process id. 0 while not running */
+    uint32_t starts;            /*!< number of times started */
+    uint64_t accepted;          /*!< number of accepted connections */
+    uint64_t closed;            /*!< number of closed connections */
+    uint64_t conns;             /*!< number of open connections */
+    uint64_t mem;               /*!< bytes buffered by connections */
+};
+
+/**
+ * Stats shared by the server processes.
+ */
+struct ad_shmstats_s {
+    uint32_t nworkers;              /*!< number of slots */
+    ad_worker_stats_t workers[];    /*!< one slot per worker */
+};
+
+/**
+ * Listener info container.
+ */
+struct ad_listener_s {
+    ad_server_t *server;        /*!< reference pointer to server */
+    char *addr;                 /*!< address to bind. see "server.addr" */
+    int port;                   /*!< port number to bind */
+    int backlog;                /*!< listen backlog. -1 for "server.backlog" */
+    int timeout;                /*!< read timeout seconds. -1 for "server.timeout" */
+    int write_timeout;          /*!< write timeout seconds. 0 means no timeout. */
+    SSL_CTX *sslctx;            /*!< SSL connection support. NULL for plain */
+    qlist_t *hooks;             /*!< listener's own hooks. NULL to use server's */
+    struct evconnlistener *listener; /*!< libevent listener while running */
+    ad_listener_t *next;        /*!< next in server's listener list */
 };
 
 /**
@@ -158,6 +348,7 @@ struct ad_server_s {
  */
 struct ad_conn_s {
     ad_server_t *server;        /*!< reference pointer to server */
+    ad_listener_t *listener;    /*!< reference pointer to listener */
     struct bufferevent *buffer; /*!< reference pointer to buffer */
     struct evbuffer *in;        /*!< in buffer */
     struct evbuffer *out;       /*!< out buffer */
@@ -166,6 +357,11 @@ struct ad_conn_s {
     void *userdata[2];             /*!< userdata[0] for end user, userdata[1] for extra */
     ad_userdata_free_cb userdata_free_cb[2];  /*!< callback to release user data */
     char *method;               /*!< request method. set by protocol handler */
+    bool busy;                  /*!< a request is in progress. set by protocol handler */
+    ad_conn_token_t *token;     /*!< not null while the connection is suspended */
+    size_t mem;                 /*!< bytes buffered by this connection */
+    ad_conn_t *prev;            /*!< previous in server's connection list */
+    ad_conn_t *next;            /*!< next in server's connection list */
 };
 
 /*----------------------------------------------------------------------------*\
@@ -185,18 +381,40 @@ extern int ad_server_get_option_int(ad_server_t *server, const char *key);
 extern SSL_CTX *ad_server_ssl_ctx_create_simple(const char *cert_path, const char *pkey_path);
 extern void ad_server_set_ssl_ctx(ad_server_t *server, SSL_CTX *sslctx);
 extern SSL_CTX *ad_server_get_ssl_ctx(ad_server_t *server);
+extern int ad_server_add_ssl_ctx(ad_server_t *server, const char *hostname, SSL_CTX *sslctx);
+extern int ad_server_remove_ssl_ctx(ad_server_t *server, const char *hostname);
 extern qhashtbl_t *ad_server_get_stats(ad_server_t *server, const char *key);
+extern int ad_server_post(ad_server_t *server, ad_msg_cb cb, void *arg);
+extern ad_shmstats_t *ad_server_get_shmstats(ad_server_t *server);
+extern ad_shmstats_t *ad_shmstats_open(const char *name);
+extern void ad_shmstats_close(ad_shmstats_t *stats);
 
 extern void ad_server_register_hook(ad_server_t *server, ad_callback cb, void *userdata);
 extern void ad_server_register_hook_on_method(ad_server_t *server, const char *method,
                                               ad_callback cb, void *userdata);
 
+extern ad_listener_t *ad_server_add_listener(ad_server_t *server, const char *addr, int port);
+extern void ad_listener_set_backlog(ad_listener_t *listener, int backlog);
+extern void ad_listener_set_timeout(ad_listener_t *listener, int read_timeout, int write_timeout);
+extern void ad_listener_set_ssl_ctx(ad_listener_t *listener, SSL_CTX *sslctx);
+extern void ad_listener_register_hook(ad_listener_t *listener, ad_callback cb, void *userdata);
+extern void ad_listener_register_hook_on_method(ad_listener_t *listener, const char *method,
+                                                ad_callback cb, void *userdata);
+extern void ad_hooks_add(qlist_t *hooks, const char *method, ad_callback cb, void *userdata);
+extern int ad_hooks_call(qlist_t *hooks, short event, ad_conn_t *conn);
+extern void ad_hooks_free(qlist_t *hooks);
+
 extern void *ad_conn_set_userdata(ad_conn_t *conn, const void *userdata, ad_userdata_free_cb free_cb);
 extern void *ad_conn_get_userdata(ad_conn_t *conn);
 extern void *ad_conn_set_extra(ad_conn_t *conn, const void *extra, ad_userdata_free_cb free_cb);
 extern void *ad_conn_get_extra(ad_conn_t *conn);
 extern void ad_conn_set_method(ad_conn_t *conn, char *method);
 extern int  ad_conn_get_socket(ad_conn_t *conn);
+extern ad_conn_token_t *ad_conn_suspend(ad_conn_t *conn);
+extern int ad_conn_resume(ad_conn_token_t *token, int status);
+extern int ad_conn_offload(ad_conn_t *conn, ad_job_cb job, ad_done_cb done, void *arg);
+extern void ad_conn_track_buffer(ad_conn_t *conn, struct evbuffer *buffer);
+extern void ad_conn_track_mem(ad_conn_t *conn, ssize_t bytes);
 
 /*---------------------------------------------------------------------------*\
 |                             INTERNAL USE ONLY                               |
@@ -37,6 +37,10 @@
 
 #include "ad_server.h"
 #include "ad_http_handler.h"
+#include "ad_http_router.h"
+#include "ad_http_static.h"
+#include "ad_http_cache.h"
+#include "ad_http_multipart.h"
 
 #ifdef __cplusplus
 extern "C" {
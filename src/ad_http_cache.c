@@ -0,0 +1,595 @@
+/******************************************************************************
+ * libasyncd
+ *
+ * Copyright (c) 2014 Seungyoung Kim.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *****************************************************************************/
+
+/**
+ * HTTP response cache.
+ *
+ * @file ad_http_cache.c
+ */
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <time.h>
+#include <pthread.h>
+#include <event2/buffer.h>
+#include "qlibc/qlibc.h"
+#include "ad_server.h"
+#include "ad_http_handler.h"
+#include "ad_http_cache.h"
+#include "macro.h"
+
+/*
+ * Responses are kept serialized, the status line without the protocol
+ * version and the headers without Connection, so a hit only adds
+ * references to them to the out-buffer. The cache is split into shards
+ * by key hash to keep the loops from contending on one lock.
+ *
+ * A miss leaves an entry being filled in the cache. Requests for the same
+ * key arriving meanwhile are suspended on the entry and resumed when the
+ * response is in, so the handler runs once for all of them. If the
+ * response turns out not cacheable, the entry stays for a while as a
+ * marker to let the requests for the key through without waiting.
+ */
+#define AD_CACHE_SHARDS     (8)     /* number of shards. power of 2 */
+#define AD_CACHE_MAXVARY    (8)     /* max number of Vary headers */
+#define AD_CACHE_PASSTTL    (5)     /* seconds to pass a key not cacheable */
+
+typedef struct ad_cache_shard_s ad_cache_shard_t;
+typedef struct ad_cache_entry_s ad_cache_entry_t;
+typedef struct ad_cache_fill_s ad_cache_fill_t;
+
+struct ad_cache_entry_s {
+    char *key;
+    ad_cache_shard_t *shard;
+    bool filling;               /* response is being made */
+    bool pass;                  /* response was not cacheable */
+    qlist_t *waiters;           /* tokens of requests waiting for the fill */
+    char *head;                 /* ex) 200 OK\r\nContent-Length: 2\r\n */
+    size_t headlen;
+    char *body;
+    size_t bodylen;
+    time_t created;
+    time_t expires;
+    size_t size;                /* bytes counted in the shard */
+    int refs;                   /* one for the cache and one for each user */
+    ad_cache_entry_t *prev;     /* LRU list, most recently used first */
+    ad_cache_entry_t *next;
+};
+
+/*
+ * Request filling an entry.
+ */
+struct ad_cache_fill_s {
+    ad_cache_entry_t *entry;
+    struct evbuffer *tee;       /* copy of the response body */
+};
+
+struct ad_cache_shard_s {
+    ad_http_cache_t *cache;
+    pthread_mutex_t lock;
+    qhashtbl_t *entries;        /* key -> ad_cache_entry_t * */
+    ad_cache_entry_t *head;
+    ad_cache_entry_t *tail;
+    size_t bytes;               /* bytes of the filled entries */
+};
+
+struct ad_http_cache_s {
+    size_t maxbytes;            /* per shard */
+    int ttl;
+    char *vary[AD_CACHE_MAXVARY];
+    int nvary;
+    ad_cache_shard_t shards[AD_CACHE_SHARDS];
+};
+
+#ifndef _DOXYGEN_SKIP
+static char *cache_key(ad_http_cache_t *cache, ad_conn_t *conn, ad_http_t *http);
+static int cache_send(ad_conn_t *conn, ad_http_t *http, ad_cache_entry_t *entry, bool head);
+static void cache_fill_done(ad_conn_t *conn, void *userdata);
+static int cache_ttl(ad_http_cache_t *cache, ad_http_t *http, size_t bodylen);
+static bool cache_compressed(ad_http_t *http);
+static bool cache_vary(ad_http_cache_t *cache, const char *name);
+static void entry_unlink(ad_cache_shard_t *shard, ad_cache_entry_t *entry);
+static void entry_unref(ad_cache_entry_t *entry);
+static void entry_unref_cb(const void *data, size_t datalen, void *extra);
+#endif
+
+/**
+ * Create a response cache.
+ *
+ * @param maxbytes memory for the responses. A response larger than its
+ *        share in a shard, maxbytes / 8, is not cached.
+ * @param ttl default seconds to keep a response. "max-age" or "s-maxage"
+ *        in Cache-Control of the response overrides it.
+ * @param vary comma separated request headers to key the responses by in
+ *        addition to method, host and URI, ex) "Accept-Encoding". NULL
+ *        for none. Responses varying by other headers are not cached.
+ *        Responses compressed by "http.compress" vary by Accept-Encoding,
+ *        so it must be listed to cache them.
+ *
+ * @return a pointer of ad_http_cache_t object, otherwise NULL.
+ *
+ * @code
+ *   ad_http_cache_t *cache = ad_http_cache_new(64 * 1024 * 1024, 10, "Accept-Encoding");
+ *
+ *   ad_server_register_hook(server, ad_http_handler, NULL);
+ *   ad_server_register_hook(server, ad_http_cache, cache);
+ *   ad_server_register_hook(server, my_handler, NULL);
+ * @endcode
+ */
+ad_http_cache_t *ad_http_cache_new(size_t maxbytes, int ttl, const char *vary) {
+    ad_http_cache_t *cache = NEW_OBJECT(ad_http_cache_t);
+    if (cache == NULL) {
+        return NULL;
+    }
+    cache->maxbytes = maxbytes / AD_CACHE_SHARDS;
+    cache->ttl = ttl;
+
+    if (vary) {
+        char *names = strdup(vary);
+        char *saveptr = NULL;
+        for (char *name = (names) ? strtok_r(names, ", \t", &saveptr) : NULL; name;
+             name = strtok_r(NULL, ", \t", &saveptr)) {
+            if (cache->nvary == AD_CACHE_MAXVARY) {
+                WARN("Too many Vary headers. %s is ignored.", name);
+                continue;
+            }
+            cache->vary[cache->nvary++] = strdup(name);
+        }
+        free(names);
+    }
+
+    for (int i = 0; i < AD_CACHE_SHARDS; i++) {
+        ad_cache_shard_t *shard = &cache->shards[i];
+        shard->cache = cache;
+        pthread_mutex_init(&shard->lock, NULL);
+        shard->entries = qhashtbl(0, 0);
+        if (shard->entries == NULL) {
+            ad_http_cache_free(cache);
+            return NULL;
+        }
+    }
+    return cache;
+}
+
+/**
+ * Release the response cache. Responses in flight keep their entries
+ * until they are sent.
+ */
+void ad_http_cache_free(ad_http_cache_t *cache) {
+    for (int i = 0; i < AD_CACHE_SHARDS; i++) {
+        ad_cache_shard_t *shard = &cache->shards[i];
+        if (shard->entries == NULL) {
+            continue;
+        }
+        qhashtbl_obj_t obj;
+        bzero((void *)&obj, sizeof(qhashtbl_obj_t));
+        while (shard->entries->getnext(shard->entries, &obj, false)) {
+            entry_unref(*(ad_cache_entry_t **)obj.data);
+        }
+        shard->entries->free(shard->entries);
+        pthread_mutex_destroy(&shard->lock);
+    }
+    for (int i = 0; i < cache->nvary; i++) {
+        free(cache->vary[i]);
+    }
+    free(cache);
+}
+
+/**
+ * Response cache hook. Register it after ad_http_handler() with the cache
+ * as userdata, in front of the hooks whose responses are to be cached.
+ *
+ * GET and HEAD requests are answered from the cache without calling the
+ * next hooks. On a miss the next hooks make the response for a GET
+ * request, and it is cached if it is a "200 OK" with Content-Length sent
+ * with ad_http_send_data() or ad_http_send_file(), and without Set-Cookie
+ * or Cache-Control saying no-store, no-cache or private. A response
+ * compressed by "http.compress" is cached compressed, and served with the
+ * length of the compressed body. Requests with Authorization header are
+ * not cached. Requests for a key whose response
+ * was not cacheable go to the next hooks on their own for a few seconds.
+ */
+int ad_http_cache(short event, ad_conn_t *conn, void *userdata) {
+    ad_http_cache_t *cache = (ad_http_cache_t *)userdata;
+    if (! (event & AD_EVENT_READ) || ad_http_get_status(conn) != AD_HTTP_REQ_DONE) {
+        return AD_OK;
+    }
+    ad_http_t *http = (ad_http_t *) ad_conn_get_extra(conn);
+    bool head = ! strcmp(http->request.method, "HEAD");
+    if (ad_http_get_userdata(conn, AD_HTTP_USERDATA_CACHE) || (! head && strcmp(http->request.method, "GET"))
+        || ad_http_get_request_header(conn, "Authorization")) {
+        return AD_OK;
+    }
+
+    char *key = cache_key(cache, conn, http);
+    if (key == NULL) {
+        return AD_OK;
+    }
+    ad_cache_shard_t *shard = &cache->shards[qhashmurmur3_32(key, strlen(key)) & (AD_CACHE_SHARDS - 1)];
+    time_t now = time(NULL);
+
+    pthread_mutex_lock(&shard->lock);
+    ad_cache_entry_t **found = (ad_cache_entry_t **) shard->entries->get(shard->entries, key, NULL, false);
+    ad_cache_entry_t *entry = (found) ? *found : NULL;
+    if (entry && ! entry->filling && now >= entry->expires) {
+        entry_unlink(shard, entry);
+        entry_unref(entry);
+        entry = NULL;
+    }
+
+    if (entry && entry->pass) {
+        // Not cacheable lately. Don't make the requests wait for each other.
+        pthread_mutex_unlock(&shard->lock);
+        free(key);
+        return AD_OK;
+    } else if (entry && ! entry->filling) {
+        // Hit.
+        if (entry != shard->head) {
+            entry->prev->next = entry->next;
+            if (entry->next) {
+                entry->next->prev = entry->prev;
+            } else {
+                shard->tail = entry->prev;
+            }
+            entry->prev = NULL;
+            entry->next = shard->head;
+            shard->head->prev = entry;
+            shard->head = entry;
+        }
+        __atomic_add_fetch(&entry->refs, 1, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&shard->lock);
+        free(key);
+        int status = cache_send(conn, http, entry, head);
+        entry_unref(entry);
+        return status;
+    } else if (entry) {
+        // Being filled by another request. Wait for it.
+        ad_conn_token_t *token = ad_conn_suspend(conn);
+        if (token) {
+            entry->waiters->addlast(entry->waiters, &token, sizeof(ad_conn_token_t *));
+        }
+        pthread_mutex_unlock(&shard->lock);
+        free(key);
+        return (token) ? AD_TAKEOVER : AD_OK;
+    } else if (head) {
+        pthread_mutex_unlock(&shard->lock);
+        free(key);
+        return AD_OK;
+    }
+
+    // Miss. Let the next hooks make the response and keep a copy.
+    entry = NEW_OBJECT(ad_cache_entry_t);
+    ad_cache_fill_t *fill = NEW_OBJECT(ad_cache_fill_t);
+    struct evbuffer *tee = evbuffer_new();
+    if (entry == NULL || fill == NULL || tee == NULL
+        || (entry->waiters = qlist(0)) == NULL
+        || ad_http_set_userdata(conn, AD_HTTP_USERDATA_CACHE, fill, cache_fill_done)
+        || ad_http_set_tee(conn, tee)
+        || ! shard->entries->put(shard->entries, key, &entry, sizeof(ad_cache_entry_t *))) {
+        pthread_mutex_unlock(&shard->lock);
+        ad_http_set_userdata(conn, AD_HTTP_USERDATA_CACHE, NULL, NULL);
+        ad_http_set_tee(conn, NULL);
+        if (entry && entry->waiters) {
+            entry->waiters->free(entry->waiters);
+        }
+        if (tee) {
+            evbuffer_free(tee);
+        }
+        free(fill);
+        free(entry);
+        free(key);
+        return AD_OK;
+    }
+    entry->key = key;
+    entry->shard = shard;
+    entry->filling = true;
+    entry->refs = 2;  // one for the cache, one for the fill.
+    pthread_mutex_unlock(&shard->lock);
+
+    fill->entry = entry;
+    fill->tee = tee;
+    return AD_OK;
+}
+
+/******************************************************************************
+ * Private internal functions.
+ *****************************************************************************/
+#ifndef _DOXYGEN_SKIP
+
+/**
+ * Make the cache key. ex) GET\nwww.domain.com\n/index.html?a=1\ngzip
+ */
+static char *cache_key(ad_http_cache_t *cache, ad_conn_t *conn, ad_http_t *http) {
+    const char *values[AD_CACHE_MAXVARY];
+    const char *host = (http->request.host) ? http->request.host : "";
+    size_t len = CONST_STRLEN("GET\n") + strlen(host) + 1 + strlen(http->request.uri) + 1;
+    for (int i = 0; i < cache->nvary; i++) {
+        values[i] = ad_http_get_request_header(conn, cache->vary[i]);
+        if (values[i] == NULL) {
+            values[i] = "";
+        }
+        len += strlen(values[i]) + 1;
+    }
+
+    char *key = malloc(len);
+    if (key == NULL) {
+        return NULL;
+    }
+    char *p = key + sprintf(key, "GET\n%s\n%s", host, http->request.uri);
+    for (int i = 0; i < cache->nvary; i++) {
+        p += sprintf(p, "\n%s", values[i]);
+    }
+    return key;
+}
+
+/**
+ * Send a cached response.
+ */
+static int cache_send(ad_conn_t *conn, ad_http_t *http, ad_cache_entry_t *entry, bool head) {
+    bool keepalive = ad_http_is_keepalive_request(conn) && ! conn->server->draining;
+    struct evbuffer *out = http->response.outbuf;
+    http->response.frozen_header = true;
+
+    evbuffer_add_printf(out, "%s ", http->request.httpver);
+    __atomic_add_fetch(&entry->refs, 1, __ATOMIC_RELAXED);
+    if (evbuffer_add_reference(out, entry->head, entry->headlen, entry_unref_cb, entry)) {
+        entry_unref(entry);
+        return AD_CLOSE;
+    }
+    evbuffer_add_printf(out, "Age: %ld" HTTP_CRLF "Connection: %s" HTTP_CRLF HTTP_CRLF,
+                        (long)(time(NULL) - entry->created), (keepalive) ? "Keep-Alive" : "close");
+    if (! head && entry->bodylen > 0) {
+        __atomic_add_fetch(&entry->refs, 1, __ATOMIC_RELAXED);
+        if (evbuffer_add_reference(out, entry->body, entry->bodylen, entry_unref_cb, entry)) {
+            entry_unref(entry);
+            return AD_CLOSE;
+        }
+    }
+    return (keepalive) ? AD_DONE : AD_CLOSE;
+}
+
+/**
+ * Called at the end of the request filling the entry. Store the response
+ * if it can be cached and wake up the waiting requests.
+ */
+static void cache_fill_done(ad_conn_t *conn, void *userdata) {
+    ad_cache_fill_t *fill = (ad_cache_fill_t *)userdata;
+    ad_cache_entry_t *entry = fill->entry;
+    ad_cache_shard_t *shard = entry->shard;
+    ad_http_t *http = (ad_http_t *) ad_conn_get_extra(conn);
+    ad_http_cache_t *cache = shard->cache;
+    ad_http_set_tee(conn, NULL);
+
+    size_t bodylen = evbuffer_get_length(fill->tee);
+    int ttl = cache_ttl(cache, http, bodylen);
+    if (ttl > 0 && bodylen <= cache->maxbytes) {
+        // A compressed body was sent in chunks. It's whole now.
+        bool compressed = cache_compressed(http);
+        // Serialize status line and headers.
+        struct evbuffer *head = evbuffer_new();
+        if (head) {
+            const char *reason = (http->response.reason) ?
+                    http->response.reason : ad_http_get_reason(http->response.code);
+            evbuffer_add_printf(head, "%d %s" HTTP_CRLF, http->response.code, reason);
+            qlisttbl_obj_t obj;
+            bzero((void*) &obj, sizeof(obj));
+            qlisttbl_t *tbl = http->response.headers;
+            tbl->lock(tbl);
+            while (tbl->getnext(tbl, &obj, NULL, false)) {
+                if (strcasecmp(obj.name, "Connection")
+                    && (! compressed || strcasecmp(obj.name, "Transfer-Encoding"))) {
+                    evbuffer_add_printf(head, "%s: %s" HTTP_CRLF, (char*) obj.name, (char*) obj.data);
+                }
+            }
+            tbl->unlock(tbl);
+            if (compressed) {
+                evbuffer_add_printf(head, "Content-Length: %zu" HTTP_CRLF, bodylen);
+            }
+            entry->headlen = evbuffer_get_length(head);
+            entry->head = malloc(entry->headlen);
+            entry->body = malloc(bodylen + 1);
+            if (entry->head && entry->body) {
+                evbuffer_remove(head, entry->head, entry->headlen);
+                evbuffer_remove(fill->tee, entry->body, bodylen);
+                entry->bodylen = bodylen;
+            } else {
+                ttl = 0;
+            }
+            evbuffer_free(head);
+        } else {
+            ttl = 0;
+        }
+    }
+    if (entry->headlen + entry->bodylen > cache->maxbytes) {
+        ttl = 0;
+    }
+
+    if (ttl <= 0) {
+        free(entry->head);
+        free(entry->body);
+        entry->head = entry->body = NULL;
+        entry->headlen = entry->bodylen = 0;
+    }
+
+    pthread_mutex_lock(&shard->lock);
+    qlist_t *waiters = entry->waiters;
+    entry->waiters = NULL;
+    entry->filling = false;
+    entry->created = time(NULL);
+    if (ttl > 0) {
+        entry->expires = entry->created + ttl;
+    } else {
+        entry->pass = true;
+        entry->expires = entry->created + AD_CACHE_PASSTTL;
+    }
+    entry->size = sizeof(ad_cache_entry_t) + strlen(entry->key)
+                  + entry->headlen + entry->bodylen;
+    entry->next = shard->head;
+    if (shard->head) {
+        shard->head->prev = entry;
+    } else {
+        shard->tail = entry;
+    }
+    shard->head = entry;
+    shard->bytes += entry->size;
+    while (shard->bytes > cache->maxbytes && shard->tail) {
+        ad_cache_entry_t *lru = shard->tail;
+        entry_unlink(shard, lru);
+        entry_unref(lru);
+    }
+    pthread_mutex_unlock(&shard->lock);
+
+    // Resume the waiting requests. They'll find the response in the cache,
+    // or go to the next hooks if it's not cacheable.
+    qlist_obj_t obj;
+    bzero((void *)&obj, sizeof(qlist_obj_t));
+    while (waiters->getnext(waiters, &obj, false)) {
+        ad_conn_resume(*(ad_conn_token_t **)obj.data, AD_OK);
+    }
+    waiters->free(waiters);
+    entry_unref(entry);
+    evbuffer_free(fill->tee);
+    free(fill);
+}
+
+/**
+ * Find out how long the response can be cached.
+ *
+ * @return seconds to keep it, 0 if it can't be cached.
+ */
+static int cache_ttl(ad_http_cache_t *cache, ad_http_t *http, size_t bodylen) {
+    bool compressed = cache_compressed(http);
+    if (http->response.code != HTTP_CODE_OK || ! http->response.frozen_header
+        || http->response.contentlength < 0
+        || http->response.bodyout != http->response.contentlength
+        || (! compressed && bodylen != http->response.contentlength)) {
+        return 0;
+    }
+
+    qlisttbl_t *headers = http->response.headers;
+    if (headers->getstr(headers, "Set-Cookie", false)
+        || (! compressed && headers->getstr(headers, "Transfer-Encoding", false))) {
+        return 0;
+    }
+
+    const char *vary = headers->getstr(headers, "Vary", false);
+    if (vary) {
+        char name[64];
+        for (const char *p = vary; *p; ) {
+            p += strspn(p, " \t,");
+            int len = strcspn(p, " \t,");
+            if (len == 0) {
+                continue;
+            }
+            if (snprintf(name, sizeof(name), "%.*s", len, p) >= sizeof(name)
+                || ! cache_vary(cache, name)) {
+                return 0;  // varies by a header not in the key, or "*".
+            }
+            p += len;
+        }
+    }
+
+    int ttl = cache->ttl;
+    const char *cc = headers->getstr(headers, "Cache-Control", false);
+    if (cc) {
+        if (strcasestr(cc, "no-store") || strcasestr(cc, "no-cache") || strcasestr(cc, "private")) {
+            return 0;
+        }
+        const char *maxage = strcasestr(cc, "s-maxage=");
+        if (maxage) {
+            ttl = atoi(maxage + CONST_STRLEN("s-maxage="));
+        } else if ((maxage = strcasestr(cc, "max-age="))) {
+            ttl = atoi(maxage + CONST_STRLEN("max-age="));
+        }
+    }
+    return ttl;
+}
+
+/**
+ * Check if the handler compressed the response on the way out, by
+ * "http.compress". Such a body goes out in chunks and the copy is the
+ * compressed one.
+ */
+static bool cache_compressed(ad_http_t *http) {
+    qlisttbl_t *headers = http->response.headers;
+    return (http->response.contentlength >= 0
+            && ! headers->getstr(headers, "Content-Length", false)
+            && headers->getstr(headers, "Transfer-Encoding", false)
+            && headers->getstr(headers, "Content-Encoding", false));
+}
+
+static bool cache_vary(ad_http_cache_t *cache, const char *name) {
+    for (int i = 0; i < cache->nvary; i++) {
+        if (! strcasecmp(cache->vary[i], name)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Take the entry out of the cache. The cache's reference is left to the
+ * caller to drop.
+ */
+static void entry_unlink(ad_cache_shard_t *shard, ad_cache_entry_t *entry) {
+    shard->entries->remove(shard->entries, entry->key);
+    if (entry->filling) {
+        return;  // not in the list yet.
+    }
+    if (entry->prev) {
+        entry->prev->next = entry->next;
+    } else {
+        shard->head = entry->next;
+    }
+    if (entry->next) {
+        entry->next->prev = entry->prev;
+    } else {
+        shard->tail = entry->prev;
+    }
+    entry->prev = entry->next = NULL;
+    shard->bytes -= entry->size;
+}
+
+static void entry_unref(ad_cache_entry_t *entry) {
+    if (__atomic_sub_fetch(&entry->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        free(entry->key);
+        free(entry->head);
+        free(entry->body);
+        free(entry);
+    }
+}
+
+static void entry_unref_cb(const void *data, size_t datalen, void *extra) {
+    entry_unref((ad_cache_entry_t *)extra);
+}
+
+#endif // _DOXYGEN_SKIP
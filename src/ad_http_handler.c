@@ -34,22 +34,75 @@
 
 #include <stdbool.h>
 #include <stdlib.h>
+#include <stdio.h>
 #include <string.h>
 #include <strings.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <limits.h>
 #include <assert.h>
 #include <errno.h>
+#include <inttypes.h>
+#include <sys/mman.h>
+#include <zlib.h>
 #include <event2/buffer.h>
 #include "qlibc/qlibc.h"
 #include "ad_server.h"
 #include "ad_http_handler.h"
 #include "macro.h"
 
+/*
+ * Compressors are pooled per thread and reset for the next response, as
+ * setting one up costs more than compressing a small response.
+ */
+#define AD_HTTP_ZPOOL   (16)                    /* max idle compressors per thread */
+#define AD_HTTP_ZCHUNK  (16 * 1024)             /* max bytes in a compressed chunk */
+#define AD_HTTP_ZMEM    ((1 << 17) + (1 << 17)) /* memory of a compressor */
+#define AD_HTTP_ZWINDOW (256 * 1024)            /* max bytes of a file compressed at once */
+
+typedef struct ad_http_zstream_s ad_http_zstream_t;
+struct ad_http_zstream_s {
+    z_stream z;             /* must be the first */
+    int level;
+    int wbits;
+    ad_http_zstream_t *next;
+};
+
+/*
+ * Query strings, form bodies and cookies are parsed on first access into
+ * one block holding a copy of the text, decoded in place, and pointers to
+ * the names and values in it.
+ */
+typedef struct ad_http_kvlist_s ad_http_kvlist_t;
+struct ad_http_kvlist_s {
+    size_t size;            /* bytes of the block */
+    int num;
+    struct {
+        const char *name;
+        const char *value;
+    } kv[];
+};
+
+/*
+ * Per-request state of the HTTP modules, kept out of ad_http_t. Created
+ * when a module first stores something for the request.
+ */
+typedef struct ad_http_ext_s ad_http_ext_t;
+struct ad_http_ext_s {
+    void *userdata[AD_HTTP_NUM_USERDATA];
+    ad_userdata_free_cb userdata_free_cb[AD_HTTP_NUM_USERDATA];
+    struct evbuffer *tee;   /* gets a copy of the body. owned by the module */
+};
+
 #ifndef _DOXYGEN_SKIP
+static __thread ad_http_zstream_t *zpool = NULL;
+static __thread int zpoolsize = 0;
+
 static ad_http_t *http_new(struct evbuffer *out);
 static void http_free(ad_http_t *http);
 static void http_free_cb(ad_conn_t *conn, void *userdata);
+static ad_http_t *http_get(ad_conn_t *conn);
+static ad_http_ext_t *http_ext(ad_conn_t *conn);
 static size_t http_add_inbuf(struct evbuffer *buffer, ad_http_t *http,
                              size_t maxsize);
 
@@ -58,6 +111,22 @@ static int parse_requestline(ad_http_t *http, char *line);
 static int parse_headers(ad_http_t *http, struct evbuffer *in);
 static int parse_body(ad_http_t *http, struct evbuffer *in);
 static ssize_t parse_chunked_body(ad_http_t *http, struct evbuffer *in);
+static void parse_host(ad_http_t *http);
+
+static ad_http_kvlist_t *kvlist_new(ad_conn_t *conn, const char *str, struct evbuffer *buffer,
+                                     size_t len, char sep, bool decode);
+static const char *kvlist_get(ad_http_kvlist_t *list, const char *name);
+
+static bool spool_needed(ad_conn_t *conn, ad_http_t *http);
+static int spool_write(ad_conn_t *conn, ad_http_t *http);
+static int spool_open(const char *dir);
+
+static void compress_start(ad_conn_t *conn, ad_http_t *http);
+static int compress_data(ad_http_t *http, const void *data, size_t size, int flush);
+static void compress_end(ad_conn_t *conn, ad_http_t *http);
+static bool compress_type(const char *types, const char *contenttype);
+static ad_http_zstream_t *zstream_get(int level, int wbits);
+static void zstream_put(ad_http_zstream_t *zs);
 
 static bool isValidPathname(const char *path);
 static void correctPathname(char *path);
@@ -80,25 +149,102 @@ static ssize_t evbuffer_drainln(struct evbuffer *buffer, size_t *n_read_out,
  *   ad_server_t *server = ad_server_new();
  *   ad_server_register_hook(server, ad_http_handler, NULL);
  * @endcode
+ *
+ * Hooks are called once the request is complete. With "http.header_phase"
+ * option, if the body is still to come, they are also called when the
+ * headers are in with AD_HTTP_REQ_HEADER_DONE status. A hook can reject
+ * the request then, and for a request with "Expect: 100-continue" the body
+ * is not even sent; otherwise "100 Continue" goes out after the hooks. A
+ * hook can also set request.streaming to be called on every read of the
+ * body and take it out of the in-buffer as it arrives, like
+ * ad_http_multipart() does. A response sent before the request is
+ * complete closes the connection.
+ *
+ * @code
+ *   if (ad_http_get_status(conn) == AD_HTTP_REQ_HEADER_DONE) {
+ *       if (ad_http_get_content_length(conn) > MY_MAX_UPLOAD) {
+ *           ad_http_response(conn, HTTP_CODE_PAYLOAD_TOO_LARGE, "text/plain", "Too large\n", 10);
+ *           return AD_CLOSE;
+ *       }
+ *       return AD_OK;
+ *   }
+ * @endcode
  */
 int ad_http_handler(short event, ad_conn_t *conn, void *userdata) {
     if (event & AD_EVENT_INIT) {
+        // Request state is created on the first read, so idle keep-alive
+        // connections don't hold any.
         DEBUG("==> HTTP INIT");
-        ad_http_t *http = http_new(conn->out);
-        if (http == NULL)
-            return AD_CLOSE;
-        ad_conn_set_extra(conn, http, http_free_cb);
         return AD_OK;
     } else if (event & AD_EVENT_READ) {
         DEBUG("==> HTTP READ");
-        ad_http_t *http = (ad_http_t *) ad_conn_get_extra(conn);
+        ad_http_t *http = http_get(conn);
+        if (http == NULL)
+            return AD_CLOSE;
+        enum ad_http_request_status_e prev = http->request.status;
+        size_t headersize = http->request.headersize;
+        size_t bodyin = http->request.bodyin;
         int status = http_parser(http, conn->in);
+        ad_conn_track_mem(conn, http->request.headersize - headersize);
+
+        // Refuse new requests while the server is short of memory.
+        if (prev == AD_HTTP_REQ_INIT && conn->server->mem_pressure
+            && http->request.status != AD_HTTP_REQ_INIT
+            && http->request.status != AD_HTTP_ERROR) {
+            ad_http_set_response_header(conn, "Connection", "close");
+            ad_http_set_response_header(conn, "Retry-After", "1");
+            ad_http_response(conn, HTTP_CODE_SERVICE_UNAVAILABLE, "text/plain",
+                             "503 Service Unavailable\n", 24);
+            return AD_CLOSE;
+        }
         if (conn->method == NULL && http->request.method != NULL) {
             ad_conn_set_method(conn, http->request.method);
         }
+        if (http->request.status != AD_HTTP_REQ_INIT) {
+            conn->busy = true;
+        }
+
+        // Move a large body to a spool file once the hooks have seen the
+        // headers and none of them takes the body as it arrives.
+        if (http->request.spool.fd >= 0
+            || (prev == AD_HTTP_REQ_HEADER_DONE && ! (event & AD_EVENT_RESUME)
+                && (http->request.status == AD_HTTP_REQ_HEADER_DONE
+                    || http->request.status == AD_HTTP_REQ_DONE)
+                && spool_needed(conn, http))) {
+            if (spool_write(conn, http)) {
+                ad_http_response(conn, HTTP_CODE_INTERNAL_SERVER_ERROR, "text/plain",
+                                 "500 Internal Server Error\n", 26);
+                return AD_CLOSE;
+            }
+        }
+
+        // Let the hooks see the headers while the body is coming if asked.
+        // For a request waiting for 100 Continue, send it after the hooks
+        // unless one has responded.
+        if (http->request.status == AD_HTTP_REQ_HEADER_DONE) {
+            if (prev != AD_HTTP_REQ_HEADER_DONE || (event & AD_EVENT_RESUME)) {
+                if (http->request.expect) {
+                    bufferevent_trigger(conn->buffer, EV_WRITE,
+                                        BEV_TRIG_IGNORE_WATERMARKS | BEV_TRIG_DEFER_CALLBACKS);
+                }
+                if (ad_server_get_option_int(conn->server, "http.header_phase")) {
+                    return AD_OK;
+                }
+            } else if (http->request.streaming && http->request.bodyin != bodyin) {
+                return AD_OK;
+            }
+        }
         return status;
     } else if (event & AD_EVENT_WRITE) {
         DEBUG("==> HTTP WRITE");
+        ad_http_t *http = (ad_http_t *) ad_conn_get_extra(conn);
+        if (http && http->request.expect && ! http->response.frozen_header
+            && http->request.status == AD_HTTP_REQ_HEADER_DONE) {
+            evbuffer_add_printf(http->response.outbuf, "%s %d %s" HTTP_CRLF HTTP_CRLF,
+                                http->request.httpver, HTTP_CODE_CONTINUE,
+                                ad_http_get_reason(HTTP_CODE_CONTINUE));
+            http->request.expect = false;
+        }
         return AD_OK;
     } else if (event & AD_EVENT_CLOSE) {
         DEBUG("==> HTTP CLOSE=%x (TIMEOUT=%d, SHUTDOWN=%d)",
@@ -122,11 +268,15 @@ enum ad_http_request_status_e ad_http_get_status(ad_conn_t *conn) {
 
 struct evbuffer *ad_http_get_inbuf(ad_conn_t *conn) {
     ad_http_t *http = (ad_http_t *) ad_conn_get_extra(conn);
+    if (http == NULL)
+        return NULL;
     return http->request.inbuf;
 }
 
 struct evbuffer *ad_http_get_outbuf(ad_conn_t *conn) {
-    ad_http_t *http = (ad_http_t *) ad_conn_get_extra(conn);
+    ad_http_t *http = http_get(conn);
+    if (http == NULL)
+        return NULL;
     return http->response.outbuf;
 }
 
@@ -139,6 +289,8 @@ struct evbuffer *ad_http_get_outbuf(ad_conn_t *conn) {
  */
 const char *ad_http_get_request_header(ad_conn_t *conn, const char *name) {
     ad_http_t *http = (ad_http_t *) ad_conn_get_extra(conn);
+    if (http == NULL)
+        return NULL;
     return http->request.headers->getstr(http->request.headers, name, false);
 }
 
@@ -147,6 +299,8 @@ const char *ad_http_get_request_header(ad_conn_t *conn, const char *name) {
  */
 off_t ad_http_get_content_length(ad_conn_t *conn) {
     ad_http_t *http = (ad_http_t *) ad_conn_get_extra(conn);
+    if (http == NULL)
+        return 0;
     return http->request.contentlength;
 }
 
@@ -156,7 +310,10 @@ off_t ad_http_get_content_length(ad_conn_t *conn) {
  */
 size_t ad_http_get_content_length_stored(ad_conn_t *conn) {
     ad_http_t *http = (ad_http_t *) ad_conn_get_extra(conn);
-    return evbuffer_get_length(http->request.inbuf);
+    if (http == NULL)
+        return 0;
+    return evbuffer_get_length(http->request.inbuf)
+           + (http->request.spool.size - http->request.spool.off);
 }
 
 /**
@@ -166,11 +323,44 @@ size_t ad_http_get_content_length_stored(ad_conn_t *conn) {
  * if it reads 3 bytes, it will allocate 4 bytes and the 4th byte will
  * be set to null terminator. `storedsized` will still return 3.
  *
+ * A spooled body is read from the spool file. Consider
+ * ad_http_get_content_map() for it instead of copying.
+ *
  * @param maxsize maximum length of data to read. 0 to read everything.
  * @param storedsize the size of data read and stored in the return.
  */
 void *ad_http_get_content(ad_conn_t *conn, size_t maxsize, size_t *storedsize) {
     ad_http_t *http = (ad_http_t *) ad_conn_get_extra(conn);
+    if (http == NULL)
+        return NULL;
+
+    if (http->request.spool.fd >= 0) {
+        size_t spoollen = http->request.spool.size - http->request.spool.off;
+        size_t readlen = (maxsize == 0 || spoollen < maxsize) ? spoollen : maxsize;
+        if (readlen == 0)
+            return NULL;
+
+        char *data = malloc(readlen + 1);
+        if (data == NULL)
+            return NULL;
+
+        size_t done = 0;
+        while (done < readlen) {
+            ssize_t n = pread(http->request.spool.fd, data + done, readlen - done,
+                              http->request.spool.off + done);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                break;
+            done += n;
+        }
+        http->request.spool.off += done;
+        data[done] = '\0';
+        if (storedsize)
+            *storedsize = done;
+
+        return data;
+    }
 
     size_t inbuflen = evbuffer_get_length(http->request.inbuf);
     size_t readlen =
@@ -191,6 +381,142 @@ void *ad_http_get_content(ad_conn_t *conn, size_t maxsize, size_t *storedsize) {
     return data;
 }
 
+/**
+ * Return the file descriptor of the spooled body.
+ *
+ * The body of a request larger than "http.spool_size" is kept in an
+ * unlinked file instead of the in-buffer. The descriptor belongs to the
+ * request and is closed with it. dup() it to keep it longer, for example
+ * to send it on with evbuffer_file_segment_new() or splice().
+ *
+ * @return file descriptor if the body is spooled, otherwise -1.
+ */
+int ad_http_get_content_fd(ad_conn_t *conn) {
+    ad_http_t *http = (ad_http_t *) ad_conn_get_extra(conn);
+    if (http == NULL)
+        return -1;
+    return http->request.spool.fd;
+}
+
+/**
+ * Map the spooled body to memory, read-only.
+ *
+ * The mapping is made once and stays until the end of the request.
+ *
+ * @param size the size of the body.
+ *
+ * @return a pointer to the body if it's spooled, otherwise NULL.
+ */
+const void *ad_http_get_content_map(ad_conn_t *conn, size_t *size) {
+    ad_http_t *http = (ad_http_t *) ad_conn_get_extra(conn);
+    if (http == NULL)
+        return NULL;
+    if (http->request.spool.fd < 0 || http->request.spool.size == 0) {
+        return NULL;
+    }
+    if (http->request.spool.map == NULL) {
+        void *map = mmap(NULL, http->request.spool.size, PROT_READ, MAP_SHARED,
+                         http->request.spool.fd, 0);
+        if (map == MAP_FAILED) {
+            WARN("Failed to map the spooled body. (size:%jd, errno:%d)",
+                 (intmax_t)http->request.spool.size, errno);
+            return NULL;
+        }
+        http->request.spool.map = map;
+        http->request.spool.maplen = http->request.spool.size;
+    }
+    if (size)
+        *size = http->request.spool.maplen;
+    return http->request.spool.map;
+}
+
+/**
+ * Return a parameter of the query string, URL decoded.
+ *
+ * The query string is parsed on the first call. The first one is returned
+ * if the parameter is repeated.
+ *
+ * @code
+ *   // GET /search?q=hello%20world&page=2
+ *   const char *q = ad_http_get_query_param(conn, "q");  // hello world
+ * @endcode
+ *
+ * @return value of the parameter, "" if it has no value, NULL if not found.
+ */
+const char *ad_http_get_query_param(ad_conn_t *conn, const char *name) {
+    ad_http_t *http = (ad_http_t *) ad_conn_get_extra(conn);
+    if (http == NULL)
+        return NULL;
+    if (http->request.queryparams == NULL) {
+        if (http->request.query == NULL) {
+            return NULL;
+        }
+        http->request.queryparams = kvlist_new(conn, http->request.query, NULL,
+                                               strlen(http->request.query), '&', true);
+        if (http->request.queryparams == NULL) {
+            return NULL;
+        }
+    }
+    return kvlist_get(http->request.queryparams, name);
+}
+
+/**
+ * Return a parameter of an application/x-www-form-urlencoded body, URL
+ * decoded.
+ *
+ * The body is parsed on the first call once the request is complete, and
+ * is left in the in-buffer.
+ *
+ * @return value of the parameter, "" if it has no value, NULL if not found.
+ */
+const char *ad_http_get_form_param(ad_conn_t *conn, const char *name) {
+    ad_http_t *http = (ad_http_t *) ad_conn_get_extra(conn);
+    if (http == NULL)
+        return NULL;
+    if (http->request.formparams == NULL) {
+        const char *contenttype = ad_http_get_request_header(conn, "Content-Type");
+        if (http->request.status != AD_HTTP_REQ_DONE || contenttype == NULL
+            || strncasecmp(contenttype, "application/x-www-form-urlencoded", 33)) {
+            return NULL;
+        }
+        size_t len = 0;
+        const char *body = ad_http_get_content_map(conn, &len);
+        if (body == NULL) {
+            len = evbuffer_get_length(http->request.inbuf);
+        }
+        http->request.formparams = kvlist_new(conn, body, http->request.inbuf, len, '&', true);
+        if (http->request.formparams == NULL) {
+            return NULL;
+        }
+    }
+    return kvlist_get(http->request.formparams, name);
+}
+
+/**
+ * Return a cookie of the request.
+ *
+ * The Cookie header is parsed on the first call. Values are returned as
+ * sent, without the double quotes around them if any.
+ *
+ * @return value of the cookie, NULL if not found.
+ */
+const char *ad_http_get_cookie(ad_conn_t *conn, const char *name) {
+    ad_http_t *http = (ad_http_t *) ad_conn_get_extra(conn);
+    if (http == NULL)
+        return NULL;
+    if (http->request.cookies == NULL) {
+        const char *cookie = ad_http_get_request_header(conn, "Cookie");
+        if (cookie == NULL) {
+            return NULL;
+        }
+        http->request.cookies = kvlist_new(conn, cookie, NULL, strlen(cookie), ';', false);
+        if (http->request.cookies == NULL) {
+            return NULL;
+        }
+    }
+    return kvlist_get(http->request.cookies, name);
+}
+
 /**
  * Return whether the request is keep-alive request or not.
  *
@@ -198,6 +524,8 @@ void *ad_http_get_content(ad_conn_t *conn, size_t maxsize, size_t *storedsize) {
  */
 int ad_http_is_keepalive_request(ad_conn_t *conn) {
     ad_http_t *http = (ad_http_t *) ad_conn_get_extra(conn);
+    if (http == NULL)
+        return 0;
     if (http->request.httpver == NULL) {
         return 0;
     }
@@ -220,6 +548,67 @@ int ad_http_is_keepalive_request(ad_conn_t *conn) {
     }
 }
 
+/**
+ * Check if the client accepts the content-coding.
+ *
+ * @param coding content-coding ex) "gzip"
+ *
+ * @return 1 if the coding is in Accept-Encoding header with non-zero
+ *         q-value, otherwise 0.
+ */
+int ad_http_accepts_encoding(ad_conn_t *conn, const char *coding) {
+    const char *accept = ad_http_get_request_header(conn, "Accept-Encoding");
+    if (accept == NULL) {
+        return 0;
+    }
+    size_t len = strlen(coding);
+    for (const char *p = accept; *p; ) {
+        p += strspn(p, " \t,");
+        size_t toklen = strcspn(p, " \t,;");
+        if (toklen == len && ! strncasecmp(p, coding, len)) {
+            const char *end = p + strcspn(p, ",");
+            const char *q = strstr(p, "q=");
+            return (q == NULL || q > end || strtod(q + 2, NULL) > 0);
+        }
+        p += strcspn(p, ",");
+    }
+    return 0;
+}
+
+/**
+ * Check If-None-Match header of the request against the entity tag, with
+ * weak comparison.
+ *
+ * @param etag entity tag ex) "\"5e8f1a2b\""
+ *
+ * @return 1 if it matches, otherwise 0.
+ */
+int ad_http_match_etag(ad_conn_t *conn, const char *etag) {
+    const char *list = ad_http_get_request_header(conn, "If-None-Match");
+    if (list == NULL || etag == NULL) {
+        return 0;
+    }
+    if (! strncmp(etag, "W/", 2)) {
+        etag += 2;
+    }
+    size_t len = strlen(etag);
+    for (const char *p = list; *p; ) {
+        p += strspn(p, " \t,");
+        if (*p == '*') {
+            return 1;
+        }
+        if (! strncmp(p, "W/", 2)) {
+            p += 2;
+        }
+        size_t toklen = strcspn(p, " \t,");
+        if (toklen == len && ! strncmp(p, etag, len)) {
+            return 1;
+        }
+        p += toklen;
+    }
+    return 0;
+}
+
 /**
  * Set response header.
  *
@@ -230,7 +619,9 @@ int ad_http_is_keepalive_request(ad_conn_t *conn) {
  */
 int ad_http_set_response_header(ad_conn_t *conn, const char *name,
                                 const char *value) {
-    ad_http_t *http = (ad_http_t *) ad_conn_get_extra(conn);
+    ad_http_t *http = http_get(conn);
+    if (http == NULL)
+        return -1;
     if (http->response.frozen_header) {
         return -1;
     }
@@ -252,7 +643,9 @@ int ad_http_set_response_header(ad_conn_t *conn, const char *name,
  * @return value of string if found, otherwise NULL.
  */
 const char *ad_http_get_response_header(ad_conn_t *conn, const char *name) {
-    ad_http_t *http = (ad_http_t *) ad_conn_get_extra(conn);
+    ad_http_t *http = http_get(conn);
+    if (http == NULL)
+        return NULL;
     return http->response.headers->getstr(http->response.headers, name, false);
 }
 
@@ -261,7 +654,9 @@ const char *ad_http_get_response_header(ad_conn_t *conn, const char *name) {
  * @return 0 on success, -1 if we already sent it out.
  */
 int ad_http_set_response_code(ad_conn_t *conn, int code, const char *reason) {
-    ad_http_t *http = (ad_http_t *) ad_conn_get_extra(conn);
+    ad_http_t *http = http_get(conn);
+    if (http == NULL)
+        return -1;
     if (http->response.frozen_header) {
         return -1;
     }
@@ -280,7 +675,9 @@ int ad_http_set_response_code(ad_conn_t *conn, int code, const char *reason) {
  */
 int ad_http_set_response_content(ad_conn_t *conn, const char *contenttype,
                                  off_t size) {
-    ad_http_t *http = (ad_http_t *) ad_conn_get_extra(conn);
+    ad_http_t *http = http_get(conn);
+    if (http == NULL)
+        return -1;
     if (http->response.frozen_header) {
         return -1;
     }
@@ -304,10 +701,17 @@ int ad_http_set_response_content(ad_conn_t *conn, const char *contenttype,
 
 /**
  * @return total bytes sent, 0 on error.
+ *
+ * @note
+ *   With "http.etag" option, a 200 response to GET or HEAD gets an ETag
+ *   made from the hash of the data unless it has one already, and it
+ *   turns into a 304 without body if the request's If-None-Match matches.
  */
 size_t ad_http_response(ad_conn_t *conn, int code, const char *contenttype,
                         const void *data, off_t size) {
-    ad_http_t *http = (ad_http_t *) ad_conn_get_extra(conn);
+    ad_http_t *http = http_get(conn);
+    if (http == NULL)
+        return 0;
     if (http->response.frozen_header) {
         return 0;
     }
@@ -316,7 +720,25 @@ size_t ad_http_response(ad_conn_t *conn, int code, const char *contenttype,
     if (ad_http_get_response_header(conn, "Connection") == NULL) {
         ad_http_set_response_header(
                 conn, "Connection",
-                (ad_http_is_keepalive_request(conn)) ? "Keep-Alive" : "close");
+                (ad_http_is_keepalive_request(conn) && !conn->server->draining) ?
+                        "Keep-Alive" : "close");
+    }
+
+    if (code == HTTP_CODE_OK && data != NULL
+        && ad_server_get_option_int(conn->server, "http.etag")
+        && http->request.method
+        && (! strcmp(http->request.method, "GET") || ! strcmp(http->request.method, "HEAD"))
+        && ad_http_get_response_header(conn, "ETag") == NULL) {
+        uint64_t hash[2];
+        char etag[2 + 16 + 1];
+        qhashmurmur3_128(data, size, hash);
+        snprintf(etag, sizeof(etag), "\"%016" PRIx64 "\"", hash[0]);
+        ad_http_set_response_header(conn, "ETag", etag);
+        if (ad_http_match_etag(conn, etag)) {
+            ad_http_set_response_code(conn, HTTP_CODE_NOT_MODIFIED,
+                                      ad_http_get_reason(HTTP_CODE_NOT_MODIFIED));
+            return ad_http_send_header(conn);
+        }
     }
 
     ad_http_set_response_code(conn, code, ad_http_get_reason(code));
@@ -329,10 +751,20 @@ size_t ad_http_response(ad_conn_t *conn, int code, const char *contenttype,
  * @return 0 total bytes put in out buffer, -1 if we already sent it out.
  */
 size_t ad_http_send_header(ad_conn_t *conn) {
-    ad_http_t *http = (ad_http_t *) ad_conn_get_extra(conn);
+    ad_http_t *http = http_get(conn);
+    if (http == NULL)
+        return 0;
     if (http->response.frozen_header) {
         return 0;
     }
+    if (http->request.status != AD_HTTP_REQ_DONE) {
+        // Answered before the whole request is in, so what comes next is
+        // not a new request. Close after the response, even if the hook
+        // returns AD_DONE; conn_cb() doesn't lower AD_CLOSE.
+        ad_http_set_response_header(conn, "Connection", "close");
+        conn->status = AD_CLOSE;
+    }
+    compress_start(conn, http);
     http->response.frozen_header = true;
 
     // Send status line.
@@ -363,9 +795,16 @@ size_t ad_http_send_header(ad_conn_t *conn) {
 /**
  *
  * @return 0 on success, -1 if we already sent it out.
+ *
+ * @note
+ *   When the response is compressed, the data is compressed as it comes
+ *   and sent out in chunks. It returns the size of the data taken then,
+ *   as the compressor may hold the data until the next call.
  */
 size_t ad_http_send_data(ad_conn_t *conn, const void *data, size_t size) {
-    ad_http_t *http = (ad_http_t *) ad_conn_get_extra(conn);
+    ad_http_t *http = http_get(conn);
+    if (http == NULL)
+        return 0;
 
     if (http->response.contentlength < 0) {
         WARN("Content-Length is not set. Invalid usage.");
@@ -382,17 +821,127 @@ size_t ad_http_send_data(ad_conn_t *conn, const void *data, size_t size) {
         ad_http_send_header(conn);
     }
 
+    if (http->response.zstream) {
+        bool last = (http->response.bodyout + size == http->response.contentlength);
+        if (compress_data(http, data, (data) ? size : 0, (last) ? Z_FINISH : Z_NO_FLUSH))
+            return 0;
+        if (last)
+            compress_end(conn, http);
+        http->response.bodyout += size;
+        return size;
+    }
+
     if (data != NULL && size > 0) {
         if (evbuffer_add(http->response.outbuf, data, size))
             return 0;
+        if (http->ext && http->ext->tee)
+            evbuffer_add(http->ext->tee, data, size);
     }
 
     http->response.bodyout += size;
     return (evbuffer_get_length(http->response.outbuf) - beforesize);
 }
 
+/**
+ * Send a part of a file as response body.
+ *
+ * The file is not copied. On a plain connection the kernel sends it
+ * straight from the page cache with sendfile(), on SSL it is mapped.
+ * Content-Length must be set beforehand just like ad_http_send_data().
+ *
+ * @param seg file segment to send from. The connection takes its own
+ *        reference, so the caller can free it right after.
+ * @param offset offset in the segment.
+ * @param length bytes to send.
+ *
+ * @return total bytes put in out buffer, 0 on error.
+ *
+ * @code
+ *   int fd = open(path, O_RDONLY);
+ *   struct evbuffer_file_segment *seg;
+ *   seg = evbuffer_file_segment_new(fd, 0, -1, EVBUF_FS_CLOSE_ON_FREE);
+ *   ad_http_set_response_code(conn, HTTP_CODE_OK, NULL);
+ *   ad_http_set_response_content(conn, "text/html", filesize);
+ *   ad_http_send_file(conn, seg, 0, filesize);
+ *   evbuffer_file_segment_free(seg);
+ * @endcode
+ *
+ * @note
+ *   Bytes queued from the file count against "server.mem_limit" until
+ *   they are sent, the same as any other response data.
+ */
+size_t ad_http_send_file(ad_conn_t *conn, struct evbuffer_file_segment *seg,
+                         off_t offset, off_t length) {
+    ad_http_t *http = http_get(conn);
+    if (http == NULL)
+        return 0;
+
+    if (http->response.contentlength < 0) {
+        WARN("Content-Length is not set. Invalid usage.");
+        return 0;
+    }
+
+    if ((http->response.bodyout + length) > http->response.contentlength) {
+        WARN("Trying to send more data than supposed to");
+        return 0;
+    }
+
+    size_t beforesize = evbuffer_get_length(http->response.outbuf);
+    if (!http->response.frozen_header) {
+        ad_http_send_header(conn);
+    }
+
+    if (http->response.zstream) {
+        // Compress the file where it's mapped, a window at a time, instead
+        // of pulling it up into one block.
+        bool last = (http->response.bodyout + length == http->response.contentlength);
+        struct evbuffer *file = evbuffer_new();
+        if (file == NULL || (length > 0 && evbuffer_add_file_segment(file, seg, offset, length))) {
+            if (file)
+                evbuffer_free(file);
+            return 0;
+        }
+        struct evbuffer_ptr ptr;
+        evbuffer_ptr_set(file, &ptr, 0, EVBUFFER_PTR_SET);
+        off_t done = 0;
+        do {
+            struct evbuffer_iovec vec = { NULL, 0 };
+            size_t window = (length - done < AD_HTTP_ZWINDOW) ? length - done : AD_HTTP_ZWINDOW;
+            if (window > 0 && (evbuffer_peek(file, window, &ptr, &vec, 1) < 1 || vec.iov_len == 0)) {
+                break;
+            }
+            size_t len = (vec.iov_len < window) ? vec.iov_len : window;
+            bool end = (done + len == length);
+            if (compress_data(http, vec.iov_base, len, (last && end) ? Z_FINISH : Z_NO_FLUSH)) {
+                break;
+            }
+            done += len;
+            evbuffer_ptr_set(file, &ptr, len, EVBUFFER_PTR_ADD);
+        } while (done < length);
+        evbuffer_free(file);
+        if (done < length)
+            return 0;
+        if (last)
+            compress_end(conn, http);
+        http->response.bodyout += length;
+        return length;
+    }
+
+    if (length > 0) {
+        if (evbuffer_add_file_segment(http->response.outbuf, seg, offset, length))
+            return 0;
+        if (http->ext && http->ext->tee)
+            evbuffer_add_file_segment(http->ext->tee, seg, offset, length);
+    }
+
+    http->response.bodyout += length;
+    return (evbuffer_get_length(http->response.outbuf) - beforesize);
+}
+
 size_t ad_http_send_chunk(ad_conn_t *conn, const void *data, size_t size) {
-    ad_http_t *http = (ad_http_t *) ad_conn_get_extra(conn);
+    ad_http_t *http = http_get(conn);
+    if (http == NULL)
+        return 0;
 
     if (http->response.contentlength >= 0) {
         WARN("Content-Length is set. Invalid usage.");
@@ -404,6 +953,19 @@ size_t ad_http_send_chunk(ad_conn_t *conn, const void *data, size_t size) {
     }
 
     size_t beforesize = evbuffer_get_length(http->response.outbuf);
+    if (http->response.zstream) {
+        // Flush each chunk so it reaches the client as a whole.
+        if (compress_data(http, data, size, (size > 0) ? Z_SYNC_FLUSH : Z_FINISH)) {
+            WARN("Failed to compress data. (size:%jd)", size);
+            return 0;
+        }
+        if (size == 0)
+            compress_end(conn, http);
+        size_t bytesout = evbuffer_get_length(http->response.outbuf) - beforesize;
+        http->response.bodyout += bytesout;
+        return bytesout;
+    }
+
     int status = 0;
     if (size > 0) {
         status += evbuffer_add_printf(http->response.outbuf, "%zu" HTTP_CRLF,
@@ -457,8 +1019,12 @@ const char *ad_http_get_reason(int code) {
             return "Request Time Out";
         case HTTP_CODE_GONE:
             return "Gone";
+        case HTTP_CODE_PAYLOAD_TOO_LARGE:
+            return "Payload Too Large";
         case HTTP_CODE_REQUEST_URI_TOO_LONG:
             return "Request URI Too Long";
+        case HTTP_CODE_RANGE_NOT_SATISFIABLE:
+            return "Range Not Satisfiable";
         case HTTP_CODE_LOCKED:
             return "Locked";
         case HTTP_CODE_INTERNAL_SERVER_ERROR:
@@ -473,6 +1039,53 @@ const char *ad_http_get_reason(int code) {
     return "-";
 }
 
+/**
+ * Attach module state to the request. It's released with free_cb at the
+ * end of the request, in the order of the index.
+ *
+ * @param index one of AD_HTTP_USERDATA_*.
+ *
+ * @return 0 if successful, otherwise -1.
+ *
+ * @note for the HTTP modules. Users keep theirs by ad_conn_set_userdata().
+ */
+int ad_http_set_userdata(ad_conn_t *conn, int index, const void *userdata,
+                         ad_userdata_free_cb free_cb) {
+    ad_http_ext_t *ext = http_ext(conn);
+    if (ext == NULL)
+        return -1;
+
+    ext->userdata[index] = (void *)userdata;
+    ext->userdata_free_cb[index] = free_cb;
+    return 0;
+}
+
+/**
+ * Get module state attached to the request.
+ */
+void *ad_http_get_userdata(ad_conn_t *conn, int index) {
+    ad_http_t *http = (ad_http_t *) ad_conn_get_extra(conn);
+    if (http == NULL || http->ext == NULL)
+        return NULL;
+    return http->ext->userdata[index];
+}
+
+/**
+ * Have the response body sent by ad_http_send_data() and ad_http_send_file()
+ * copied to the buffer. A compressed body is copied as compressed, without
+ * the chunk framing. The caller keeps the ownership. NULL to stop.
+ *
+ * @return 0 if successful, otherwise -1.
+ */
+int ad_http_set_tee(ad_conn_t *conn, struct evbuffer *tee) {
+    ad_http_ext_t *ext = http_ext(conn);
+    if (ext == NULL)
+        return -1;
+
+    ext->tee = tee;
+    return 0;
+}
+
 /******************************************************************************
  * Private internal functions.
  *****************************************************************************/
@@ -499,6 +1112,7 @@ static ad_http_t *http_new(struct evbuffer *out) {
     // Initialize structure.
     http->request.status = AD_HTTP_REQ_INIT;
     http->request.contentlength = -1;
+    http->request.spool.fd = -1;
     http->response.contentlength = -1;
     http->response.outbuf = out;
 
@@ -526,18 +1140,74 @@ static void http_free(ad_http_t *http) {
             free(http->request.host);
         if (http->request.domain)
             free(http->request.domain);
+        if (http->request.spool.map)
+            munmap(http->request.spool.map, http->request.spool.maplen);
+        if (http->request.spool.fd >= 0)
+            close(http->request.spool.fd);
+        free(http->request.queryparams);
+        free(http->request.formparams);
+        free(http->request.cookies);
 
         if (http->response.headers)
             http->response.headers->free(http->response.headers);
         if (http->response.reason)
             free(http->response.reason);
+        free(http->ext);
 
         free(http);
     }
 }
 
 static void http_free_cb(ad_conn_t *conn, void *userdata) {
-    http_free((ad_http_t *) userdata);
+    ad_http_t *http = (ad_http_t *) userdata;
+    if (http->ext) {
+        for (int i = 0; i < AD_HTTP_NUM_USERDATA; i++) {
+            if (http->ext->userdata[i] && http->ext->userdata_free_cb[i]) {
+                http->ext->userdata_free_cb[i](conn, http->ext->userdata[i]);
+            }
+        }
+        ad_conn_track_mem(conn, -(ssize_t)sizeof(ad_http_ext_t));
+    }
+    compress_end(conn, http);
+    ad_http_kvlist_t *lists[] = { http->request.queryparams, http->request.formparams,
+                                  http->request.cookies };
+    for (int i = 0; i < 3; i++) {
+        if (lists[i]) {
+            ad_conn_track_mem(conn, -(ssize_t)lists[i]->size);
+        }
+    }
+    ad_conn_track_mem(conn, -(ssize_t)(sizeof(ad_http_t) + http->request.headersize));
+    evbuffer_drain(http->request.inbuf, evbuffer_get_length(http->request.inbuf));
+    http_free(http);
+}
+
+/**
+ * Return the request state of the connection, create it if there's none.
+ */
+static ad_http_t *http_get(ad_conn_t *conn) {
+    ad_http_t *http = (ad_http_t *) ad_conn_get_extra(conn);
+    if (http == NULL) {
+        http = http_new(conn->out);
+        if (http == NULL)
+            return NULL;
+        ad_conn_set_extra(conn, http, http_free_cb);
+        ad_conn_track_buffer(conn, http->request.inbuf);
+        ad_conn_track_mem(conn, sizeof(ad_http_t));
+    }
+    return http;
+}
+
+static ad_http_ext_t *http_ext(ad_conn_t *conn) {
+    ad_http_t *http = http_get(conn);
+    if (http == NULL)
+        return NULL;
+    if (http->ext == NULL) {
+        http->ext = NEW_OBJECT(ad_http_ext_t);
+        if (http->ext == NULL)
+            return NULL;
+        ad_conn_track_mem(conn, sizeof(ad_http_ext_t));
+    }
+    return http->ext;
 }
 
 static size_t http_add_inbuf(struct evbuffer *buffer, ad_http_t *http,
@@ -556,6 +1226,7 @@ static int http_parser(ad_http_t *http, struct evbuffer *in) {
         char *line = evbuffer_readln(in, NULL, EVBUFFER_EOL_CRLF);
         if (line == NULL)
             return http->request.status;
+        http->request.headersize += strlen(line);
         http->request.status = parse_requestline(http, line);
         free(line);
         // Do not call user callbacks until I reach the next state.
@@ -665,10 +1336,16 @@ static int parse_requestline(ad_http_t *http, char *line) {
 static int parse_headers(ad_http_t *http, struct evbuffer *in) {
     char *line;
     while ((line = evbuffer_readln(in, NULL, EVBUFFER_EOL_CRLF))) {
+        http->request.headersize += strlen(line);
         if (IS_EMPTY_STR(line)) {
             const char *clen = http->request.headers->getstr(
                     http->request.headers, "Content-Length", false);
             http->request.contentlength = (clen) ? atol(clen) : -1;
+            const char *expect = http->request.headers->getstr(
+                    http->request.headers, "Expect", false);
+            http->request.expect = (expect && ! strcasecmp(expect, "100-continue")
+                                    && ! strcmp(http->request.httpver, HTTP_PROTOCOL_11));
+            parse_host(http);
             free(line);
             return AD_HTTP_REQ_HEADER_DONE;
         }
@@ -732,6 +1409,206 @@ static int parse_body(ad_http_t *http, struct evbuffer *in) {
     return http->request.status;
 }
 
+/**
+ * Set host and domain from Host header. Both are lowercased and the
+ * domain has no port number nor trailing dot.
+ */
+static void parse_host(ad_http_t *http) {
+    const char *host = http->request.headers->getstr(http->request.headers, "Host", false);
+    if (host == NULL || IS_EMPTY_STR(host)) {
+        return;
+    }
+    http->request.host = qstrlower(strdup(host));
+    http->request.domain = strdup(http->request.host);
+    if (http->request.host == NULL || http->request.domain == NULL) {
+        return;
+    }
+
+    // Strip port number. ex) www.domain.com:8080, [::1]:8080
+    char *domain = http->request.domain;
+    char *port = (domain[0] == '[') ? strchr(domain, ']') : domain;
+    if (port && (port = strchr(port, ':'))) {
+        *port = '\0';
+    }
+    size_t len = strlen(domain);
+    if (len > 0 && domain[len - 1] == '.') {
+        domain[len - 1] = '\0';
+    }
+}
+
+/**
+ * Set up compression of the response body if the client and the options
+ * allow it. Called right before the headers go out.
+ */
+static void compress_start(ad_conn_t *conn, ad_http_t *http) {
+    if (! ad_server_get_option_int(conn->server, "http.compress")) {
+        return;
+    }
+
+    // Compress only bodies we can send in chunks.
+    int code = http->response.code;
+    off_t size = http->response.contentlength;
+    if (code < HTTP_CODE_OK || code == HTTP_CODE_NO_CONTENT
+        || code == HTTP_CODE_PARTIAL_CONTENT || code == HTTP_CODE_NOT_MODIFIED
+        || ! http->request.httpver || strcmp(http->request.httpver, HTTP_PROTOCOL_11)
+        || ! http->request.method || ! strcmp(http->request.method, "HEAD") || size == 0
+        || (size > 0 && size < ad_server_get_option_int(conn->server, "http.compress_min_size"))
+        || ad_http_get_response_header(conn, "Content-Encoding")
+        || ! compress_type(ad_server_get_option(conn->server, "http.compress_types"),
+                           ad_http_get_response_header(conn, "Content-Type"))) {
+        return;
+    }
+
+    const char *coding;
+    int wbits;
+    if (ad_http_accepts_encoding(conn, "gzip")) {
+        coding = "gzip";
+        wbits = MAX_WBITS + 16;
+    } else if (ad_http_accepts_encoding(conn, "deflate")) {
+        coding = "deflate";
+        wbits = MAX_WBITS;
+    } else {
+        return;
+    }
+    int level = ad_server_get_option_int(conn->server, "http.compress_level");
+    ad_http_zstream_t *zs = zstream_get(level, wbits);
+    if (zs == NULL) {
+        return;
+    }
+    http->response.zstream = &zs->z;
+    ad_conn_track_mem(conn, AD_HTTP_ZMEM);
+
+    qlisttbl_t *headers = http->response.headers;
+    headers->remove(headers, "Content-Length");
+    headers->putstr(headers, "Transfer-Encoding", "chunked");
+    headers->putstr(headers, "Content-Encoding", coding);
+    const char *vary = headers->getstr(headers, "Vary", false);
+    if (vary == NULL) {
+        headers->putstr(headers, "Vary", "Accept-Encoding");
+    } else if (! strcasestr(vary, "Accept-Encoding")) {
+        char *value = qstrdupf("%s, Accept-Encoding", vary);
+        if (value) {
+            headers->putstr(headers, "Vary", value);
+            free(value);
+        }
+    }
+    // The compressed body is not byte for byte the same any more.
+    const char *etag = headers->getstr(headers, "ETag", false);
+    if (etag && etag[0] == '"') {
+        char *value = qstrdupf("W/%s", etag);
+        if (value) {
+            headers->putstr(headers, "ETag", value);
+            free(value);
+        }
+    }
+}
+
+/**
+ * Compress data and add it to the out-buffer in chunks.
+ *
+ * @param flush Z_NO_FLUSH, Z_SYNC_FLUSH to send out what's given so far,
+ *        or Z_FINISH to end the body.
+ *
+ * @return 0 on success, otherwise -1.
+ */
+static int compress_data(ad_http_t *http, const void *data, size_t size, int flush) {
+    z_stream *z = (z_stream *) http->response.zstream;
+    struct evbuffer *out = http->response.outbuf;
+    unsigned char buf[AD_HTTP_ZCHUNK];
+
+    z->next_in = (Bytef *) data;
+    z->avail_in = size;
+    do {
+        z->next_out = buf;
+        z->avail_out = sizeof(buf);
+        if (deflate(z, flush) == Z_STREAM_ERROR) {
+            return -1;
+        }
+        size_t len = sizeof(buf) - z->avail_out;
+        if (len > 0) {
+            evbuffer_add_printf(out, "%zx" HTTP_CRLF, len);
+            evbuffer_add(out, buf, len);
+            evbuffer_add(out, HTTP_CRLF, CONST_STRLEN(HTTP_CRLF));
+            if (http->ext && http->ext->tee)
+                evbuffer_add(http->ext->tee, buf, len);
+        }
+    } while (z->avail_out == 0);
+
+    if (flush == Z_FINISH) {
+        evbuffer_add_printf(out, "0" HTTP_CRLF HTTP_CRLF);
+    }
+    return 0;
+}
+
+/**
+ * Give the compressor back to the pool.
+ */
+static void compress_end(ad_conn_t *conn, ad_http_t *http) {
+    if (http->response.zstream) {
+        zstream_put((ad_http_zstream_t *) http->response.zstream);
+        http->response.zstream = NULL;
+        ad_conn_track_mem(conn, -AD_HTTP_ZMEM);
+    }
+}
+
+/**
+ * Check the content type against the list.
+ *
+ * @param types comma separated types. Ones ending with '/' match all the
+ *        subtypes ex) "text/,application/json"
+ */
+static bool compress_type(const char *types, const char *contenttype) {
+    if (types == NULL || contenttype == NULL) {
+        return false;
+    }
+    size_t typelen = strcspn(contenttype, " \t;");
+    for (const char *p = types; *p; ) {
+        p += strspn(p, " \t,");
+        size_t len = strcspn(p, " \t,");
+        if (len > 0 && ((p[len - 1] == '/') ? len <= typelen : len == typelen)
+            && ! strncasecmp(p, contenttype, len)) {
+            return true;
+        }
+        p += len;
+    }
+    return false;
+}
+
+static ad_http_zstream_t *zstream_get(int level, int wbits) {
+    for (ad_http_zstream_t **zs = &zpool; *zs; zs = &(*zs)->next) {
+        if ((*zs)->level == level && (*zs)->wbits == wbits) {
+            ad_http_zstream_t *found = *zs;
+            *zs = found->next;
+            zpoolsize--;
+            return found;
+        }
+    }
+
+    ad_http_zstream_t *zs = NEW_OBJECT(ad_http_zstream_t);
+    if (zs == NULL) {
+        return NULL;
+    }
+    if (deflateInit2(&zs->z, level, Z_DEFLATED, wbits, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        WARN("Failed to initialize compressor. (level:%d)", level);
+        free(zs);
+        return NULL;
+    }
+    zs->level = level;
+    zs->wbits = wbits;
+    return zs;
+}
+
+static void zstream_put(ad_http_zstream_t *zs) {
+    if (zpoolsize >= AD_HTTP_ZPOOL || deflateReset(&zs->z) != Z_OK) {
+        deflateEnd(&zs->z);
+        free(zs);
+        return;
+    }
+    zs->next = zpool;
+    zpool = zs;
+    zpoolsize++;
+}
+
 /**
  * Parse chunked body and append it to inbuf.
  *
@@ -761,12 +1638,161 @@ static ssize_t parse_chunked_body(ad_http_t *http, struct evbuffer *in) {
 
     // Copy chunk body
     evbuffer_drainln(in, NULL, EVBUFFER_EOL_CRLF);
-    http_add_inbuf(in, http, chunksize);
+    http->request.bodyin += http_add_inbuf(in, http, chunksize);
     evbuffer_drainln(in, NULL, EVBUFFER_EOL_CRLF);
 
     return chunksize;
 }
 
+/**
+ * Parse "name=value" pairs separated by sep.
+ *
+ * @param str text to parse, or NULL to copy it out of the buffer.
+ * @param buffer buffer holding the text from its start when str is NULL.
+ *        It is left as it is.
+ * @param decode URL decode the names and values. Otherwise white spaces in
+ *        front of the names and double quotes around the values are
+ *        removed, as in cookies.
+ */
+static ad_http_kvlist_t *kvlist_new(ad_conn_t *conn, const char *str, struct evbuffer *buffer,
+                                     size_t len, char sep, bool decode) {
+    char delim[2] = { sep, '\0' };
+    int max = 1;
+    if (str) {
+        for (const char *p = str; (p = memchr(p, sep, len - (p - str))); p++) {
+            max++;
+        }
+    } else {
+        struct evbuffer_ptr ptr = evbuffer_search(buffer, delim, 1, NULL);
+        while (ptr.pos >= 0 && (size_t)ptr.pos < len) {
+            max++;
+            if (evbuffer_ptr_set(buffer, &ptr, 1, EVBUFFER_PTR_ADD)) {
+                break;
+            }
+            ptr = evbuffer_search(buffer, delim, 1, &ptr);
+        }
+    }
+    size_t size = sizeof(ad_http_kvlist_t) + max * sizeof(((ad_http_kvlist_t *)0)->kv[0]) + len + 1;
+    ad_http_kvlist_t *list = (ad_http_kvlist_t *) malloc(size);
+    if (list == NULL) {
+        return NULL;
+    }
+    list->size = size;
+    list->num = 0;
+    char *buf = (char *) &list->kv[max];
+    if (str) {
+        memcpy(buf, str, len);
+    } else if (evbuffer_copyout(buffer, buf, len) != (ssize_t)len) {
+        free(list);
+        return NULL;
+    }
+    buf[len] = '\0';
+
+    char *saveptr = NULL;
+    for (char *name = strtok_r(buf, delim, &saveptr); name;
+         name = strtok_r(NULL, delim, &saveptr)) {
+        char *value = strchr(name, '=');
+        if (value) {
+            *value++ = '\0';
+        }
+        if (decode) {
+            qurl_decode(name);
+            if (value) {
+                qurl_decode(value);
+            }
+        } else {
+            name += strspn(name, " \t");
+            size_t valuelen = (value) ? strlen(value) : 0;
+            if (valuelen >= 2 && value[0] == '"' && value[valuelen - 1] == '"') {
+                value[valuelen - 1] = '\0';
+                value++;
+            }
+        }
+        if (*name == '\0') {
+            continue;
+        }
+        list->kv[list->num].name = name;
+        list->kv[list->num].value = (value) ? value : "";
+        list->num++;
+    }
+
+    ad_conn_track_mem(conn, size);
+    return list;
+}
+
+static const char *kvlist_get(ad_http_kvlist_t *list, const char *name) {
+    for (int i = 0; i < list->num; i++) {
+        if (! strcmp(list->kv[i].name, name)) {
+            return list->kv[i].value;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Return whether the body of the request is large enough to spool.
+ */
+static bool spool_needed(ad_conn_t *conn, ad_http_t *http) {
+    if (http->request.streaming) {
+        return false;
+    }
+    int spoolsize = ad_server_get_option_int(conn->server, "http.spool_size");
+    return (spoolsize > 0
+            && (http->request.contentlength > spoolsize
+                || evbuffer_get_length(http->request.inbuf) > (size_t)spoolsize));
+}
+
+/**
+ * Move the body in the in-buffer to the spool file, creating it first.
+ *
+ * @return 0 on success, otherwise -1.
+ */
+static int spool_write(ad_conn_t *conn, ad_http_t *http) {
+    if (http->request.spool.fd < 0) {
+        http->request.spool.fd = spool_open(ad_server_get_option(conn->server, "http.spool_dir"));
+        if (http->request.spool.fd < 0) {
+            WARN("Failed to create a spool file. (errno:%d)", errno);
+            return -1;
+        }
+    }
+
+    struct evbuffer *inbuf = http->request.inbuf;
+    while (evbuffer_get_length(inbuf) > 0) {
+        int n = evbuffer_write(inbuf, http->request.spool.fd);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n <= 0) {
+            WARN("Failed to write to the spool file. (errno:%d)", errno);
+            return -1;
+        }
+        http->request.spool.size += n;
+    }
+    return 0;
+}
+
+/**
+ * Create an unlinked file for a spooled body.
+ */
+static int spool_open(const char *dir) {
+#ifdef MFD_CLOEXEC
+    if (dir == NULL || *dir == '\0') {
+        int fd = memfd_create("ad_http_spool", MFD_CLOEXEC);
+        if (fd >= 0 || errno != ENOSYS) {
+            return fd;
+        }
+    }
+#endif
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/ad_http_spool.XXXXXX",
+             (dir && *dir) ? dir : P_tmpdir);
+    int fd = mkstemp(path);
+    if (fd >= 0) {
+        unlink(path);
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+    }
+    return fd;
+}
+
 /**
  * validate file path
  */
@@ -0,0 +1,581 @@
+/******************************************************************************
+ * libasyncd
+ *
+ * Copyright (c) 2014 Seungyoung Kim.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *****************************************************************************/
+
+/**
+ * Streaming multipart/form-data parser.
+ *
+ * @file ad_http_multipart.c
+ */
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <event2/buffer.h>
+#include "qlibc/qlibc.h"
+#include "ad_server.h"
+#include "ad_http_handler.h"
+#include "ad_http_multipart.h"
+#include "macro.h"
+
+/*
+ * The body is parsed as it comes in and taken out of the in-buffer, so an
+ * upload of any size is held in a few reads worth of memory. Part data is
+ * handed to the callback straight from the in-buffer, keeping back only
+ * the bytes which may be the start of the next delimiter.
+ *
+ * Delimiters, "\r\n--" + boundary, are found with Boyer-Moore-Horspool
+ * over each extent of the buffer and over the joints between extents.
+ */
+#define AD_MULTIPART_MAXBOUNDARY    (70)            /* RFC 2046 */
+#define AD_MULTIPART_MAXDELIM       (4 + AD_MULTIPART_MAXBOUNDARY)
+#define AD_MULTIPART_MAXHEADER      (8 * 1024)      /* max bytes of part headers */
+#define AD_MULTIPART_IOVECS         (16)
+
+enum ad_multipart_state_e {
+    AD_MULTIPART_PREAMBLE = 0,  /* before the first boundary */
+    AD_MULTIPART_BOUNDARY,      /* right after a boundary */
+    AD_MULTIPART_HEADER,        /* in part headers */
+    AD_MULTIPART_DATA,          /* in part data */
+    AD_MULTIPART_EPILOGUE,      /* after the last boundary */
+};
+
+typedef struct ad_multipart_parser_s ad_multipart_parser_t;
+
+struct ad_multipart_parser_s {
+    ad_http_multipart_t *mp;
+    enum ad_multipart_state_e state;
+    unsigned char delim[AD_MULTIPART_MAXDELIM];  /* \r\n--boundary */
+    size_t delimlen;
+    uint8_t skip[256];          /* Horspool shift by the last byte of a window */
+    size_t headerbytes;         /* bytes of the headers of the current part */
+    ad_http_part_t part;
+    char *name;
+    char *filename;
+};
+
+struct ad_http_multipart_s {
+    ad_http_part_cb cb;
+    void *userdata;
+};
+
+#ifndef _DOXYGEN_SKIP
+static ad_multipart_parser_t *parser_new(ad_http_multipart_t *mp, ad_conn_t *conn);
+static void parser_free_cb(ad_conn_t *conn, void *userdata);
+static int parser_run(ad_multipart_parser_t *parser, ad_conn_t *conn, struct evbuffer *buf);
+static int part_begin(ad_multipart_parser_t *parser, ad_conn_t *conn);
+static int part_header(ad_multipart_parser_t *parser, char *line);
+static int part_data(ad_multipart_parser_t *parser, ad_conn_t *conn, struct evbuffer *buf, size_t size);
+static void part_clear(ad_multipart_parser_t *parser);
+static ssize_t delim_search(ad_multipart_parser_t *parser, struct evbuffer *buf);
+static ssize_t delim_search_mem(ad_multipart_parser_t *parser, const unsigned char *s, size_t n);
+static char *header_param(const char *value, const char *param);
+#endif
+
+/**
+ * Create a multipart/form-data parser.
+ *
+ * @param cb callback to be called with the parts.
+ * @param userdata userdata to pass to the callback.
+ *
+ * @return a pointer of ad_http_multipart_t object, otherwise NULL.
+ *
+ * @code
+ *   int my_part_cb(short event, ad_conn_t *conn, ad_http_part_t *part,
+ *                  const void *data, size_t size, void *userdata) {
+ *       if (event & AD_HTTP_PART_BEGIN) {
+ *           part->userdata = my_open(part->filename);
+ *       } else if (event & AD_HTTP_PART_DATA) {
+ *           my_write(part->userdata, data, size);
+ *       } else {
+ *           my_close(part->userdata, (event & AD_HTTP_PART_ABORT));
+ *       }
+ *       return AD_OK;
+ *   }
+ *
+ *   ad_http_multipart_t *mp = ad_http_multipart_new(my_part_cb, NULL);
+ *
+ *   ad_server_set_option(server, "http.header_phase", "1");
+ *   ad_server_register_hook(server, ad_http_handler, NULL);
+ *   ad_server_register_hook(server, ad_http_multipart, mp);
+ *   ad_server_register_hook(server, my_handler, NULL);
+ * @endcode
+ */
+ad_http_multipart_t *ad_http_multipart_new(ad_http_part_cb cb, void *userdata) {
+    ad_http_multipart_t *mp = NEW_OBJECT(ad_http_multipart_t);
+    if (mp == NULL) {
+        return NULL;
+    }
+    mp->cb = cb;
+    mp->userdata = userdata;
+    return mp;
+}
+
+/**
+ * Release the multipart/form-data parser.
+ */
+void ad_http_multipart_free(ad_http_multipart_t *mp) {
+    free(mp);
+}
+
+/**
+ * Multipart hook. Register it after ad_http_handler() with the parser as
+ * userdata, in front of the hook which responds to the upload.
+ *
+ * The body of a multipart/form-data request is handed to the callback
+ * part by part. With "http.header_phase" option, it's done as the body
+ * arrives and the body does not pile up in the in-buffer; otherwise all at
+ * once when the request is complete. The next hooks are called when the
+ * request is complete and all parts have been handed over. Hooks which
+ * check the headers of a request before the body comes in have to be
+ * registered in front of this one.
+ */
+int ad_http_multipart(short event, ad_conn_t *conn, void *userdata) {
+    ad_http_multipart_t *mp = (ad_http_multipart_t *)userdata;
+    if (! (event & AD_EVENT_READ)) {
+        return AD_OK;
+    }
+    enum ad_http_request_status_e status = ad_http_get_status(conn);
+    if (status != AD_HTTP_REQ_HEADER_DONE && status != AD_HTTP_REQ_DONE) {
+        return AD_OK;
+    }
+
+    ad_http_t *http = (ad_http_t *) ad_conn_get_extra(conn);
+    ad_multipart_parser_t *parser = (ad_multipart_parser_t *)
+            ad_http_get_userdata(conn, AD_HTTP_USERDATA_MULTIPART);
+    if (parser == NULL) {
+        parser = parser_new(mp, conn);
+        if (parser == NULL) {
+            return AD_OK;
+        }
+        if (ad_http_set_userdata(conn, AD_HTTP_USERDATA_MULTIPART, parser, parser_free_cb)) {
+            parser_free_cb(conn, parser);
+            return AD_OK;
+        }
+        http->request.streaming = true;
+    }
+
+    int ret = parser_run(parser, conn, http->request.inbuf);
+    if (ret == AD_OK && status == AD_HTTP_REQ_DONE
+        && parser->state != AD_MULTIPART_EPILOGUE) {
+        // Body ended before the last boundary.
+        ret = AD_CLOSE;
+    }
+    if (ret != AD_OK) {
+        if (! http->response.frozen_header) {
+            ad_http_response(conn, HTTP_CODE_BAD_REQUEST, "text/plain", "Bad Request\n", 12);
+        }
+        return AD_CLOSE;
+    }
+    return (status == AD_HTTP_REQ_DONE) ? AD_OK : AD_TAKEOVER;
+}
+
+#ifndef _DOXYGEN_SKIP
+
+/**
+ * Create the parser state of a request, NULL if the request is not
+ * multipart/form-data.
+ */
+static ad_multipart_parser_t *parser_new(ad_http_multipart_t *mp, ad_conn_t *conn) {
+    const char *contenttype = ad_http_get_request_header(conn, "Content-Type");
+    if (contenttype == NULL || strncasecmp(contenttype, "multipart/form-data", 19)) {
+        return NULL;
+    }
+    char *boundary = header_param(contenttype, "boundary");
+    if (boundary == NULL) {
+        return NULL;
+    }
+    size_t boundarylen = strlen(boundary);
+    if (boundarylen == 0 || boundarylen > AD_MULTIPART_MAXBOUNDARY) {
+        free(boundary);
+        return NULL;
+    }
+
+    ad_multipart_parser_t *parser = NEW_OBJECT(ad_multipart_parser_t);
+    if (parser == NULL) {
+        free(boundary);
+        return NULL;
+    }
+    parser->mp = mp;
+    parser->state = AD_MULTIPART_PREAMBLE;
+    memcpy(parser->delim, "\r\n--", 4);
+    memcpy(parser->delim + 4, boundary, boundarylen);
+    parser->delimlen = 4 + boundarylen;
+    free(boundary);
+
+    size_t m = parser->delimlen;
+    memset(parser->skip, m, sizeof(parser->skip));
+    for (size_t i = 0; i < m - 1; i++) {
+        parser->skip[parser->delim[i]] = m - 1 - i;
+    }
+    parser->part.index = -1;
+
+    ad_conn_track_mem(conn, sizeof(ad_multipart_parser_t));
+    return parser;
+}
+
+static void parser_free_cb(ad_conn_t *conn, void *userdata) {
+    ad_multipart_parser_t *parser = (ad_multipart_parser_t *)userdata;
+    if (parser->state == AD_MULTIPART_DATA) {
+        parser->mp->cb(AD_HTTP_PART_END | AD_HTTP_PART_ABORT, conn, &parser->part,
+                       NULL, 0, parser->mp->userdata);
+    }
+    part_clear(parser);
+    ad_conn_track_mem(conn, -(ssize_t)sizeof(ad_multipart_parser_t));
+    free(parser);
+}
+
+/**
+ * Parse what's in the buffer, taking out what's parsed.
+ *
+ * @return AD_OK to wait for more, otherwise the body is malformed or the
+ *         callback stopped the request.
+ */
+static int parser_run(ad_multipart_parser_t *parser, ad_conn_t *conn, struct evbuffer *buf) {
+    ad_http_multipart_t *mp = parser->mp;
+    while (true) {
+        size_t len = evbuffer_get_length(buf);
+        switch (parser->state) {
+            case AD_MULTIPART_PREAMBLE: {
+                // The body usually starts with the boundary, with no CRLF
+                // in front of it.
+                size_t first = parser->delimlen - 2;
+                if (len < first) {
+                    return AD_OK;
+                }
+                unsigned char head[AD_MULTIPART_MAXDELIM];
+                evbuffer_copyout(buf, head, first);
+                if (! memcmp(head, parser->delim + 2, first)) {
+                    evbuffer_drain(buf, first);
+                    parser->state = AD_MULTIPART_BOUNDARY;
+                    break;
+                }
+                ssize_t pos = delim_search(parser, buf);
+                if (pos < 0) {
+                    if (len > parser->delimlen - 1) {
+                        evbuffer_drain(buf, len - (parser->delimlen - 1));
+                    }
+                    return AD_OK;
+                }
+                evbuffer_drain(buf, pos + parser->delimlen);
+                parser->state = AD_MULTIPART_BOUNDARY;
+                break;
+            }
+            case AD_MULTIPART_BOUNDARY: {
+                // "--" for the last boundary, otherwise CRLF possibly
+                // after white spaces.
+                char tail[2];
+                if (len < sizeof(tail)) {
+                    return AD_OK;
+                }
+                evbuffer_copyout(buf, tail, sizeof(tail));
+                if (! memcmp(tail, "--", 2)) {
+                    parser->state = AD_MULTIPART_EPILOGUE;
+                    break;
+                }
+                char *line = evbuffer_readln(buf, NULL, EVBUFFER_EOL_CRLF);
+                if (line == NULL) {
+                    return (len > AD_MULTIPART_MAXHEADER) ? AD_CLOSE : AD_OK;
+                }
+                bool blank = (line[strspn(line, " \t")] == '\0');
+                free(line);
+                if (! blank) {
+                    return AD_CLOSE;
+                }
+                part_clear(parser);
+                parser->part.headers = qlisttbl(QLISTTBL_UNIQUE | QLISTTBL_CASEINSENSITIVE);
+                if (parser->part.headers == NULL) {
+                    return AD_CLOSE;
+                }
+                parser->part.index++;
+                parser->state = AD_MULTIPART_HEADER;
+                break;
+            }
+            case AD_MULTIPART_HEADER: {
+                size_t linelen = 0;
+                char *line = evbuffer_readln(buf, &linelen, EVBUFFER_EOL_CRLF);
+                if (line == NULL) {
+                    return (parser->headerbytes + len > AD_MULTIPART_MAXHEADER) ? AD_CLOSE : AD_OK;
+                }
+                parser->headerbytes += linelen + 2;
+                if (parser->headerbytes > AD_MULTIPART_MAXHEADER) {
+                    free(line);
+                    return AD_CLOSE;
+                }
+                if (linelen > 0) {
+                    int ret = part_header(parser, line);
+                    free(line);
+                    if (ret != AD_OK) {
+                        return ret;
+                    }
+                    break;
+                }
+                free(line);
+                int ret = part_begin(parser, conn);
+                if (ret != AD_OK) {
+                    return ret;
+                }
+                parser->state = AD_MULTIPART_DATA;
+                break;
+            }
+            case AD_MULTIPART_DATA: {
+                // Hand over the data up to the delimiter, or all but what
+                // could be the start of it.
+                ssize_t pos = delim_search(parser, buf);
+                size_t size = (pos >= 0) ? (size_t)pos
+                              : (len > parser->delimlen - 1) ? len - (parser->delimlen - 1) : 0;
+                if (size > 0) {
+                    int ret = part_data(parser, conn, buf, size);
+                    if (ret != AD_OK) {
+                        return ret;
+                    }
+                }
+                if (pos < 0) {
+                    return AD_OK;
+                }
+                evbuffer_drain(buf, parser->delimlen);
+                parser->state = AD_MULTIPART_BOUNDARY;
+                int ret = mp->cb(AD_HTTP_PART_END, conn, &parser->part, NULL, 0, mp->userdata);
+                if (ret != AD_OK) {
+                    return ret;
+                }
+                break;
+            }
+            case AD_MULTIPART_EPILOGUE: {
+                evbuffer_drain(buf, len);
+                return AD_OK;
+            }
+        }
+    }
+}
+
+/**
+ * Set up the part from its headers and call the callback.
+ */
+static int part_begin(ad_multipart_parser_t *parser, ad_conn_t *conn) {
+    ad_http_part_t *part = &parser->part;
+    const char *disposition = part->headers->getstr(part->headers, "Content-Disposition", false);
+    if (disposition) {
+        parser->name = header_param(disposition, "name");
+        parser->filename = header_param(disposition, "filename");
+    }
+    part->name = parser->name;
+    part->filename = parser->filename;
+    part->contenttype = part->headers->getstr(part->headers, "Content-Type", false);
+    return parser->mp->cb(AD_HTTP_PART_BEGIN, conn, part, NULL, 0, parser->mp->userdata);
+}
+
+/**
+ * Add a "name: value" header line to the part.
+ */
+static int part_header(ad_multipart_parser_t *parser, char *line) {
+    char *value = strchr(line, ':');
+    if (value == NULL) {
+        return AD_CLOSE;
+    }
+    *value++ = '\0';
+    char *name = qstrtrim(line);
+    value = qstrtrim(value);
+    if (*name == '\0') {
+        return AD_CLOSE;
+    }
+    parser->part.headers->putstr(parser->part.headers, name, value);
+    return AD_OK;
+}
+
+/**
+ * Hand the data in the front of the buffer to the callback extent by
+ * extent, and take it out.
+ */
+static int part_data(ad_multipart_parser_t *parser, ad_conn_t *conn, struct evbuffer *buf, size_t size) {
+    ad_http_multipart_t *mp = parser->mp;
+    while (size > 0) {
+        struct evbuffer_iovec vec[AD_MULTIPART_IOVECS];
+        int nvec = evbuffer_peek(buf, size, NULL, vec, AD_MULTIPART_IOVECS);
+        if (nvec > AD_MULTIPART_IOVECS) {
+            nvec = AD_MULTIPART_IOVECS;
+        }
+        size_t done = 0;
+        int ret = AD_OK;
+        for (int i = 0; i < nvec && done < size && ret == AD_OK; i++) {
+            // The last extent may run past the data.
+            size_t n = (vec[i].iov_len < size - done) ? vec[i].iov_len : size - done;
+            ret = mp->cb(AD_HTTP_PART_DATA, conn, &parser->part, vec[i].iov_base, n, mp->userdata);
+            parser->part.size += n;
+            done += n;
+        }
+        evbuffer_drain(buf, done);
+        if (ret != AD_OK) {
+            return ret;
+        }
+        size -= done;
+    }
+    return AD_OK;
+}
+
+static void part_clear(ad_multipart_parser_t *parser) {
+    ad_http_part_t *part = &parser->part;
+    if (part->headers) {
+        part->headers->free(part->headers);
+    }
+    free(parser->name);
+    free(parser->filename);
+    parser->name = parser->filename = NULL;
+    parser->headerbytes = 0;
+
+    int index = part->index;
+    memset(part, 0, sizeof(ad_http_part_t));
+    part->index = index;
+}
+
+/**
+ * Find the first delimiter in the buffer.
+ *
+ * @return offset of the delimiter, otherwise -1.
+ */
+static ssize_t delim_search(ad_multipart_parser_t *parser, struct evbuffer *buf) {
+    size_t len = evbuffer_get_length(buf);
+    size_t m = parser->delimlen;
+    if (len < m) {
+        return -1;
+    }
+
+    struct evbuffer_ptr ptr;
+    evbuffer_ptr_set(buf, &ptr, 0, EVBUFFER_PTR_SET);
+    for (size_t off = 0; off < len;) {
+        struct evbuffer_iovec vec;
+        if (evbuffer_peek(buf, -1, &ptr, &vec, 1) < 1) {
+            break;
+        }
+        ssize_t pos = delim_search_mem(parser, vec.iov_base, vec.iov_len);
+        if (pos >= 0) {
+            return off + pos;
+        }
+
+        // Delimiters starting in the last m - 1 bytes of the extent.
+        size_t end = off + vec.iov_len;
+        if (end < len) {
+            size_t from = end - ((vec.iov_len < m - 1) ? vec.iov_len : m - 1);
+            size_t jointlen = (len - from < 2 * (m - 1)) ? len - from : 2 * (m - 1);
+            unsigned char joint[2 * AD_MULTIPART_MAXDELIM];
+            struct evbuffer_ptr jointptr;
+            evbuffer_ptr_set(buf, &jointptr, from, EVBUFFER_PTR_SET);
+            if (evbuffer_copyout_from(buf, &jointptr, joint, jointlen) == (ssize_t)jointlen) {
+                pos = delim_search_mem(parser, joint, jointlen);
+                if (pos >= 0) {
+                    return from + pos;
+                }
+            }
+        }
+
+        off = end;
+        if (off < len) {
+            evbuffer_ptr_set(buf, &ptr, vec.iov_len, EVBUFFER_PTR_ADD);
+        }
+    }
+    return -1;
+}
+
+/**
+ * Boyer-Moore-Horspool search of the delimiter in a memory block.
+ */
+static ssize_t delim_search_mem(ad_multipart_parser_t *parser, const unsigned char *s, size_t n) {
+    const unsigned char *delim = parser->delim;
+    size_t m = parser->delimlen;
+    unsigned char last = delim[m - 1];
+    for (size_t i = 0; i + m <= n; i += parser->skip[s[i + m - 1]]) {
+        if (s[i + m - 1] == last && ! memcmp(s + i, delim, m - 1)) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Get a parameter of a header value, unquoted.
+ *
+ * @code
+ *   header_param("form-data; name=\"a\"; filename=\"b.txt\"", "filename")  // b.txt
+ * @endcode
+ *
+ * @return malloced value, otherwise NULL.
+ */
+static char *header_param(const char *value, const char *param) {
+    size_t paramlen = strlen(param);
+    for (const char *p = strchr(value, ';'); p; ) {
+        p++;
+        p += strspn(p, " \t");
+        const char *eq = p + strcspn(p, "=;");
+        bool match = (*eq == '=' && (size_t)(eq - p) == paramlen && ! strncasecmp(p, param, paramlen));
+        if (*eq != '=') {
+            p = (*eq == ';') ? eq : NULL;
+            continue;
+        }
+
+        const char *v = eq + 1;
+        char *found = NULL;
+        if (*v == '"') {
+            // Quoted string with backslash escapes.
+            const char *end = ++v;
+            for (; *end && *end != '"'; end++) {
+                if (*end == '\\' && end[1]) {
+                    end++;
+                }
+            }
+            if (match) {
+                found = malloc(end - v + 1);
+                if (found) {
+                    char *d = found;
+                    for (const char *s = v; s < end; s++) {
+                        if (*s == '\\' && s + 1 < end) {
+                            s++;
+                        }
+                        *d++ = *s;
+                    }
+                    *d = '\0';
+                }
+                return found;
+            }
+            p = (*end) ? strchr(end + 1, ';') : NULL;
+        } else {
+            size_t vlen = strcspn(v, ";");
+            if (match) {
+                while (vlen > 0 && (v[vlen - 1] == ' ' || v[vlen - 1] == '\t')) {
+                    vlen--;
+                }
+                return strndup(v, vlen);
+            }
+            p = (v[vlen]) ? v + vlen : NULL;
+        }
+    }
+    return NULL;
+}
+
+#endif // _DOXYGEN_SKIP
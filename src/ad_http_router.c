@@ -0,0 +1,648 @@
+/******************************************************************************
+ * libasyncd
+ *
+ * Copyright (c) 2014 Seungyoung Kim.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *****************************************************************************/
+
+/**
+ * HTTP request routing by path and by virtual host.
+ *
+ * @file ad_http_router.c
+ */
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <assert.h>
+#include "qlibc/qlibc.h"
+#include "ad_server.h"
+#include "ad_http_handler.h"
+#include "ad_http_router.h"
+#include "macro.h"
+
+/*
+ * Routes are kept in a radix tree per method. Static parts of the paths
+ * share their common prefixes, so looking up a request walks the path
+ * once no matter how many routes there are. At each node static children
+ * are tried first, then a ":name" parameter, then a "*name" wildcard.
+ */
+typedef struct ad_route_s ad_route_t;
+struct ad_route_s {
+    ad_http_router_t *router;
+    ad_callback cb;
+    void *userdata;
+};
+
+typedef struct ad_route_node_s ad_route_node_t;
+struct ad_route_node_s {
+    char *label;                    /* static part, or parameter name */
+    size_t len;                     /* length of label */
+    ad_route_node_t **children;     /* static children */
+    int nchildren;
+    ad_route_node_t *param;         /* ":name" child, matches a segment */
+    ad_route_node_t *wildcard;      /* "*name" child, matches the rest */
+    ad_route_t *route;              /* route ending at this node */
+};
+
+typedef struct ad_route_tree_s ad_route_tree_t;
+struct ad_route_tree_s {
+    char *method;                   /* NULL for any method */
+    ad_route_node_t *root;
+    ad_route_tree_t *next;
+};
+
+struct ad_http_router_s {
+    ad_route_tree_t *trees;
+};
+
+/*
+ * Lookup result of a request, kept until the end of the request.
+ */
+typedef struct ad_route_param_s ad_route_param_t;
+struct ad_route_param_s {
+    const char *name;               /* parameter name in the route */
+    const char *value;              /* value in the request path, not null terminated */
+    size_t len;
+};
+
+typedef struct ad_route_match_s ad_route_match_t;
+struct ad_route_match_s {
+    ad_http_router_t *router;       /* router which looked up the request */
+    ad_route_t *route;              /* matched route. NULL if nothing matched */
+    int nparams;
+    ad_route_param_t params[AD_HTTP_MAX_PARAMS];
+};
+
+/*
+ * Hook chains by hostname. "*.domain.com" matches one more label in the
+ * front and "*" matches any host.
+ */
+#define AD_VHOST_NAME_MAX   (253)
+
+struct ad_http_vhost_s {
+    qhashtbl_t *hosts;      /* hostname -> hook chain, see ad_hooks_add() */
+};
+
+#ifndef _DOXYGEN_SKIP
+static ad_route_tree_t *router_tree(ad_http_router_t *router, const char *method, bool create);
+static ad_route_t *router_match(ad_http_router_t *router, ad_http_t *http,
+                                ad_route_match_t *match);
+static void match_free_cb(ad_conn_t *conn, void *userdata);
+static ad_route_node_t *node_new(const char *label, size_t len);
+static void node_free(ad_route_node_t *node);
+static ad_route_node_t **node_child(ad_route_node_t *node, char c);
+static int node_add_child(ad_route_node_t *node, ad_route_node_t *child);
+static int node_insert(ad_route_node_t *node, const char *path, ad_route_t *route);
+static ad_route_t *node_match(ad_route_node_t *node, const char *path,
+                              ad_route_match_t *match);
+static size_t static_len(const char *path);
+static qlist_t *vhost_lookup(ad_http_vhost_t *vhost, const char *domain);
+#endif
+
+/**
+ * Create a router.
+ *
+ * @code
+ *   ad_http_router_t *router = ad_http_router_new();
+ *   ad_http_router_add(router, "GET", "/users/:id", my_get_user, NULL);
+ *   ad_http_router_add(router, "GET", "/users/:id/posts/:post", my_get_post, NULL);
+ *   ad_http_router_add(router, NULL, "/health", my_health, NULL);
+ *
+ *   ad_server_register_hook(server, ad_http_handler, NULL);
+ *   ad_server_register_hook(server, ad_http_router, router);
+ *   ad_server_register_hook(server, my_not_found, NULL);
+ * @endcode
+ */
+ad_http_router_t *ad_http_router_new(void) {
+    return NEW_OBJECT(ad_http_router_t);
+}
+
+/**
+ * Add a route.
+ *
+ * The path consists of static parts, ":name" parameters matching one path
+ * segment, and an optional "*name" wildcard at the end matching the rest
+ * of the path. Static parts win over parameters, parameters win over the
+ * wildcard regardless of the order the routes are added.
+ *
+ * @param method request method such as "GET". NULL or "*" for any method.
+ *        Routes of the method are tried before the ones for any method.
+ * @param path route path ex) "/users/:id/posts/:post". A wildcard goes
+ *        after the last slash, like "*file" to get "file" parameter.
+ * @param cb hook to call for the requests matching the route.
+ * @param userdata userdata for the hook.
+ *
+ * @return 0 if successful, -1 if the path is invalid or already taken.
+ *
+ * @note
+ *   Routes must be added before the server starts.
+ */
+int ad_http_router_add(ad_http_router_t *router, const char *method,
+                       const char *path, ad_callback cb, void *userdata) {
+    if (path == NULL || path[0] != '/' || cb == NULL) {
+        return -1;
+    }
+    int nparams = 0;
+    for (const char *p = path; *p; p++) {
+        if ((*p == ':' || *p == '*') && p[-1] == '/') {
+            nparams++;
+        }
+    }
+    if (nparams > AD_HTTP_MAX_PARAMS) {
+        WARN("Too many parameters in route %s", path);
+        return -1;
+    }
+
+    if (method && ! strcmp(method, "*")) {
+        method = NULL;
+    }
+    ad_route_tree_t *tree = router_tree(router, method, true);
+    ad_route_t *route = NEW_OBJECT(ad_route_t);
+    if (tree == NULL || route == NULL) {
+        free(route);
+        return -1;
+    }
+    route->router = router;
+    route->cb = cb;
+    route->userdata = userdata;
+
+    if (node_insert(tree->root, path, route)) {
+        WARN("Route conflicts with another. %s %s", (method) ? method : "*", path);
+        free(route);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Release the router.
+ */
+void ad_http_router_free(ad_http_router_t *router) {
+    while (router->trees) {
+        ad_route_tree_t *tree = router->trees;
+        router->trees = tree->next;
+        node_free(tree->root);
+        free(tree->method);
+        free(tree);
+    }
+    free(router);
+}
+
+/**
+ * Router hook. Register it after ad_http_handler() with the router as
+ * userdata.
+ *
+ * The request is looked up once its headers are in, and from then on the
+ * route's hook gets all the events of the request as if it were
+ * registered in place of the router. Requests matching no route are
+ * passed on to the next hook.
+ */
+int ad_http_router(short event, ad_conn_t *conn, void *userdata) {
+    ad_http_router_t *router = (ad_http_router_t *)userdata;
+    ad_http_t *http = (ad_http_t *) ad_conn_get_extra(conn);
+    if (http == NULL || http->request.path == NULL) {
+        return AD_OK;
+    }
+
+    ad_route_match_t *match = (ad_route_match_t *)
+            ad_http_get_userdata(conn, AD_HTTP_USERDATA_ROUTER);
+    if (match == NULL || match->router != router) {
+        if (! (event & AD_EVENT_READ)) {
+            return AD_OK;
+        }
+        if (match == NULL) {
+            match = NEW_OBJECT(ad_route_match_t);
+            if (match == NULL) {
+                return AD_OK;
+            }
+            if (ad_http_set_userdata(conn, AD_HTTP_USERDATA_ROUTER, match, match_free_cb)) {
+                free(match);
+                return AD_OK;
+            }
+            ad_conn_track_mem(conn, sizeof(ad_route_match_t));
+        }
+        match->router = router;
+        match->nparams = 0;
+        match->route = router_match(router, http, match);
+    }
+
+    const ad_route_t *route = match->route;
+    if (route == NULL) {
+        return AD_OK;
+    }
+    return route->cb(event, conn, route->userdata);
+}
+
+/**
+ * Get a path parameter of the matched route.
+ *
+ * @param name parameter name without ':' or '*'.
+ * @param len length of the value. Can be NULL.
+ *
+ * @return pointer to the value in the request path if found, otherwise
+ *         NULL. The value is not null terminated, use the length.
+ *
+ * @code
+ *   // route "/users/:id"
+ *   size_t len;
+ *   const char *id = ad_http_get_param(conn, "id", &len);
+ *   if (id) printf("%.*s", (int)len, id);
+ * @endcode
+ */
+const char *ad_http_get_param(ad_conn_t *conn, const char *name, size_t *len) {
+    ad_route_match_t *match = (ad_route_match_t *)
+            ad_http_get_userdata(conn, AD_HTTP_USERDATA_ROUTER);
+    if (match == NULL) {
+        return NULL;
+    }
+    for (int i = 0; i < match->nparams; i++) {
+        ad_route_param_t *param = &match->params[i];
+        if (! strcmp(param->name, name)) {
+            if (len) {
+                *len = param->len;
+            }
+            return param->value;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Create a virtual host dispatcher.
+ *
+ * @code
+ *   ad_http_vhost_t *vhost = ad_http_vhost_new();
+ *   ad_http_vhost_register_hook(vhost, "www.example.com", my_www, NULL);
+ *   ad_http_vhost_register_hook(vhost, "api.example.com", ad_http_router, router);
+ *   ad_http_vhost_register_hook(vhost, "*.example.com", my_others, NULL);
+ *   ad_http_vhost_register_hook(vhost, "*", my_default, NULL);
+ *
+ *   ad_server_register_hook(server, ad_http_handler, NULL);
+ *   ad_server_register_hook(server, ad_http_vhost, vhost);
+ * @endcode
+ */
+ad_http_vhost_t *ad_http_vhost_new(void) {
+    ad_http_vhost_t *vhost = NEW_OBJECT(ad_http_vhost_t);
+    if (vhost == NULL) {
+        return NULL;
+    }
+    vhost->hosts = qhashtbl(0, 0);
+    if (vhost->hosts == NULL) {
+        free(vhost);
+        return NULL;
+    }
+    return vhost;
+}
+
+/**
+ * Add a hook to the host's hook chain. Hooks of a host are called in the
+ * registered order, the same way as the server's hooks.
+ *
+ * @param hostname hostname without port number, "*.domain.com" for the
+ *        subdomains or "*" for any other host.
+ *
+ * @return 0 if successful, otherwise -1.
+ *
+ * @note
+ *   Hooks must be added before the server starts. The hooks see the
+ *   requests from AD_EVENT_READ with complete headers, not AD_EVENT_INIT.
+ */
+int ad_http_vhost_register_hook(ad_http_vhost_t *vhost, const char *hostname,
+                                ad_callback cb, void *userdata) {
+    size_t len = (hostname) ? strlen(hostname) : 0;
+    if (len > 0 && hostname[len - 1] == '.') {
+        len--;
+    }
+    if (len == 0 || len > AD_VHOST_NAME_MAX || cb == NULL) {
+        return -1;
+    }
+    char name[AD_VHOST_NAME_MAX + 1];
+    for (size_t i = 0; i < len; i++) {
+        name[i] = tolower((unsigned char)hostname[i]);
+    }
+    name[len] = '\0';
+
+    qlist_t **hooks = (qlist_t **) vhost->hosts->get(vhost->hosts, name, NULL, false);
+    qlist_t *list = (hooks) ? *hooks : qlist(0);
+    if (list == NULL) {
+        return -1;
+    }
+    if (hooks == NULL && ! vhost->hosts->put(vhost->hosts, name, &list, sizeof(qlist_t *))) {
+        list->free(list);
+        return -1;
+    }
+    ad_hooks_add(list, NULL, cb, userdata);
+    return 0;
+}
+
+/**
+ * Release the virtual host dispatcher.
+ */
+void ad_http_vhost_free(ad_http_vhost_t *vhost) {
+    qhashtbl_obj_t obj;
+    bzero((void *)&obj, sizeof(qhashtbl_obj_t));
+    while (vhost->hosts->getnext(vhost->hosts, &obj, false)) {
+        ad_hooks_free(*(qlist_t **)obj.data);
+    }
+    vhost->hosts->free(vhost->hosts);
+    free(vhost);
+}
+
+/**
+ * Virtual host hook. Register it after ad_http_handler() with the
+ * dispatcher as userdata.
+ *
+ * Requests go to the hook chain of the exact domain, then the wildcard
+ * of the parent domain, then "*". Requests without Host header or with
+ * no matching host are passed on to the next hook.
+ */
+int ad_http_vhost(short event, ad_conn_t *conn, void *userdata) {
+    ad_http_vhost_t *vhost = (ad_http_vhost_t *)userdata;
+    ad_http_t *http = (ad_http_t *) ad_conn_get_extra(conn);
+    if (http == NULL || http->request.domain == NULL) {
+        return AD_OK;
+    }
+
+    qlist_t *hooks = vhost_lookup(vhost, http->request.domain);
+    if (hooks == NULL) {
+        return AD_OK;
+    }
+
+    return ad_hooks_call(hooks, event, conn);
+}
+
+/******************************************************************************
+ * Private internal functions.
+ *****************************************************************************/
+#ifndef _DOXYGEN_SKIP
+
+static ad_route_tree_t *router_tree(ad_http_router_t *router, const char *method, bool create) {
+    ad_route_tree_t *tree;
+    for (tree = router->trees; tree; tree = tree->next) {
+        if ((method == NULL && tree->method == NULL)
+            || (method && tree->method && ! strcasecmp(method, tree->method))) {
+            return tree;
+        }
+    }
+    if (! create) {
+        return NULL;
+    }
+
+    tree = NEW_OBJECT(ad_route_tree_t);
+    if (tree == NULL) {
+        return NULL;
+    }
+    tree->method = (method) ? qstrupper(strdup(method)) : NULL;
+    tree->root = node_new("", 0);
+    if ((method && tree->method == NULL) || tree->root == NULL) {
+        free(tree->method);
+        free(tree);
+        return NULL;
+    }
+    tree->next = router->trees;
+    router->trees = tree;
+    return tree;
+}
+
+static ad_route_t *router_match(ad_http_router_t *router, ad_http_t *http,
+                                ad_route_match_t *match) {
+    ad_route_tree_t *tree = router_tree(router, http->request.method, false);
+    ad_route_t *route = NULL;
+    if (tree) {
+        route = node_match(tree->root, http->request.path, match);
+    }
+    if (route == NULL && (tree = router_tree(router, NULL, false))) {
+        match->nparams = 0;
+        route = node_match(tree->root, http->request.path, match);
+    }
+    DEBUG("Route %s %s", http->request.path, (route) ? "found" : "not found");
+    return route;
+}
+
+static void match_free_cb(ad_conn_t *conn, void *userdata) {
+    ad_conn_track_mem(conn, -(ssize_t)sizeof(ad_route_match_t));
+    free(userdata);
+}
+
+static ad_route_node_t *node_new(const char *label, size_t len) {
+    ad_route_node_t *node = NEW_OBJECT(ad_route_node_t);
+    if (node == NULL) {
+        return NULL;
+    }
+    node->label = strndup(label, len);
+    node->len = len;
+    if (node->label == NULL) {
+        free(node);
+        return NULL;
+    }
+    return node;
+}
+
+static void node_free(ad_route_node_t *node) {
+    if (node == NULL) {
+        return;
+    }
+    for (int i = 0; i < node->nchildren; i++) {
+        node_free(node->children[i]);
+    }
+    node_free(node->param);
+    node_free(node->wildcard);
+    free(node->children);
+    free(node->route);
+    free(node->label);
+    free(node);
+}
+
+/**
+ * Find the static child starting with the character.
+ */
+static ad_route_node_t **node_child(ad_route_node_t *node, char c) {
+    for (int i = 0; i < node->nchildren; i++) {
+        if (node->children[i]->label[0] == c) {
+            return &node->children[i];
+        }
+    }
+    return NULL;
+}
+
+static int node_add_child(ad_route_node_t *node, ad_route_node_t *child) {
+    ad_route_node_t **children = (ad_route_node_t **) realloc(
+            node->children, sizeof(ad_route_node_t *) * (node->nchildren + 1));
+    if (children == NULL) {
+        return -1;
+    }
+    children[node->nchildren++] = child;
+    node->children = children;
+    return 0;
+}
+
+/**
+ * Insert the rest of the route path below the node.
+ */
+static int node_insert(ad_route_node_t *node, const char *path, ad_route_t *route) {
+    if (*path == '\0') {
+        if (node->route) {
+            return -1;
+        }
+        node->route = route;
+        return 0;
+    }
+
+    if (*path == ':') {
+        size_t len = strcspn(path + 1, "/");
+        if (len == 0) {
+            return -1;
+        }
+        if (node->param == NULL) {
+            node->param = node_new(path + 1, len);
+            if (node->param == NULL) {
+                return -1;
+            }
+        } else if (node->param->len != len || strncmp(node->param->label, path + 1, len)) {
+            return -1;  // Same place, different name.
+        }
+        return node_insert(node->param, path + 1 + len, route);
+    }
+
+    if (*path == '*') {
+        if (strchr(path, '/') || node->wildcard) {
+            return -1;
+        }
+        node->wildcard = node_new(path + 1, strlen(path + 1));
+        if (node->wildcard == NULL) {
+            return -1;
+        }
+        node->wildcard->route = route;
+        return 0;
+    }
+
+    // Static part, up to the next parameter.
+    size_t len = static_len(path);
+    ad_route_node_t **childp = node_child(node, path[0]);
+    if (childp == NULL) {
+        ad_route_node_t *child = node_new(path, len);
+        if (child == NULL || node_add_child(node, child)) {
+            node_free(child);
+            return -1;
+        }
+        return node_insert(child, path + len, route);
+    }
+
+    ad_route_node_t *child = *childp;
+    size_t common = 0;
+    while (common < len && common < child->len && child->label[common] == path[common]) {
+        common++;
+    }
+    if (common < child->len) {
+        // Split the child at the common prefix.
+        ad_route_node_t *mid = node_new(child->label, common);
+        if (mid == NULL || node_add_child(mid, child)) {
+            node_free(mid);
+            return -1;
+        }
+        memmove(child->label, child->label + common, child->len - common + 1);
+        child->len -= common;
+        *childp = mid;
+        child = mid;
+    }
+    return node_insert(child, path + common, route);
+}
+
+/**
+ * Match the rest of the request path below the node, collecting the
+ * parameters.
+ */
+static ad_route_t *node_match(ad_route_node_t *node, const char *path,
+                              ad_route_match_t *match) {
+    if (*path == '\0' && node->route) {
+        return node->route;
+    }
+
+    if (*path != '\0') {
+        ad_route_node_t **childp = node_child(node, *path);
+        if (childp && ! strncmp(path, (*childp)->label, (*childp)->len)) {
+            ad_route_t *route = node_match(*childp, path + (*childp)->len, match);
+            if (route) {
+                return route;
+            }
+        }
+
+        size_t len = strcspn(path, "/");
+        if (node->param && len > 0) {
+            int n = match->nparams++;
+            match->params[n].name = node->param->label;
+            match->params[n].value = path;
+            match->params[n].len = len;
+            ad_route_t *route = node_match(node->param, path + len, match);
+            if (route) {
+                return route;
+            }
+            match->nparams = n;
+        }
+    }
+
+    if (node->wildcard) {
+        int n = match->nparams++;
+        match->params[n].name = node->wildcard->label;
+        match->params[n].value = path;
+        match->params[n].len = strlen(path);
+        return node->wildcard->route;
+    }
+    return NULL;
+}
+
+static qlist_t *vhost_lookup(ad_http_vhost_t *vhost, const char *domain) {
+    qlist_t **hooks = (qlist_t **) vhost->hosts->get(vhost->hosts, domain, NULL, false);
+    if (hooks == NULL) {
+        const char *dot = strchr(domain, '.');
+        if (dot && strlen(dot) <= AD_VHOST_NAME_MAX) {
+            char name[AD_VHOST_NAME_MAX + 2];
+            name[0] = '*';
+            strcpy(name + 1, dot);
+            hooks = (qlist_t **) vhost->hosts->get(vhost->hosts, name, NULL, false);
+        }
+    }
+    if (hooks == NULL) {
+        hooks = (qlist_t **) vhost->hosts->get(vhost->hosts, "*", NULL, false);
+    }
+    return (hooks) ? *hooks : NULL;
+}
+
+/**
+ * Length of the static part, parameters start right after a slash.
+ */
+static size_t static_len(const char *path) {
+    size_t len = 0;
+    for (; path[len]; len++) {
+        if ((path[len] == ':' || path[len] == '*') && len > 0 && path[len - 1] == '/') {
+            break;
+        }
+    }
+    return len;
+}
+
+#endif // _DOXYGEN_SKIP
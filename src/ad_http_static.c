@@ -0,0 +1,667 @@
+/******************************************************************************
+ * libasyncd
+ *
+ * Copyright (c) 2014 Seungyoung Kim.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *****************************************************************************/
+
+/**
+ * Static file serving with an open file cache.
+ *
+ * @file ad_http_static.c
+ */
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <event2/buffer.h>
+#include "qlibc/qlibc.h"
+#include "ad_server.h"
+#include "ad_http_handler.h"
+#include "ad_http_static.h"
+#include "macro.h"
+
+/*
+ * Files are kept open with their stat results in a LRU cache, so a hit
+ * costs no system call but a stat() at most once a second to see if the
+ * file has changed. Missing files are cached as well, that's what most
+ * lookups of precompressed siblings end up with. They have a LRU list and
+ * limit of their own, so a flood of 404s can't push open files out.
+ * The disk is looked at without holding the lock.
+ */
+#define AD_STATIC_MAXFILES      (1024)          /* default cache size */
+#define AD_STATIC_REVALIDATE    (1)             /* seconds to trust a cached stat */
+#define AD_STATIC_INDEX         "index.html"    /* file served for a directory */
+
+enum ad_static_type_e {
+    AD_STATIC_NONE = 0,     /* not found or not readable */
+    AD_STATIC_FILE,
+    AD_STATIC_DIR,
+};
+
+typedef struct ad_static_file_s ad_static_file_t;
+struct ad_static_file_s {
+    char *name;                 /* request path, cache key */
+    enum ad_static_type_e type;
+    struct evbuffer_file_segment *seg;  /* whole file. NULL if empty */
+    off_t size;
+    time_t mtime;
+    dev_t dev;
+    ino_t ino;
+    time_t checked;             /* when it was stat()ed last */
+    char etag[48];              /* ex) "5e8f1a2b-1f4" */
+    char lastmod[32];           /* ex) Sun, 06 Nov 1994 08:49:37 GMT */
+    int refs;                   /* one for the cache and one for each user */
+    ad_static_file_t *prev;     /* LRU list, most recently used first */
+    ad_static_file_t *next;
+};
+
+typedef struct ad_static_lru_s ad_static_lru_t;
+struct ad_static_lru_s {
+    ad_static_file_t *head;
+    ad_static_file_t *tail;
+    size_t num;
+};
+
+struct ad_http_static_s {
+    char *rootdir;
+    size_t maxfiles;            /* limit of each LRU list */
+    pthread_mutex_t lock;
+    qhashtbl_t *files;          /* name -> ad_static_file_t * */
+    ad_static_lru_t found;      /* files and directories */
+    ad_static_lru_t missing;    /* AD_STATIC_NONE entries */
+};
+
+/*
+ * Precompressed siblings in the order of preference.
+ */
+static const struct {
+    const char *ext;
+    const char *coding;
+} encodings[] = {
+    { ".br", "br" },
+    { ".gz", "gzip" },
+};
+
+static const struct {
+    const char *ext;
+    const char *type;
+} mimetypes[] = {
+    { "html", "text/html" },
+    { "htm", "text/html" },
+    { "css", "text/css" },
+    { "js", "application/javascript" },
+    { "mjs", "application/javascript" },
+    { "json", "application/json" },
+    { "xml", "application/xml" },
+    { "txt", "text/plain" },
+    { "csv", "text/csv" },
+    { "md", "text/markdown" },
+    { "png", "image/png" },
+    { "jpg", "image/jpeg" },
+    { "jpeg", "image/jpeg" },
+    { "gif", "image/gif" },
+    { "webp", "image/webp" },
+    { "avif", "image/avif" },
+    { "svg", "image/svg+xml" },
+    { "ico", "image/x-icon" },
+    { "woff", "font/woff" },
+    { "woff2", "font/woff2" },
+    { "ttf", "font/ttf" },
+    { "otf", "font/otf" },
+    { "wasm", "application/wasm" },
+    { "pdf", "application/pdf" },
+    { "zip", "application/zip" },
+    { "gz", "application/gzip" },
+    { "mp4", "video/mp4" },
+    { "webm", "video/webm" },
+    { "mp3", "audio/mpeg" },
+    { "ogg", "audio/ogg" },
+    { "wav", "audio/wav" },
+};
+
+#ifndef _DOXYGEN_SKIP
+static int static_send(ad_conn_t *conn, ad_static_file_t *file, ad_static_file_t *body,
+                       const char *coding, bool vary, bool head);
+static ad_static_file_t *file_get(ad_http_static_t *files, const char *name);
+static void file_release(ad_http_static_t *files, ad_static_file_t *file);
+static ad_static_file_t *file_open(ad_http_static_t *files, const char *name);
+static void file_stat(ad_static_file_t *file, struct stat *st);
+static void file_unlink(ad_http_static_t *files, ad_static_file_t *file);
+static ad_static_lru_t *file_lru(ad_http_static_t *files, ad_static_file_t *file);
+static void lru_push(ad_static_lru_t *lru, ad_static_file_t *file);
+static void lru_remove(ad_static_lru_t *lru, ad_static_file_t *file);
+static void file_free(ad_static_file_t *file);
+static bool path_allowed(const char *path);
+static const char *mimetype(const char *name);
+static bool not_modified_since(const char *date, time_t mtime);
+static int parse_range(const char *range, off_t size, off_t *offset, off_t *length);
+#endif
+
+/**
+ * Create a static file handler.
+ *
+ * @param rootdir document root directory.
+ * @param maxfiles max number of files to keep open, and of missing ones
+ *        to remember. 0 for the default.
+ *
+ * @return a pointer of ad_http_static_t object, otherwise NULL if the
+ *         root is not a directory.
+ *
+ * @code
+ *   ad_http_static_t *files = ad_http_static_new("/var/www/html", 0);
+ *
+ *   ad_server_register_hook(server, ad_http_handler, NULL);
+ *   ad_server_register_hook(server, ad_http_static, files);
+ *   ad_server_register_hook(server, my_not_found, NULL);
+ * @endcode
+ */
+ad_http_static_t *ad_http_static_new(const char *rootdir, size_t maxfiles) {
+    struct stat st;
+    if (rootdir == NULL || stat(rootdir, &st) || ! S_ISDIR(st.st_mode)) {
+        ERROR("Invalid document root. %s", (rootdir) ? rootdir : "(null)");
+        return NULL;
+    }
+
+    ad_http_static_t *files = NEW_OBJECT(ad_http_static_t);
+    if (files == NULL) {
+        return NULL;
+    }
+    files->rootdir = strdup(rootdir);
+    files->files = qhashtbl(0, 0);
+    if (files->rootdir == NULL || files->files == NULL) {
+        ad_http_static_free(files);
+        return NULL;
+    }
+    size_t len = strlen(files->rootdir);
+    while (len > 1 && files->rootdir[len - 1] == '/') {
+        files->rootdir[--len] = '\0';
+    }
+    files->maxfiles = (maxfiles > 0) ? maxfiles : AD_STATIC_MAXFILES;
+    pthread_mutex_init(&files->lock, NULL);
+    return files;
+}
+
+/**
+ * Release the static file handler. Responses in flight keep their files
+ * open until they are sent.
+ */
+void ad_http_static_free(ad_http_static_t *files) {
+    if (files->files) {
+        while (files->found.head || files->missing.head) {
+            ad_static_file_t *file = (files->found.head) ? files->found.head : files->missing.head;
+            file_unlink(files, file);
+            file_release(files, file);
+        }
+        files->files->free(files->files);
+        pthread_mutex_destroy(&files->lock);
+    }
+    free(files->rootdir);
+    free(files);
+}
+
+/**
+ * Static file hook. Register it after ad_http_handler() with the handler
+ * as userdata.
+ *
+ * GET and HEAD requests are served from the files under the document
+ * root, with "index.html" for a directory. The body goes out with
+ * sendfile() with no copy in user space. It handles a single byte range
+ * (206), If-None-Match and If-Modified-Since (304), and serves a ".br" or
+ * ".gz" file next to the requested one when the client accepts it.
+ * Requests for files that don't exist are passed on to the next hook.
+ *
+ * @note
+ *   The request path is already validated and cleaned up by the parser,
+ *   and paths with ".." in them are never served.
+ */
+int ad_http_static(short event, ad_conn_t *conn, void *userdata) {
+    ad_http_static_t *files = (ad_http_static_t *)userdata;
+    if (! (event & AD_EVENT_READ) || ad_http_get_status(conn) != AD_HTTP_REQ_DONE) {
+        return AD_OK;
+    }
+    ad_http_t *http = (ad_http_t *) ad_conn_get_extra(conn);
+    bool head = ! strcmp(http->request.method, "HEAD");
+    if ((! head && strcmp(http->request.method, "GET"))
+        || ! path_allowed(http->request.path)) {
+        return AD_OK;
+    }
+
+    char name[PATH_MAX];
+    const char *path = http->request.path;
+    ad_static_file_t *file = file_get(files, path);
+    if (file && file->type == AD_STATIC_DIR) {
+        file_release(files, file);
+        file = NULL;
+        if (snprintf(name, sizeof(name), "%s%s" AD_STATIC_INDEX, path,
+                     (path[1] == '\0') ? "" : "/") < sizeof(name)) {
+            file = file_get(files, name);
+        }
+    }
+    if (file == NULL || file->type != AD_STATIC_FILE) {
+        if (file) {
+            file_release(files, file);
+        }
+        return AD_OK;
+    }
+
+    // Look for precompressed siblings.
+    ad_static_file_t *body = file;
+    const char *coding = NULL;
+    bool vary = false;
+    for (int i = 0; i < sizeof(encodings) / sizeof(encodings[0]); i++) {
+        if (snprintf(name, sizeof(name), "%s%s", file->name, encodings[i].ext) >= sizeof(name)) {
+            continue;
+        }
+        ad_static_file_t *sibling = file_get(files, name);
+        if (sibling == NULL) {
+            continue;
+        }
+        if (sibling->type == AD_STATIC_FILE) {
+            vary = true;
+            if (coding == NULL && ad_http_accepts_encoding(conn, encodings[i].coding)) {
+                body = sibling;
+                coding = encodings[i].coding;
+                continue;
+            }
+        }
+        file_release(files, sibling);
+    }
+
+    int status = static_send(conn, file, body, coding, vary, head);
+    if (body != file) {
+        file_release(files, body);
+    }
+    file_release(files, file);
+    return status;
+}
+
+/******************************************************************************
+ * Private internal functions.
+ *****************************************************************************/
+#ifndef _DOXYGEN_SKIP
+
+/**
+ * Send the response for a file.
+ *
+ * @param file the requested file.
+ * @param body the file to send, either the requested one or its
+ *        precompressed sibling.
+ */
+static int static_send(ad_conn_t *conn, ad_static_file_t *file, ad_static_file_t *body,
+                       const char *coding, bool vary, bool head) {
+    bool keepalive = ad_http_is_keepalive_request(conn) && ! conn->server->draining;
+    ad_http_set_response_header(conn, "Connection", (keepalive) ? "Keep-Alive" : "close");
+    ad_http_set_response_header(conn, "Last-Modified", body->lastmod);
+    ad_http_set_response_header(conn, "ETag", body->etag);
+    ad_http_set_response_header(conn, "Accept-Ranges", "bytes");
+    if (vary) {
+        ad_http_set_response_header(conn, "Vary", "Accept-Encoding");
+    }
+    if (coding) {
+        ad_http_set_response_header(conn, "Content-Encoding", coding);
+    }
+
+    // Conditional request. If-Modified-Since is ignored with If-None-Match.
+    const char *inm = ad_http_get_request_header(conn, "If-None-Match");
+    const char *ims = ad_http_get_request_header(conn, "If-Modified-Since");
+    if ((inm) ? ad_http_match_etag(conn, body->etag) : (ims && not_modified_since(ims, body->mtime))) {
+        ad_http_set_response_code(conn, HTTP_CODE_NOT_MODIFIED, NULL);
+        ad_http_send_header(conn);
+        return (keepalive) ? AD_DONE : AD_CLOSE;
+    }
+
+    // Range request. A stale If-Range gets the whole file.
+    int code = HTTP_CODE_OK;
+    off_t offset = 0, length = body->size;
+    const char *range = ad_http_get_request_header(conn, "Range");
+    const char *ifrange = ad_http_get_request_header(conn, "If-Range");
+    if (range && (ifrange == NULL || ! strcmp(ifrange, body->etag)
+                  || ! strcmp(ifrange, body->lastmod))) {
+        char value[64];
+        int ret = parse_range(range, body->size, &offset, &length);
+        if (ret < 0) {
+            snprintf(value, sizeof(value), "bytes */%jd", (intmax_t)body->size);
+            ad_http_set_response_header(conn, "Content-Range", value);
+            ad_http_response(conn, HTTP_CODE_RANGE_NOT_SATISFIABLE, "text/plain",
+                             "416 Range Not Satisfiable\n", 26);
+            return (keepalive) ? AD_DONE : AD_CLOSE;
+        } else if (ret > 0) {
+            snprintf(value, sizeof(value), "bytes %jd-%jd/%jd", (intmax_t)offset,
+                     (intmax_t)(offset + length - 1), (intmax_t)body->size);
+            ad_http_set_response_header(conn, "Content-Range", value);
+            code = HTTP_CODE_PARTIAL_CONTENT;
+        }
+    }
+
+    ad_http_set_response_code(conn, code, NULL);
+    ad_http_set_response_content(conn, mimetype(file->name), length);
+    if (head || length == 0) {
+        ad_http_send_header(conn);
+    } else if (ad_http_send_file(conn, body->seg, offset, length) == 0) {
+        return AD_CLOSE;
+    }
+    return (keepalive) ? AD_DONE : AD_CLOSE;
+}
+
+/**
+ * Look up a file from the cache, open it if it's not there.
+ *
+ * @return the file with a reference taken, release it with
+ *         file_release(). NULL on allocation failure.
+ */
+static ad_static_file_t *file_get(ad_http_static_t *files, const char *name) {
+    time_t now = time(NULL);
+    pthread_mutex_lock(&files->lock);
+
+    ad_static_file_t **found = (ad_static_file_t **) files->files->get(files->files, name, NULL, false);
+    ad_static_file_t *file = (found) ? *found : NULL;
+    if (file) {
+        // Move to the front.
+        lru_remove(file_lru(files, file), file);
+        lru_push(file_lru(files, file), file);
+        file->refs++;
+        if (now - file->checked < AD_STATIC_REVALIDATE) {
+            pthread_mutex_unlock(&files->lock);
+            return file;
+        }
+    }
+    pthread_mutex_unlock(&files->lock);
+
+    if (file) {
+        // See if it has been changed since.
+        ad_static_file_t cur;
+        struct stat st;
+        char path[PATH_MAX];
+        bzero((void *)&cur, sizeof(cur));
+        if (snprintf(path, sizeof(path), "%s%s", files->rootdir, name) < sizeof(path)
+            && ! stat(path, &st)) {
+            file_stat(&cur, &st);
+        }
+        if (cur.type == file->type && cur.size == file->size && cur.mtime == file->mtime
+            && cur.dev == file->dev && cur.ino == file->ino) {
+            pthread_mutex_lock(&files->lock);
+            file->checked = now;
+            pthread_mutex_unlock(&files->lock);
+            return file;
+        }
+        file_release(files, file);
+    }
+
+    ad_static_file_t *opened = file_open(files, name);
+    if (opened == NULL) {
+        return NULL;
+    }
+    opened->checked = now;
+    opened->refs = 2;
+
+    // Replace what's there now, the stale one or one opened meanwhile.
+    pthread_mutex_lock(&files->lock);
+    found = (ad_static_file_t **) files->files->get(files->files, name, NULL, false);
+    if (found) {
+        file = *found;
+        file_unlink(files, file);
+        if (--file->refs == 0) {
+            file_free(file);
+        }
+    }
+    if (! files->files->put(files->files, opened->name, &opened, sizeof(ad_static_file_t *))) {
+        pthread_mutex_unlock(&files->lock);
+        file_free(opened);
+        return NULL;
+    }
+    ad_static_lru_t *lru = file_lru(files, opened);
+    lru_push(lru, opened);
+    while (lru->num > files->maxfiles && lru->tail) {
+        file = lru->tail;
+        file_unlink(files, file);
+        if (--file->refs == 0) {
+            file_free(file);
+        }
+    }
+
+    pthread_mutex_unlock(&files->lock);
+    return opened;
+}
+
+static void file_release(ad_http_static_t *files, ad_static_file_t *file) {
+    pthread_mutex_lock(&files->lock);
+    bool last = (--file->refs == 0);
+    pthread_mutex_unlock(&files->lock);
+    if (last) {
+        file_free(file);
+    }
+}
+
+/**
+ * Open a file under the document root.
+ *
+ * @return a new entry, with AD_STATIC_NONE type if it can't be served.
+ */
+static ad_static_file_t *file_open(ad_http_static_t *files, const char *name) {
+    ad_static_file_t *file = NEW_OBJECT(ad_static_file_t);
+    if (file == NULL) {
+        return NULL;
+    }
+    file->name = strdup(name);
+    if (file->name == NULL) {
+        free(file);
+        return NULL;
+    }
+
+    char path[PATH_MAX];
+    struct stat st;
+    if (snprintf(path, sizeof(path), "%s%s", files->rootdir, name) >= sizeof(path)
+        || stat(path, &st)) {
+        return file;
+    }
+    if (S_ISREG(st.st_mode)) {
+        int fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0 || fstat(fd, &st)) {
+            if (fd >= 0) {
+                close(fd);
+            }
+            return file;
+        }
+        if (st.st_size > 0) {
+            file->seg = evbuffer_file_segment_new(fd, 0, st.st_size, EVBUF_FS_CLOSE_ON_FREE);
+            if (file->seg == NULL) {
+                close(fd);
+                return file;
+            }
+        } else {
+            close(fd);
+        }
+    }
+    file_stat(file, &st);
+    return file;
+}
+
+/**
+ * Fill type, size and validators from stat results.
+ */
+static void file_stat(ad_static_file_t *file, struct stat *st) {
+    if (S_ISDIR(st->st_mode)) {
+        file->type = AD_STATIC_DIR;
+    } else if (S_ISREG(st->st_mode)) {
+        file->type = AD_STATIC_FILE;
+    } else {
+        return;
+    }
+    file->size = st->st_size;
+    file->mtime = st->st_mtime;
+    file->dev = st->st_dev;
+    file->ino = st->st_ino;
+
+    struct tm tm;
+    gmtime_r(&file->mtime, &tm);
+    strftime(file->lastmod, sizeof(file->lastmod), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    snprintf(file->etag, sizeof(file->etag), "\"%jx-%jx\"",
+             (uintmax_t)file->mtime, (uintmax_t)file->size);
+}
+
+/**
+ * Take the file out of the cache. The cache's reference is left to the
+ * caller to drop.
+ */
+static void file_unlink(ad_http_static_t *files, ad_static_file_t *file) {
+    files->files->remove(files->files, file->name);
+    lru_remove(file_lru(files, file), file);
+}
+
+static ad_static_lru_t *file_lru(ad_http_static_t *files, ad_static_file_t *file) {
+    return (file->type == AD_STATIC_NONE) ? &files->missing : &files->found;
+}
+
+static void lru_push(ad_static_lru_t *lru, ad_static_file_t *file) {
+    file->prev = NULL;
+    file->next = lru->head;
+    if (lru->head) {
+        lru->head->prev = file;
+    } else {
+        lru->tail = file;
+    }
+    lru->head = file;
+    lru->num++;
+}
+
+static void lru_remove(ad_static_lru_t *lru, ad_static_file_t *file) {
+    if (file->prev) {
+        file->prev->next = file->next;
+    } else {
+        lru->head = file->next;
+    }
+    if (file->next) {
+        file->next->prev = file->prev;
+    } else {
+        lru->tail = file->prev;
+    }
+    file->prev = file->next = NULL;
+    lru->num--;
+}
+
+static void file_free(ad_static_file_t *file) {
+    if (file->seg) {
+        evbuffer_file_segment_free(file->seg);
+    }
+    free(file->name);
+    free(file);
+}
+
+/**
+ * Check if the path has no ".." segment in it.
+ */
+static bool path_allowed(const char *path) {
+    for (const char *p = path; (p = strstr(p, "..")); p += 2) {
+        if ((p == path || p[-1] == '/') && (p[2] == '/' || p[2] == '\0')) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static const char *mimetype(const char *name) {
+    const char *ext = strrchr(name, '.');
+    if (ext && ! strchr(ext, '/')) {
+        for (int i = 0; i < sizeof(mimetypes) / sizeof(mimetypes[0]); i++) {
+            if (! strcasecmp(ext + 1, mimetypes[i].ext)) {
+                return mimetypes[i].type;
+            }
+        }
+    }
+    return HTTP_DEF_CONTENTTYPE;
+}
+
+static bool not_modified_since(const char *date, time_t mtime) {
+    struct tm tm;
+    bzero((void *)&tm, sizeof(tm));
+    const char *end = strptime(date, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    if (end == NULL || *end != '\0') {
+        return false;
+    }
+    return (mtime <= timegm(&tm));
+}
+
+/**
+ * Parse a single byte range.
+ *
+ * @return 1 with the offset and the length of the range, 0 to ignore it
+ *         and send the whole file, -1 if the range is not satisfiable.
+ */
+static int parse_range(const char *range, off_t size, off_t *offset, off_t *length) {
+    if (strncasecmp(range, "bytes=", CONST_STRLEN("bytes="))) {
+        return 0;
+    }
+    range += CONST_STRLEN("bytes=");
+    if (strchr(range, ',')) {
+        return 0;  // multiple ranges are not supported, send it all.
+    }
+
+    char *end;
+    if (*range == '-') {
+        // Suffix range ex) bytes=-500
+        long long n = strtoll(range + 1, &end, 10);
+        if (end == range + 1 || *end != '\0' || n < 0) {
+            return 0;
+        }
+        if (n == 0 || size == 0) {
+            return -1;
+        }
+        *offset = (n < size) ? size - n : 0;
+        *length = size - *offset;
+        return 1;
+    }
+
+    long long first = strtoll(range, &end, 10);
+    if (end == range || *end != '-' || first < 0) {
+        return 0;
+    }
+    range = end + 1;
+    long long last = size - 1;
+    if (*range != '\0') {
+        last = strtoll(range, &end, 10);
+        if (*end != '\0' || last < first) {
+            return 0;
+        }
+    }
+    if (first >= size) {
+        return -1;
+    }
+    if (last >= size) {
+        last = size - 1;
+    }
+    *offset = first;
+    *length = last - first + 1;
+    return 1;
+}
+
+#endif // _DOXYGEN_SKIP
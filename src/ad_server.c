@@ -38,9 +38,17 @@
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <errno.h>
+#include <ctype.h>
 #include <assert.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
 #include <sys/un.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
 #include <event2/event.h>
 #include <event2/bufferevent.h>
 #include <event2/bufferevent_ssl.h>
@@ -51,6 +59,10 @@
 #include <openssl/conf.h>
 #include <openssl/engine.h>
 #include <openssl/err.h>
+#include <openssl/hmac.h>
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#include <openssl/core_names.h>
+#endif
 #include "macro.h"
 #include "qlibc/qlibc.h"
 #include "ad_server.h"
@@ -62,6 +74,30 @@
 #endif
 
 #ifndef _DOXYGEN_SKIP
+/*
+ * Hot restart handoff.
+ */
+#define AD_HANDOFF_ACK      'A' /* the new process is accepting */
+#define AD_HANDOFF_TIMEOUT  (10)
+
+/*
+ * Listening sockets passed from other process.
+ */
+#define AD_LISTEN_FDS_START (3)     /* first descriptor by systemd */
+#define AD_LISTEN_FDS_MAX   (16)    /* max descriptors to take over */
+
+/*
+ * Milliseconds to pause accepting after running out of descriptors, and
+ * to check again when other workers hold all the connections allowed.
+ */
+#define AD_ACCEPT_BACKOFF   (100)
+
+/*
+ * Workers exited within this seconds after start are restarted after
+ * the same delay, so a crash loop doesn't spin the supervisor.
+ */
+#define AD_RESPAWN_DELAY    (1)
+
 /*
  * User callback hook container.
  */
@@ -72,11 +108,280 @@ struct ad_hook_s {
     void *userdata;
 };
 
+/*
+ * Suspended connection handle.
+ *
+ * A token is owned by the loop thread until ad_conn_resume() hands it over
+ * through the server's resume queue. The loop frees it after processing.
+ */
+struct ad_conn_token_s {
+    ad_server_t *server;    /* owning server */
+    ad_conn_t *conn;        /* NULL if connection was closed while suspended */
+    int status;             /* status given by ad_conn_resume() */
+    ad_conn_token_t *next;  /* link in resume queue */
+
+    // ad_conn_offload() only.
+    ad_job_cb job;          /* runs in a pool thread */
+    ad_done_cb done;        /* runs in the loop after the job */
+    void *arg;              /* argument for job and done */
+};
+
+/*
+ * TLS handshake done by the handshake thread pool.
+ *
+ * The pool thread drives SSL_accept() on the socket until it's done or
+ * the deadline has passed, and hands the result back through the server's
+ * handshake queue, so only the connection setup is left for the loop.
+ * Queued handshakes count as connections until they come back.
+ */
+#define AD_HANDSHAKE_TIMEOUT    (10)    /* seconds, if "server.timeout" is 0 */
+
+struct ad_handshake_s {
+    ad_server_t *server;
+    ad_listener_t *listener;
+    evutil_socket_t fd;
+    SSL *ssl;
+    int timeout;            /* seconds for the whole handshake */
+    bool ok;                /* handshake succeeded */
+    ad_handshake_t *next;   /* link in handshake queue */
+};
+
+/*
+ * Bounded multi-producer single-consumer message ring.
+ *
+ * Any thread can enqueue, only the loop dequeues. Each cell carries a
+ * sequence number telling whether it's ready for the producer (seq == pos)
+ * or for the consumer (seq == pos + 1), so no locks are needed.
+ */
+#define AD_MSGQ_MAXSIZE     (1 << 20)   /* cells */
+
+enum ad_msg_type_e {
+    AD_MSG_DRAIN = 0,   /* finish in-flight requests and exit the loop */
+    AD_MSG_USER,        /* call user function in the loop */
+};
+
+typedef struct ad_msg_s ad_msg_t;
+struct ad_msg_s {
+    enum ad_msg_type_e type;
+    ad_msg_cb cb;
+    void *arg;
+};
+
+typedef struct ad_msgq_cell_s ad_msgq_cell_t;
+struct ad_msgq_cell_s {
+    size_t seq;
+    ad_msg_t msg;
+};
+
+struct ad_msgq_s {
+    size_t mask;            /* number of cells - 1 */
+    ad_msgq_cell_t *cells;
+    size_t enqpos;          /* shared by producers */
+    size_t deqpos;          /* loop only */
+};
+
+/*
+ * Work-stealing thread pool.
+ *
+ * Each worker has its own job queue. Jobs are distributed round-robin and
+ * an idle worker steals from its siblings' queues before going to sleep.
+ */
+typedef struct ad_job_s ad_job_t;
+struct ad_job_s {
+    ad_job_cb fn;
+    void *arg;
+    ad_job_t *next;
+};
+
+typedef struct ad_worker_s ad_worker_t;
+struct ad_worker_s {
+    pthread_t thread;
+    pthread_mutex_t lock;   /* protects the queue */
+    ad_job_t *head;
+    ad_job_t *tail;
+    ad_pool_t *pool;
+};
+
+struct ad_pool_s {
+    int nworkers;
+    ad_worker_t *workers;
+    unsigned int next;      /* round-robin index for submissions */
+
+    pthread_mutex_t lock;   /* protects pending and shutdown */
+    pthread_cond_t cond;
+    size_t pending;         /* number of queued jobs */
+    bool shutdown;
+};
+
+/*
+ * TLS session cache and session ticket keys.
+ *
+ * Sessions are kept DER encoded in shards picked by the session id, so
+ * handshakes on different threads rarely wait for the same lock. Each
+ * shard evicts the oldest session when it's full.
+ *
+ * Ticket keys are derived from a random seed and the current rotation
+ * period. The previous period's key still decrypts tickets so clients
+ * don't lose sessions at rotation, and worker processes forked from
+ * the same server agree on the keys without talking to each other.
+ */
+#define AD_SSLCACHE_SHARDS  (16)
+
+typedef struct ad_sslcache_sess_s ad_sslcache_sess_t;
+struct ad_sslcache_sess_s {
+    unsigned int hash;
+    unsigned char id[SSL_MAX_SSL_SESSION_ID_LENGTH];
+    unsigned int idlen;
+    time_t expire;
+    ad_sslcache_sess_t *hnext;  /* hash chain */
+    ad_sslcache_sess_t *prev;   /* age list, oldest first */
+    ad_sslcache_sess_t *next;
+    int derlen;
+    unsigned char der[];
+};
+
+typedef struct ad_sslcache_shard_s ad_sslcache_shard_t;
+struct ad_sslcache_shard_s {
+    pthread_mutex_t lock;
+    ad_sslcache_sess_t **slots;
+    size_t mask;                /* number of slots - 1 */
+    ad_sslcache_sess_t *oldest;
+    ad_sslcache_sess_t *newest;
+    size_t num;
+};
+
+typedef struct ad_ticket_key_s ad_ticket_key_t;
+struct ad_ticket_key_s {
+    unsigned char name[16];
+    unsigned char aes[32];
+    unsigned char hmac[32];
+};
+
+struct ad_sslcache_s {
+    size_t max;                 /* max sessions per shard, 0 if disabled */
+    ad_sslcache_shard_t shards[AD_SSLCACHE_SHARDS];
+
+    int rotate;                 /* ticket key period, 0 if disabled */
+    uint64_t period;            /* current period */
+    unsigned char seed[32];
+    pthread_rwlock_t keylock;
+    ad_ticket_key_t keys[2];    /* current and previous */
+    struct event *timer;
+};
+
+/*
+ * SSL contexts by hostname for SNI.
+ *
+ * Handshakes look up with the read lock, so contexts can be added and
+ * swapped from any thread while the server is running.
+ */
+#define AD_SNI_NAME_MAX     (253)
+
+struct ad_sni_s {
+    pthread_rwlock_t lock;
+    qhashtbl_t *ctxs;       /* hostname -> SSL_CTX * */
+};
+
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+typedef const unsigned char ad_sslsess_id_t;
+#else
+typedef unsigned char ad_sslsess_id_t;
+#endif
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+typedef EVP_MAC_CTX ad_ticket_mac_t;
+#else
+typedef HMAC_CTX ad_ticket_mac_t;
+#endif
+
+/*
+ * Prefork state.
+ *
+ * The supervisor holds the listening sockets without accepting, forks
+ * workers, restarts crashed ones and tells them to drain on stop.
+ * Workers are independent servers sharing the listening sockets.
+ */
+struct ad_prefork_s {
+    int nworkers;
+    int worker;             /* worker index, -1 in the supervisor */
+    pid_t *pids;            /* supervisor only */
+    time_t *started;        /* supervisor only */
+    struct event *sigchld;  /* supervisor only */
+    struct event *sigterm;
+};
+
 /*
  * Local functions.
  */
-static int notify_loopexit(ad_server_t *server);
+static int notify_open(ad_server_t *server);
+static void notify_close(ad_server_t *server);
+static int notify_drain(ad_server_t *server);
+static void drain_server(ad_server_t *server);
+static void drain_timeout_cb(evutil_socket_t fd, short what, void *userdata);
+static void drain_check(ad_server_t *server);
+static int notify_msg(ad_server_t *server, enum ad_msg_type_e type, ad_msg_cb cb, void *arg);
+static int notify_wakeup(ad_server_t *server);
 static void notify_cb(struct bufferevent *buffer, void *userdata);
+static void dispatch_msgs(ad_server_t *server);
+static ad_msgq_t *msgq_new(int size);
+static int msgq_push(ad_msgq_t *q, const ad_msg_t *msg);
+static bool msgq_pop(ad_msgq_t *q, ad_msg_t *msg);
+static void msgq_free(ad_msgq_t *q);
+static void resume_conns(ad_server_t *server);
+static void release_token(ad_conn_token_t *token);
+static ad_pool_t *pool_new(int nworkers);
+static int pool_submit(ad_pool_t *pool, ad_job_cb fn, void *arg);
+static void pool_free(ad_pool_t *pool);
+static void *pool_worker(void *instance);
+static ad_job_t *pool_take(ad_worker_t *worker);
+static void offload_job(void *arg);
+static void mem_buffer_cb(struct evbuffer *buffer, const struct evbuffer_cb_info *info,
+                          void *userdata);
+static void mem_update(ad_server_t *server, ssize_t bytes);
+static void mem_shed_cb(evutil_socket_t fd, short what, void *userdata);
+static void accept_update(ad_server_t *server);
+static bool accept_full(ad_server_t *server);
+static void accept_error_cb(struct evconnlistener *evlistener, void *userdata);
+static void accept_resume_cb(evutil_socket_t fd, short what, void *userdata);
+static int handshake_start(ad_listener_t *listener, evutil_socket_t fd);
+static void handshake_job(void *arg);
+static void accept_handshakes(ad_server_t *server);
+static void handshake_free(ad_handshake_t *hs);
+static int prefork(ad_server_t *server, int nworkers);
+static int prefork_worker_init(ad_server_t *server, int worker);
+static int prefork_running(ad_prefork_t *prefork);
+static void prefork_drain(ad_server_t *server);
+static void prefork_free(ad_server_t *server);
+static void prefork_sigchld_cb(evutil_socket_t sig, short what, void *userdata);
+static void prefork_sigterm_cb(evutil_socket_t sig, short what, void *userdata);
+static void prefork_respawn_cb(evutil_socket_t fd, short what, void *userdata);
+static void prefork_kill_cb(evutil_socket_t fd, short what, void *userdata);
+static int shmstats_new(ad_server_t *server, int nslots);
+static void sslctx_setup(ad_server_t *server, SSL_CTX *sslctx);
+static int sni_name(char *name, const char *hostname);
+static SSL_CTX *sni_lookup(ad_sni_t *sni, const char *name);
+static int sni_cb(SSL *ssl, int *alert, void *userdata);
+static void sni_free(ad_sni_t *sni);
+static int sslcache_init(ad_server_t *server);
+static void sslcache_setup(ad_server_t *server, SSL_CTX *sslctx);
+static void sslcache_free(ad_server_t *server);
+static void sslctx_index_init(void);
+static ad_sslcache_t *sslcache_get(SSL *ssl);
+static unsigned int sslcache_hash(const unsigned char *id, unsigned int idlen);
+static void sslcache_insert(ad_sslcache_t *cache, ad_sslcache_sess_t *sess);
+static void sslcache_unlink(ad_sslcache_shard_t *shard, ad_sslcache_sess_t *sess);
+static ad_sslcache_sess_t *sslcache_find(ad_sslcache_shard_t *shard, unsigned int hash,
+                                         const unsigned char *id, unsigned int idlen);
+static int sslcache_new_cb(SSL *ssl, SSL_SESSION *session);
+static SSL_SESSION *sslcache_get_cb(SSL *ssl, ad_sslsess_id_t *id, int idlen, int *copy);
+static void sslcache_remove_cb(SSL_CTX *sslctx, SSL_SESSION *session);
+static void sslcache_derive_key(ad_sslcache_t *cache, uint64_t period, ad_ticket_key_t *key);
+static void sslcache_rotate(ad_sslcache_t *cache);
+static void sslcache_rotate_cb(evutil_socket_t fd, short what, void *userdata);
+static int sslcache_ticket_cb(SSL *ssl, unsigned char *name, unsigned char *iv,
+                              EVP_CIPHER_CTX *ectx, ad_ticket_mac_t *hctx, int enc);
+static int sslcache_ticket_mac(ad_ticket_mac_t *hctx, ad_ticket_key_t *key);
+static void shmstats_free(ad_server_t *server);
 static void *server_loop(void *instance);
 static void close_server(ad_server_t *server);
 static void libevent_log_cb(int severity, const char *msg);
@@ -85,8 +390,22 @@ static SSL_CTX *init_ssl(const char *cert_path, const char *pkey_path);
 static void listener_cb(struct evconnlistener *listener,
                         evutil_socket_t evsocket, struct sockaddr *sockaddr,
                         int socklen, void *userdata);
-static ad_conn_t *conn_new(ad_server_t *server, struct bufferevent *buffer);
+static int listener_bind(ad_listener_t *listener);
+static int listener_new_fd(ad_listener_t *listener, evutil_socket_t fd);
+static int listeners_adopt(ad_server_t *server, int *fds, int nfds);
+static void listener_set_timeouts(ad_listener_t *listener, struct bufferevent *buffer);
+static void listener_free(ad_listener_t *listener);
+static int inherited_fds(ad_server_t *server, int *fds, int maxfds);
+static int handoff_receive(ad_server_t *server, const char *path);
+static int handoff_listen(ad_server_t *server, const char *path);
+static void handoff_cb(struct evconnlistener *listener,
+                       evutil_socket_t sock, struct sockaddr *sockaddr,
+                       int socklen, void *userdata);
+static void handoff_ack_cb(evutil_socket_t sock, short what, void *userdata);
+static ad_conn_t *conn_new(ad_server_t *server, ad_listener_t *listener,
+                           struct bufferevent *buffer);
 static void conn_reset(ad_conn_t *conn);
+static void conn_ktls(ad_conn_t *conn);
 static void conn_free(ad_conn_t *conn);
 static void conn_read_cb(struct bufferevent *buffer, void *userdata) ;
 static void conn_write_cb(struct bufferevent *buffer, void *userdata);
@@ -100,6 +419,8 @@ static void *get_userdata(ad_conn_t *conn, int index);
  * Local variables.
  */
 static bool initialized = false;
+static int sslctx_index = -1;  /* SSL_CTX ex_data slot for the server */
+static pthread_once_t sslctx_index_once = PTHREAD_ONCE_INIT;
 #endif
 
 /*
@@ -144,10 +465,17 @@ ad_server_t *ad_server_new(void) {
     }
 
     // Initialize instance.
+    server->spare_fd = -1;
     server->options = qhashtbl(0, 0);
     server->stats = qhashtbl(100, QHASHTBL_THREADSAFE);
     server->hooks = qlist(0);
-    if (server->options == NULL || server->stats == NULL || server->hooks == NULL) {
+    server->sni = NEW_OBJECT(ad_sni_t);
+    if (server->sni) {
+        pthread_rwlock_init(&server->sni->lock, NULL);
+        server->sni->ctxs = qhashtbl(0, 0);
+    }
+    if (server->options == NULL || server->stats == NULL || server->hooks == NULL
+        || server->sni == NULL || server->sni->ctxs == NULL) {
         ad_server_free(server);
         return NULL;
     }
@@ -175,42 +503,6 @@ int ad_server_start(ad_server_t *server) {
         }
     }
 
-    // Parse addr
-    int port = ad_server_get_option_int(server, "server.port");
-    char *addr = ad_server_get_option(server, "server.addr");
-    struct sockaddr *sockaddr = NULL;
-    size_t sockaddr_len = 0;
-    if (addr[0] == '/') {  // Unix socket.
-        struct sockaddr_un unixaddr;
-        bzero((void *) &unixaddr, sizeof(struct sockaddr_un));
-        if (strlen(addr) >= sizeof(unixaddr.sun_path)) {
-            errno = EINVAL;
-            DEBUG("Too long unix socket name. '%s'", addr);
-            return -1;
-        }
-        unixaddr.sun_family = AF_UNIX;
-        strcpy(unixaddr.sun_path, addr);  // no need of strncpy()
-        sockaddr = (struct sockaddr *) &unixaddr;
-        sockaddr_len = sizeof(unixaddr);
-    } else if (strstr(addr, ":")) {  // IPv6
-        struct sockaddr_in6 ipv6addr;
-        bzero((void *) &ipv6addr, sizeof(struct sockaddr_in6));
-        ipv6addr.sin6_family = AF_INET6;
-        ipv6addr.sin6_port = htons(port);
-        evutil_inet_pton(AF_INET6, addr, &ipv6addr.sin6_addr);
-        sockaddr = (struct sockaddr *) &ipv6addr;
-        sockaddr_len = sizeof(ipv6addr);
-    } else {  // IPv4
-        struct sockaddr_in ipv4addr;
-        bzero((void *) &ipv4addr, sizeof(struct sockaddr_in));
-        ipv4addr.sin_family = AF_INET;
-        ipv4addr.sin_port = htons(port);
-        ipv4addr.sin_addr.s_addr =
-                (IS_EMPTY_STR(addr)) ? INADDR_ANY : inet_addr(addr);
-        sockaddr = (struct sockaddr *) &ipv4addr;
-        sockaddr_len = sizeof(ipv4addr);
-    }
-
     // SSL
     if (!server->sslctx && ad_server_get_option_int(server, "server.enable_ssl")) {
         char *cert_path = ad_server_get_option(server, "server.ssl_cert");
@@ -233,29 +525,167 @@ int ad_server_start(ad_server_t *server) {
         }
     }
 
-    // Create a eventfd for notification channel.
-#ifdef __linux__
-    int notifyfd = eventfd(0, 0);
-#else
-    int notifyfd = kqueue();
-#endif
-    server->notify_buffer = bufferevent_socket_new(server->evbase, notifyfd, BEV_OPT_CLOSE_ON_FREE);
-    bufferevent_setcb(server->notify_buffer, NULL, notify_cb, NULL, server);
-
-    if (! server->listener) {
-        server->listener = evconnlistener_new_bind(
-                server->evbase, listener_cb, (void *)server,
-                LEV_OPT_THREADSAFE | LEV_OPT_REUSEABLE | LEV_OPT_CLOSE_ON_FREE,
-                ad_server_get_option_int(server, "server.backlog"),
-                sockaddr, sockaddr_len);
-        if (! server->listener) {
-            ERROR("Failed to bind on %s:%d", addr, port);
+    // Create a message queue and eventfd for notification channel.
+    if (notify_open(server)) {
+        return -1;
+    }
+
+    // Listen on "server.addr" unless listeners are given.
+    if (server->listeners == NULL) {
+        ad_listener_t *listener = ad_server_add_listener(
+                server, ad_server_get_option(server, "server.addr"),
+                ad_server_get_option_int(server, "server.port"));
+        if (! listener) {
+            return -1;
+        }
+        listener->sslctx = server->sslctx;
+    }
+
+    // Adopt sockets bound by someone else.
+    int fds[AD_LISTEN_FDS_MAX];
+    int nfds = inherited_fds(server, fds, AD_LISTEN_FDS_MAX);
+    if (nfds > 0) {
+        if (listeners_adopt(server, fds, nfds)) {
+            ERROR("Failed to listen on inherited sockets.");
+            return -1;
+        }
+        INFO("Using %d inherited listening socket(s).", nfds);
+    }
+
+    // Take over listening sockets from the running process.
+    char *handoff_path = ad_server_get_option(server, "server.handoff_path");
+    if (nfds == 0 && ! IS_EMPTY_STR(handoff_path)) {
+        if (handoff_receive(server, handoff_path) < 0) {
+            return -1;
+        }
+    }
+
+    // Bind the rest.
+    ad_listener_t *listener;
+    for (listener = server->listeners; listener; listener = listener->next) {
+        if (! listener->listener && listener_bind(listener)) {
+            ERROR("Failed to bind on %s:%d", listener->addr, listener->port);
+            return -1;
+        }
+    }
+    server->listener = server->listeners->listener;
+
+    // SSL contexts.
+    if (sslcache_init(server)) {
+        ERROR("Failed to initialize SSL session cache.");
+        return -1;
+    }
+    if (server->sslcache) {
+        for (listener = server->listeners; listener; listener = listener->next) {
+            if (listener->sslctx) {
+                sslctx_setup(server, listener->sslctx);
+            }
+        }
+        pthread_rwlock_wrlock(&server->sni->lock);
+        qhashtbl_obj_t obj;
+        bzero((void *)&obj, sizeof(qhashtbl_obj_t));
+        while (server->sni->ctxs->getnext(server->sni->ctxs, &obj, false)) {
+            sslctx_setup(server, *(SSL_CTX **)obj.data);
+        }
+        pthread_rwlock_unlock(&server->sni->lock);
+    }
+
+    // Open the channel for the next process.
+    if (! server->handoff && ! IS_EMPTY_STR(handoff_path)) {
+        if (handoff_listen(server, handoff_path)) {
+            ERROR("Failed to open handoff channel on %s", handoff_path);
             return -1;
         }
     }
 
     // Listen
-    INFO("Listening on %s:%d%s", addr, port, ((server->sslctx) ? " (SSL)" : ""));
+    for (listener = server->listeners; listener; listener = listener->next) {
+        INFO("Listening on %s:%d%s", listener->addr, listener->port,
+             ((listener->sslctx) ? " (SSL)" : ""));
+    }
+
+    // Shared stats.
+    int workers = ad_server_get_option_int(server, "server.workers");
+    char *stats_shm = ad_server_get_option(server, "server.stats_shm");
+    if (! server->shmstats && (workers > 0 || ! IS_EMPTY_STR(stats_shm))) {
+        if (shmstats_new(server, (workers > 0) ? workers : 1)) {
+            ERROR("Failed to create shared stats. (%s)", strerror(errno));
+            return -1;
+        }
+        if (workers <= 0) {
+            server->mystats = &server->shmstats->workers[0];
+            server->mystats->pid = getpid();
+            server->mystats->starts++;
+        }
+    }
+
+    // Fork workers. Only workers come out of here, the supervisor
+    // returns when all the workers are finished.
+    if (workers > 0 && ! server->prefork) {
+        if (ad_server_get_option_int(server, "server.thread")) {
+            ERROR("Worker processes can't be used with \"server.thread\".");
+            return -1;
+        }
+        int ret = prefork(server, workers);
+        if (ret < 0) {
+            return -1;
+        } else if (ret > 0) {
+            close_server(server);
+            if (ad_server_get_option_int(server, "server.free_on_stop")) {
+                ad_server_free(server);
+            }
+            return 0;
+        }
+    }
+
+    // Memory limits.
+    char *mem_limit = ad_server_get_option(server, "server.mem_limit");
+    char *mem_hard_limit = ad_server_get_option(server, "server.mem_hard_limit");
+    server->mem_limit = (mem_limit) ? strtoull(mem_limit, NULL, 10) : 0;
+    server->mem_hard_limit = (mem_hard_limit) ? strtoull(mem_hard_limit, NULL, 10) : 0;
+    if (server->mem_hard_limit > 0 && ! server->mem_event) {
+        server->mem_event = event_new(server->evbase, -1, 0, mem_shed_cb, server);
+        if (! server->mem_event) {
+            ERROR("Failed to create an event.");
+            return -1;
+        }
+    }
+
+    // Connection limits.
+    server->max_conns = ad_server_get_option_int(server, "server.max_connections");
+    server->max_conns_global = ad_server_get_option_int(server, "server.max_connections_global");
+    if (! server->accept_event) {
+        server->accept_event = evtimer_new(server->evbase, accept_resume_cb, server);
+        if (! server->accept_event) {
+            ERROR("Failed to create an event.");
+            return -1;
+        }
+    }
+    if (server->spare_fd < 0) {
+        server->spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    }
+
+    // Offload thread pool.
+    int offload_threads = ad_server_get_option_int(server, "server.offload_threads");
+    if (offload_threads > 0 && ! server->pool) {
+        server->pool = pool_new(offload_threads);
+        if (! server->pool) {
+            ERROR("Failed to create offload thread pool.");
+            return -1;
+        }
+        DEBUG("Offload thread pool started. (threads:%d)", offload_threads);
+    }
+
+    // TLS handshake thread pool.
+    int handshake_threads = ad_server_get_option_int(server, "server.ssl_handshake_threads");
+    if (handshake_threads > 0 && server->sslcache && ! server->hspool) {
+        server->hspool = pool_new(handshake_threads);
+        if (! server->hspool) {
+            ERROR("Failed to create TLS handshake thread pool.");
+            return -1;
+        }
+        DEBUG("TLS handshake thread pool started. (threads:%d)", handshake_threads);
+    }
 
     int exitstatus = 0;
     if (ad_server_get_option_int(server, "server.thread")) {
@@ -282,12 +712,17 @@ int ad_server_start(ad_server_t *server) {
  *
  * This call is be used to stop a server from different thread.
  *
- * @return 0 if successful, otherwise -1.
+ * The server stops accepting new connections, closes idle connections and
+ * lets in-flight requests finish with "Connection: close" up to
+ * "server.drain_timeout" seconds before the loop exits.
+ *
+ * @note
+ *   If the server runs as a thread, this call returns after the loop
+ *   has finished. Otherwise ad_server_start() returns when it's done.
  */
 void ad_server_stop(ad_server_t *server) {
-    DEBUG("Send loopexit notification.");
-    notify_loopexit(server);
-    sleep(1);
+    DEBUG("Send drain notification.");
+    notify_drain(server);
 
     if (ad_server_get_option_int(server, "server.thread")) {
         close_server(server);
@@ -305,11 +740,38 @@ void ad_server_free(ad_server_t *server) {
 
     int thread = ad_server_get_option_int(server, "server.thread");
     if (thread && server->thread) {
-        notify_loopexit(server);
-        sleep(1);
+        notify_drain(server);
         close_server(server);
     }
 
+    while (server->listeners) {
+        ad_listener_t *listener = server->listeners;
+        server->listeners = listener->next;
+        listener_free(listener);
+    }
+
+    if (server->shmstats) {
+        shmstats_free(server);
+    }
+    if (server->sslcache) {
+        sslcache_free(server);
+    }
+    if (server->sni) {
+        sni_free(server->sni);
+    }
+    if (server->prefork) {
+        prefork_free(server);
+    }
+    if (server->mem_event) {
+        event_free(server->mem_event);
+    }
+    if (server->accept_event) {
+        event_free(server->accept_event);
+    }
+    if (server->spare_fd >= 0) {
+        close(server->spare_fd);
+    }
+
     if (server->evbase) {
         event_base_free(server->evbase);
     }
@@ -327,13 +789,7 @@ void ad_server_free(ad_server_t *server) {
         server->stats->free(server->stats);
     }
     if (server->hooks) {
-        qlist_t *tbl = server->hooks;
-        ad_hook_t *hook;
-        while ((hook = tbl->popfirst(tbl, NULL))) {
-            if (hook->method) free(hook->method);
-            free(hook);
-        }
-        server->hooks->free(server->hooks);
+        ad_hooks_free(server->hooks);
     }
     free(server);
     DEBUG("Server terminated.");
@@ -433,6 +889,13 @@ SSL_CTX *ad_server_ssl_ctx_create_simple(const char *cert_path,
  */
 void ad_server_set_ssl_ctx(ad_server_t *server, SSL_CTX *sslctx) {
     
+    ad_listener_t *listener;
+    for (listener = server->listeners; listener; listener = listener->next) {
+        if (listener->sslctx && listener->sslctx == server->sslctx) {
+            listener->sslctx = sslctx;
+        }
+    }
+
     if (server->sslctx) {
         SSL_CTX_free(server->sslctx);
     }
@@ -456,149 +919,2165 @@ SSL_CTX *ad_server_get_ssl_ctx(ad_server_t *server) {
 }
 
 /**
- * Return internal statistic counter map.
- */
-qhashtbl_t *ad_server_get_stats(ad_server_t *server, const char *key) {
-    return server->stats;
-}
-
-/**
- * Register user hook.
+ * Add SSL_CTX for a hostname. SSL listeners pick it by the hostname the
+ * client sent in SNI extension.
+ *
+ * @param hostname exact hostname or wildcard for one label such as
+ *        "*.example.com".
+ * @param sslctx SSL_CTX for the hostname. The server takes the ownership.
+ *
+ * @return 0 if successful, -1 on error.
+ *
+ * @note
+ *   This can be called from any thread while the server is running.
+ *   A context already added for the hostname is replaced and released
+ *   once the handshakes using it are finished. Clients without SNI or
+ *   with unknown hostname get the listener's SSL_CTX.
  */
-void ad_server_register_hook(ad_server_t *server, ad_callback cb, void *userdata) {
-    ad_server_register_hook_on_method(server, NULL, cb, userdata);
-}
+int ad_server_add_ssl_ctx(ad_server_t *server, const char *hostname, SSL_CTX *sslctx) {
+    char name[AD_SNI_NAME_MAX + 1];
+    if (sslctx == NULL || sni_name(name, hostname)) {
+        return -1;
+    }
+    if (server->sslcache) {
+        sslctx_setup(server, sslctx);
+    }
 
-/**
- * Register user hook on method name.
- */
-void ad_server_register_hook_on_method(ad_server_t *server, const char *method, ad_callback cb, void *userdata) {
-    ad_hook_t hook;
-    bzero((void *)&hook, sizeof(ad_hook_t));
-    hook.method = (method) ? strdup(method) : NULL;
-    hook.cb = cb;
-    hook.userdata = userdata;
+    ad_sni_t *sni = server->sni;
+    pthread_rwlock_wrlock(&sni->lock);
+    SSL_CTX *old = sni_lookup(sni, name);
+    bool added = sni->ctxs->put(sni->ctxs, name, &sslctx, sizeof(SSL_CTX *));
+    pthread_rwlock_unlock(&sni->lock);
+    if (! added) {
+        return -1;
+    }
 
-    server->hooks->addlast(server->hooks, (void *)&hook, sizeof(ad_hook_t));
+    if (old && old != sslctx) {
+        SSL_CTX_free(old);
+    }
+    return 0;
 }
 
 /**
- * Attach userdata into the connection.
+ * Remove and release SSL_CTX added for the hostname.
  *
- * @return previous userdata;
+ * @return 0 if successful, -1 if there's no such hostname.
  */
-void *ad_conn_set_userdata(ad_conn_t *conn, const void *userdata, ad_userdata_free_cb free_cb) {
-    return set_userdata(conn, 0, userdata, free_cb);
+int ad_server_remove_ssl_ctx(ad_server_t *server, const char *hostname) {
+    char name[AD_SNI_NAME_MAX + 1];
+    if (sni_name(name, hostname)) {
+        return -1;
+    }
+
+    ad_sni_t *sni = server->sni;
+    pthread_rwlock_wrlock(&sni->lock);
+    SSL_CTX *old = sni_lookup(sni, name);
+    if (old) {
+        sni->ctxs->remove(sni->ctxs, name);
+    }
+    pthread_rwlock_unlock(&sni->lock);
+
+    if (old == NULL) {
+        return -1;
+    }
+    SSL_CTX_free(old);
+    return 0;
 }
 
 /**
- * Get userdata attached in the connection.
- *
- * @return previous userdata;
+ * Return internal statistic counter map.
  */
-void *ad_conn_get_userdata(ad_conn_t *conn) {
-    return get_userdata(conn, 0);
+qhashtbl_t *ad_server_get_stats(ad_server_t *server, const char *key) {
+    return server->stats;
 }
 
 /**
- * Set extra userdata into the connection.
+ * Post a message to the server's loop. This can be called from any thread.
  *
- * @return previous userdata;
+ * The callback is called in the loop thread, so it's safe to touch the
+ * server and its connections from there. Messages are delivered in order
+ * of arrival and in batches, and posting many messages at once costs a
+ * single wakeup of the loop.
+ *
+ * @param cb callback function to call in the loop.
+ * @param arg argument for the callback.
+ *
+ * @return 0 if successful, -1 if the queue is full or server isn't running.
  *
  * @note
- *   Extra userdata is for default protocol handler such as ad_http_handler to
- *   provide higher abstraction. End users should always use only ad_conn_set_userdata()
- *   to avoid any conflict with default handlers.
+ *   The queue is lock-free and bounded by "server.msgq_size" option.
+ *   Messages still queued when the loop finishes are delivered when
+ *   the server is closed.
  */
-void *ad_conn_set_extra(ad_conn_t *conn, const void *extra, ad_userdata_free_cb free_cb) {
-    return set_userdata(conn, 1, extra, free_cb);
+int ad_server_post(ad_server_t *server, ad_msg_cb cb, void *arg) {
+    if (cb == NULL) {
+        return -1;
+    }
+    return notify_msg(server, AD_MSG_USER, cb, arg);
 }
 
 /**
- * Get extra userdata attached in this connection.
+ * Return the stats shared by the server processes.
+ *
+ * Stats are kept when "server.workers" or "server.stats_shm" option is
+ * set. Each worker counts on its own slot, so reading the counters
+ * needs no locking and no system call.
+ *
+ * @return shared stats, NULL if not enabled.
+ *
+ * @see ad_shmstats_open()
  */
-void *ad_conn_get_extra(ad_conn_t *conn) {
-    return get_userdata(conn, 1);
+ad_shmstats_t *ad_server_get_shmstats(ad_server_t *server) {
+    return server->shmstats;
 }
 
 /**
- * Set method name on this connection.
+ * Map server stats from other process in read-only mode.
  *
- * Once the method name is set, hooks registered by ad_server_register_hook_on_method()
- * will be called if method name matches with the registered name.
+ * @param name name given by "server.stats_shm" option.
  *
- * @see ad_server_register_hook_on_method()
+ * @return shared stats, NULL on error.
+ *
+ * @code
+ *   ad_shmstats_t *stats = ad_shmstats_open("/ad_server");
+ *   for (int i = 0; i < stats->nworkers; i++) {
+ *       printf("%d %ju\n", stats->workers[i].pid,
+ *              stats->workers[i].accepted - stats->workers[i].closed);
+ *   }
+ *   ad_shmstats_close(stats);
+ * @endcode
  */
-void ad_conn_set_method(ad_conn_t *conn, char *method) {
-    char *prev = conn->method;
-    conn->method = (method != NULL) ? strdup(method) : NULL;
-    if (prev) {
-        free(prev);
+ad_shmstats_t *ad_shmstats_open(const char *name) {
+    int fd = shm_open(name, O_RDONLY, 0);
+    if (fd < 0) {
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) || st.st_size < sizeof(ad_shmstats_t)) {
+        close(fd);
+        return NULL;
+    }
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return NULL;
+    }
+
+    ad_shmstats_t *stats = (ad_shmstats_t *)map;
+    if (st.st_size < sizeof(ad_shmstats_t) + sizeof(ad_worker_stats_t) * stats->nworkers) {
+        munmap(map, st.st_size);
+        return NULL;
     }
+    return stats;
 }
 
 /**
- * Return socket file descriptor associated with a connection.
+ * Unmap stats mapped by ad_shmstats_open().
  */
-int ad_conn_get_socket(ad_conn_t *conn) {
-    return bufferevent_getfd(conn->buffer);
+void ad_shmstats_close(ad_shmstats_t *stats) {
+    if (stats) {
+        munmap(stats, sizeof(ad_shmstats_t) + sizeof(ad_worker_stats_t) * stats->nworkers);
+    }
 }
 
-/******************************************************************************
- * Private internal functions.
- *****************************************************************************/
-#ifndef _DOXYGEN_SKIP
-
 /**
- * If there's no event, loopbreak or loopexit call won't work until one more
- * event arrived. So we use eventfd as a internal notification channel to let
- * server get out of the loop without waiting for an event.
+ * Register user hook.
  */
-static int notify_loopexit(ad_server_t *server) {
-    uint64_t x = 0;
-    return bufferevent_write(server->notify_buffer, &x, sizeof(uint64_t));
+void ad_server_register_hook(ad_server_t *server, ad_callback cb, void *userdata) {
+    ad_server_register_hook_on_method(server, NULL, cb, userdata);
+}
+
+/**
+ * Register user hook on method name.
+ */
+void ad_server_register_hook_on_method(ad_server_t *server, const char *method, ad_callback cb, void *userdata) {
+    ad_hooks_add(server->hooks, method, cb, userdata);
+}
+
+/**
+ * Add a listener to the server.
+ *
+ * A server can listen on multiple addresses at the same time, each with
+ * its own backlog, SSL context, timeouts and hooks. Connections from all
+ * the listeners are served by the same loop. If no listener is added,
+ * one listener is made from "server.addr" and "server.port" options.
+ *
+ * @param addr address to bind. same format as "server.addr" option.
+ * @param port port number to bind. not used for unix socket.
+ *
+ * @return listener object, NULL on error.
+ *
+ * @code
+ *   ad_listener_t *http = ad_server_add_listener(server, "0.0.0.0", 80);
+ *   ad_listener_t *https = ad_server_add_listener(server, "0.0.0.0", 443);
+ *   ad_listener_set_ssl_ctx(https, ad_server_ssl_ctx_create_simple(cert, pkey));
+ *   ad_listener_t *admin = ad_server_add_listener(server, "/var/run/admin.sock", 0);
+ *   ad_listener_register_hook(admin, ad_http_handler, NULL);
+ *   ad_listener_register_hook(admin, my_admin_handler, NULL);
+ * @endcode
+ *
+ * @note
+ *   Listeners must be added before the server starts. Sockets passed by
+ *   "server.listen_fd", socket activation or hot restart are assigned to
+ *   the listeners in the order they were added.
+ */
+ad_listener_t *ad_server_add_listener(ad_server_t *server, const char *addr, int port) {
+    ad_listener_t *listener = NEW_OBJECT(ad_listener_t);
+    if (listener == NULL) {
+        return NULL;
+    }
+    listener->server = server;
+    listener->addr = strdup((addr) ? addr : "");
+    if (listener->addr == NULL) {
+        free(listener);
+        return NULL;
+    }
+    listener->port = port;
+    listener->backlog = -1;
+    listener->timeout = -1;
+
+    // Keep the added order.
+    ad_listener_t **tail = &server->listeners;
+    while (*tail) {
+        tail = &(*tail)->next;
+    }
+    *tail = listener;
+
+    return listener;
+}
+
+/**
+ * Set listen backlog of the listener. -1 to follow "server.backlog".
+ */
+void ad_listener_set_backlog(ad_listener_t *listener, int backlog) {
+    listener->backlog = backlog;
+}
+
+/**
+ * Set timeouts of the connections accepted by the listener.
+ *
+ * @param read_timeout read timeout seconds. 0 means no timeout,
+ *        -1 to follow "server.timeout".
+ * @param write_timeout write timeout seconds. 0 means no timeout.
+ */
+void ad_listener_set_timeout(ad_listener_t *listener, int read_timeout, int write_timeout) {
+    listener->timeout = read_timeout;
+    listener->write_timeout = write_timeout;
+}
+
+/**
+ * Attach OpenSSL SSL_CTX to the listener.
+ *
+ * The listener takes the ownership of the object. NULL makes the listener
+ * plain. "server.enable_ssl" option and ad_server_set_ssl_ctx() apply to
+ * the default listener only.
+ */
+void ad_listener_set_ssl_ctx(ad_listener_t *listener, SSL_CTX *sslctx) {
+    if (listener->sslctx && listener->sslctx != listener->server->sslctx) {
+        SSL_CTX_free(listener->sslctx);
+    }
+    listener->sslctx = sslctx;
+}
+
+/**
+ * Register hook on the listener.
+ *
+ * Once a hook is registered on the listener, connections accepted by
+ * the listener run the listener's hooks instead of the server's.
+ */
+void ad_listener_register_hook(ad_listener_t *listener, ad_callback cb, void *userdata) {
+    ad_listener_register_hook_on_method(listener, NULL, cb, userdata);
+}
+
+/**
+ * Register hook on the listener on method name.
+ */
+void ad_listener_register_hook_on_method(ad_listener_t *listener, const char *method,
+                                         ad_callback cb, void *userdata) {
+    if (listener->hooks == NULL) {
+        listener->hooks = qlist(0);
+    }
+    ad_hooks_add(listener->hooks, method, cb, userdata);
+}
+
+/**
+ * Add a hook to a hook chain.
+ *
+ * Server and listeners keep their hooks in chains of this form. Modules
+ * dispatching to hooks of their own, like ad_http_vhost(), use the same
+ * so the hooks behave the same way. See ad_hooks_call().
+ *
+ * @param hooks hook chain created by qlist().
+ * @param method method name to run the hook on. NULL for any method.
+ */
+void ad_hooks_add(qlist_t *hooks, const char *method, ad_callback cb, void *userdata) {
+    ad_hook_t hook;
+    bzero((void *)&hook, sizeof(ad_hook_t));
+    hook.method = (method) ? strdup(method) : NULL;
+    hook.cb = cb;
+    hook.userdata = userdata;
+
+    hooks->addlast(hooks, (void *)&hook, sizeof(ad_hook_t));
+}
+
+/**
+ * Run the hooks of a chain in the registered order.
+ *
+ * @return the first status other than AD_OK, AD_TAKEOVER if a hook
+ *         suspended the connection, otherwise AD_OK.
+ */
+int ad_hooks_call(qlist_t *hooks, short event, ad_conn_t *conn) {
+    ad_conn_token_t *token = conn->token;
+    qlist_obj_t obj;
+    bzero((void *)&obj, sizeof(qlist_obj_t));
+    while (hooks->getnext(hooks, &obj, false) == true) {
+        ad_hook_t *hook = (ad_hook_t *)obj.data;
+        if (hook->cb) {
+            if (hook->method && conn->method && strcmp(hook->method, conn->method)) {
+                continue;
+            }
+            int status = hook->cb(event, conn, hook->userdata);
+            if (conn->token != token) {
+                // Suspended by this hook, skip the rest.
+                return AD_TAKEOVER;
+            }
+            if (status != AD_OK) {
+                return status;
+            }
+        }
+    }
+    return AD_OK;
+}
+
+/**
+ * Release a hook chain.
+ */
+void ad_hooks_free(qlist_t *hooks) {
+    ad_hook_t *hook;
+    while ((hook = hooks->popfirst(hooks, NULL))) {
+        if (hook->method) free(hook->method);
+        free(hook);
+    }
+    hooks->free(hooks);
+}
+
+/**
+ * Attach userdata into the connection.
+ *
+ * @return previous userdata;
+ */
+void *ad_conn_set_userdata(ad_conn_t *conn, const void *userdata, ad_userdata_free_cb free_cb) {
+    return set_userdata(conn, 0, userdata, free_cb);
+}
+
+/**
+ * Get userdata attached in the connection.
+ *
+ * @return previous userdata;
+ */
+void *ad_conn_get_userdata(ad_conn_t *conn) {
+    return get_userdata(conn, 0);
+}
+
+/**
+ * Set extra userdata into the connection.
+ *
+ * @return previous userdata;
+ *
+ * @note
+ *   Extra userdata is for default protocol handler such as ad_http_handler to
+ *   provide higher abstraction. End users should always use only ad_conn_set_userdata()
+ *   to avoid any conflict with default handlers.
+ */
+void *ad_conn_set_extra(ad_conn_t *conn, const void *extra, ad_userdata_free_cb free_cb) {
+    return set_userdata(conn, 1, extra, free_cb);
+}
+
+/**
+ * Get extra userdata attached in this connection.
+ */
+void *ad_conn_get_extra(ad_conn_t *conn) {
+    return get_userdata(conn, 1);
+}
+
+/**
+ * Set method name on this connection.
+ *
+ * Once the method name is set, hooks registered by ad_server_register_hook_on_method()
+ * will be called if method name matches with the registered name.
+ *
+ * @see ad_server_register_hook_on_method()
+ */
+void ad_conn_set_method(ad_conn_t *conn, char *method) {
+    char *prev = conn->method;
+    conn->method = (method != NULL) ? strdup(method) : NULL;
+    if (prev) {
+        free(prev);
+    }
+}
+
+/**
+ * Return socket file descriptor associated with a connection.
+ */
+int ad_conn_get_socket(ad_conn_t *conn) {
+    return bufferevent_getfd(conn->buffer);
+}
+
+/**
+ * Suspend the connection so the request can be completed later, possibly
+ * from another thread.
+ *
+ * While suspended, reading is paused and no hooks are called on this
+ * connection except for AD_EVENT_CLOSE. The hook that suspended the
+ * connection should return AD_TAKEOVER; the remaining hooks are skipped.
+ *
+ * @return a token to pass to ad_conn_resume(), NULL on failure.
+ *
+ * @note
+ *   Every token must be resumed exactly once, even if the connection
+ *   has been closed in the meantime. Resuming a closed connection is
+ *   safe and simply releases the token.
+ *
+ * @code
+ *   if (ad_http_get_status(conn) == AD_HTTP_REQ_DONE) {
+ *       if (event & AD_EVENT_RESUME) {
+ *           // My worker thread stored the result in my userdata.
+ *           ad_http_response(conn, 200, "text/plain", result, size);
+ *           return AD_DONE;
+ *       }
+ *       ad_conn_token_t *token = ad_conn_suspend(conn);
+ *       my_queue_job(token);  // calls ad_conn_resume(token, AD_OK) when done.
+ *       return AD_TAKEOVER;
+ *   }
+ * @endcode
+ */
+ad_conn_token_t *ad_conn_suspend(ad_conn_t *conn) {
+    if (conn->token != NULL) {
+        WARN("Connection is already suspended.");
+        return NULL;
+    }
+
+    ad_conn_token_t *token = NEW_OBJECT(ad_conn_token_t);
+    if (token == NULL) {
+        return NULL;
+    }
+    token->server = conn->server;
+    token->conn = conn;
+    token->status = AD_OK;
+
+    conn->token = token;
+    bufferevent_disable(conn->buffer, EV_READ);
+    DEBUG("Connection suspended.");
+    return token;
+}
+
+/**
+ * Resume a suspended connection. This can be called from any thread.
+ *
+ * The connection is resumed in its own event loop. If status is AD_OK,
+ * the hooks are called again with AD_EVENT_READ | AD_EVENT_RESUME so the
+ * hook can produce the response. Otherwise the status is applied as if it
+ * were returned by the hook, for example AD_CLOSE closes the connection.
+ *
+ * @param token token returned by ad_conn_suspend(). It's released by this
+ *              call and must not be used again.
+ * @param status one of AD_OK | AD_DONE | AD_CLOSE | AD_TAKEOVER
+ *
+ * @return 0 if successful, otherwise -1.
+ */
+int ad_conn_resume(ad_conn_token_t *token, int status) {
+    if (token == NULL) {
+        return -1;
+    }
+    ad_server_t *server = token->server;
+    token->status = status;
+
+    // Push to the lock-free resume queue.
+    ad_conn_token_t *head;
+    do {
+        head = server->resumeq;
+        token->next = head;
+    } while (! __sync_bool_compare_and_swap(&server->resumeq, head, token));
+
+    return notify_wakeup(server);
+}
+
+/**
+ * Run a job in the offload thread pool and finish the request in the loop.
+ *
+ * The connection is suspended, `job` runs in one of the pool threads and
+ * then `done` is called in the connection's loop where it's safe to write
+ * the response. The return value of `done` is handled the same way as the
+ * status given to ad_conn_resume(). The hook should return AD_TAKEOVER.
+ *
+ * If the connection was closed before the job finished, `done` is called
+ * with NULL connection so the argument can be released.
+ *
+ * @param job function to run off the loop. Must not touch the connection.
+ * @param done function to run in the loop after the job.
+ * @param arg argument for both functions.
+ *
+ * @return 0 if successful, otherwise -1. On failure nothing is called and
+ *         the connection stays as is.
+ *
+ * @note
+ *   Requires "server.offload_threads" option.
+ *
+ * @code
+ *   int my_done(ad_conn_t *conn, void *arg) {
+ *       struct my_job *myjob = (struct my_job *)arg;
+ *       if (conn) {
+ *           ad_http_response(conn, 200, "image/png", myjob->out, myjob->outlen);
+ *       }
+ *       my_job_free(myjob);
+ *       return AD_DONE;
+ *   }
+ *
+ *   if (ad_conn_offload(conn, my_resize_image, my_done, myjob) == 0) {
+ *       return AD_TAKEOVER;
+ *   }
+ * @endcode
+ */
+int ad_conn_offload(ad_conn_t *conn, ad_job_cb job, ad_done_cb done, void *arg) {
+    ad_pool_t *pool = conn->server->pool;
+    if (pool == NULL) {
+        WARN("Offload thread pool is not enabled.");
+        return -1;
+    }
+
+    ad_conn_token_t *token = ad_conn_suspend(conn);
+    if (token == NULL) {
+        return -1;
+    }
+    token->job = job;
+    token->done = done;
+    token->arg = arg;
+
+    if (pool_submit(pool, offload_job, token)) {
+        // Undo suspend.
+        conn->token = NULL;
+        bufferevent_enable(conn->buffer, EV_READ);
+        free(token);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Account the bytes in a buffer to the connection's memory usage.
+ *
+ * The connection's in and out buffers are tracked already. Protocol
+ * handlers use this for buffers they keep per connection so the server
+ * can apply "server.mem_limit" and "server.mem_hard_limit".
+ *
+ * @note
+ *   The buffer must not outlive the connection. Drain it before freeing,
+ *   otherwise the bytes stay accounted until the connection is closed.
+ */
+void ad_conn_track_buffer(ad_conn_t *conn, struct evbuffer *buffer) {
+    evbuffer_add_cb(buffer, mem_buffer_cb, conn);
+}
+
+/**
+ * Account memory held for the connection other than buffers.
+ *
+ * @param bytes bytes allocated, negative for bytes released.
+ */
+void ad_conn_track_mem(ad_conn_t *conn, ssize_t bytes) {
+    conn->mem += bytes;
+    mem_update(conn->server, bytes);
+}
+
+/******************************************************************************
+ * Private internal functions.
+ *****************************************************************************/
+#ifndef _DOXYGEN_SKIP
+
+/**
+ * Open the notification channel and the message queue.
+ */
+static int notify_open(ad_server_t *server) {
+    int msgqsize = ad_server_get_option_int(server, "server.msgq_size");
+    if (msgqsize <= 0 || msgqsize > AD_MSGQ_MAXSIZE) {
+        ERROR("Invalid message queue size. (server.msgq_size:%d, max:%d)",
+              msgqsize, AD_MSGQ_MAXSIZE);
+        return -1;
+    }
+    server->msgq = msgq_new(msgqsize);
+    if (server->msgq == NULL) {
+        ERROR("Failed to create a message queue.");
+        return -1;
+    }
+#ifdef __linux__
+    int notifyfd = eventfd(0, 0);
+    server->notifyfd = notifyfd;
+#else
+    evutil_socket_t notifypair[2];
+    if (evutil_socketpair(AF_UNIX, SOCK_STREAM, 0, notifypair) < 0) {
+        ERROR("Failed to create a notification channel.");
+        return -1;
+    }
+    int notifyfd = notifypair[0];
+    server->notifyfd = notifypair[1];
+#endif
+    struct bufferevent *buffer = bufferevent_socket_new(server->evbase, notifyfd, BEV_OPT_CLOSE_ON_FREE);
+    bufferevent_setcb(buffer, notify_cb, NULL, NULL, server);
+    bufferevent_enable(buffer, EV_READ);
+    // Publish only once it's ready, notify_wakeup() may be looking.
+    __atomic_store_n(&server->notify_buffer, buffer, __ATOMIC_RELEASE);
+    return 0;
+}
+
+static void notify_close(ad_server_t *server) {
+    // Unpublish before the descriptor goes away, so wakeups from other
+    // threads stop short of writing to a closed or reused descriptor.
+    struct bufferevent *buffer = __atomic_exchange_n(&server->notify_buffer, NULL,
+                                                     __ATOMIC_ACQ_REL);
+    if (buffer) {
+        bufferevent_free(buffer);
+#ifndef __linux__
+        close(server->notifyfd);
+#endif
+    }
+    server->notified = 0;
+}
+
+/**
+ * If there's no event, loopbreak or loopexit call won't work until one more
+ * event arrived. So we use eventfd as a internal notification channel to let
+ * server get out of the loop without waiting for an event.
+ */
+static int notify_drain(ad_server_t *server) {
+    // Control message must not be lost to a full queue. Give the loop
+    // some time to make room.
+    for (int i = 0; i < MAX_MUTEX_LOCK_WAIT; i++) {
+        if (notify_msg(server, AD_MSG_DRAIN, NULL, NULL) == 0) {
+            return 0;
+        }
+        if (server->msgq == NULL) {
+            break;
+        }
+        usleep(1);
+    }
+    return -1;
+}
+
+static int notify_msg(ad_server_t *server, enum ad_msg_type_e type, ad_msg_cb cb, void *arg) {
+    if (server->msgq == NULL) {
+        return -1;
+    }
+    ad_msg_t msg = { .type = type, .cb = cb, .arg = arg };
+    if (msgq_push(server->msgq, &msg)) {
+        DEBUG("Message queue is full.");
+        return -1;
+    }
+    return notify_wakeup(server);
+}
+
+/**
+ * Wake up the loop. This is the only part of the notification channel
+ * that's touched by other threads, so it writes to the descriptor
+ * directly instead of going through the bufferevent. Wakeups are
+ * coalesced, only the first one after the loop drained the channel
+ * costs a system call.
+ */
+static int notify_wakeup(ad_server_t *server) {
+    if (__atomic_load_n(&server->notify_buffer, __ATOMIC_ACQUIRE) == NULL) {
+        return -1;
+    }
+    if (__atomic_exchange_n(&server->notified, 1, __ATOMIC_ACQ_REL)) {
+        return 0;  // Already on the way.
+    }
+    uint64_t x = 1;
+    if (write(server->notifyfd, &x, sizeof(uint64_t)) != sizeof(uint64_t)) {
+        // Nothing is on the way. Let the next one try again.
+        __atomic_store_n(&server->notified, 0, __ATOMIC_RELEASE);
+        return -1;
+    }
+    return 0;
 }
 
 static void notify_cb(struct bufferevent *buffer, void *userdata) {
     ad_server_t *server = (ad_server_t *)userdata;
-    event_base_loopexit(server->evbase, NULL);
-    DEBUG("Existing loop.");
+    struct evbuffer *in = bufferevent_get_input(buffer);
+    evbuffer_drain(in, evbuffer_get_length(in));
+
+    // Clear before draining queues, so what comes next wakes us up again.
+    __atomic_store_n(&server->notified, 0, __ATOMIC_RELEASE);
+
+    resume_conns(server);
+    accept_handshakes(server);
+    dispatch_msgs(server);
+}
+
+/**
+ * Deliver a batch of messages. The batch is limited to the size of the
+ * queue so busy producers can't starve the connections.
+ */
+static void dispatch_msgs(ad_server_t *server) {
+    ad_msg_t msg;
+    size_t n;
+    for (n = 0; n <= server->msgq->mask && msgq_pop(server->msgq, &msg); n++) {
+        switch (msg.type) {
+            case AD_MSG_DRAIN : {
+                drain_server(server);
+                break;
+            }
+            case AD_MSG_USER : {
+                msg.cb(server, msg.arg);
+                break;
+            }
+        }
+    }
+
+    // Come back for the rest in the next round.
+    if (n > server->msgq->mask) {
+        notify_wakeup(server);
+    }
+}
+
+/**
+ * Stop accepting, close idle connections and exit the loop once in-flight
+ * requests are finished or the deadline has passed.
+ */
+static void drain_server(ad_server_t *server) {
+    if (server->draining) {
+        return;
+    }
+    DEBUG("Draining server. (connections:%zu)", server->nconns);
+    server->draining = true;
+    accept_update(server);
+
+    // The supervisor has nothing to finish but the workers.
+    if (server->prefork && server->prefork->worker < 0) {
+        prefork_drain(server);
+        return;
+    }
+
+    // Idle connections have nothing to finish. A connection is in the
+    // middle of a request while the protocol handler says so, even if the
+    // hooks returned AD_OK for a part of it.
+    ad_conn_t *conn = server->conns;
+    while (conn) {
+        ad_conn_t *next = conn->next;
+        if ((conn->status == AD_DONE || (conn->status == AD_OK && ! conn->busy))
+            && conn->token == NULL && evbuffer_get_length(conn->out) == 0) {
+            conn_free(conn);
+        }
+        conn = next;
+    }
+
+    int timeout = ad_server_get_option_int(server, "server.drain_timeout");
+    if (server->nconns > 0 && timeout > 0) {
+        struct timeval tm;
+        bzero((void *)&tm, sizeof(struct timeval));
+        tm.tv_sec = timeout;
+        event_base_once(server->evbase, -1, EV_TIMEOUT, drain_timeout_cb, server, &tm);
+    } else {
+        event_base_loopexit(server->evbase, NULL);
+        DEBUG("Existing loop.");
+    }
+}
+
+static void drain_timeout_cb(evutil_socket_t fd, short what, void *userdata) {
+    ad_server_t *server = (ad_server_t *)userdata;
+    WARN("Drain timeout. %zu connection(s) left.", server->nconns);
+    event_base_loopexit(server->evbase, NULL);
+}
+
+/**
+ * Exit the loop when the last connection is gone during draining.
+ */
+static void drain_check(ad_server_t *server) {
+    if (server->draining && server->nconns == 0) {
+        event_base_loopexit(server->evbase, NULL);
+        DEBUG("Existing loop. All connections are finished.");
+    }
+}
+
+static ad_msgq_t *msgq_new(int size) {
+    if (size <= 0 || size > AD_MSGQ_MAXSIZE) {
+        return NULL;
+    }
+    size_t cells = 2;
+    while (cells < (size_t)size) {
+        cells <<= 1;
+    }
+
+    ad_msgq_t *q = NEW_OBJECT(ad_msgq_t);
+    if (q == NULL) {
+        return NULL;
+    }
+    q->cells = (ad_msgq_cell_t *)calloc(cells, sizeof(ad_msgq_cell_t));
+    if (q->cells == NULL) {
+        free(q);
+        return NULL;
+    }
+    q->mask = cells - 1;
+    for (size_t i = 0; i < cells; i++) {
+        q->cells[i].seq = i;
+    }
+    return q;
+}
+
+static int msgq_push(ad_msgq_t *q, const ad_msg_t *msg) {
+    ad_msgq_cell_t *cell;
+    size_t pos = __atomic_load_n(&q->enqpos, __ATOMIC_RELAXED);
+    for (;;) {
+        cell = &q->cells[pos & q->mask];
+        size_t seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&q->enqpos, &pos, pos + 1, true,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if (diff < 0) {
+            return -1;  // full
+        } else {
+            pos = __atomic_load_n(&q->enqpos, __ATOMIC_RELAXED);
+        }
+    }
+    cell->msg = *msg;
+    __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+static bool msgq_pop(ad_msgq_t *q, ad_msg_t *msg) {
+    size_t pos = q->deqpos;
+    ad_msgq_cell_t *cell = &q->cells[pos & q->mask];
+    size_t seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+    if ((intptr_t)seq - (intptr_t)(pos + 1) < 0) {
+        return false;  // empty
+    }
+    *msg = cell->msg;
+    __atomic_store_n(&cell->seq, pos + q->mask + 1, __ATOMIC_RELEASE);
+    q->deqpos = pos + 1;
+    return true;
+}
+
+static void msgq_free(ad_msgq_t *q) {
+    free(q->cells);
+    free(q);
+}
+
+/**
+ * Release a token of which connection is gone.
+ */
+static void release_token(ad_conn_token_t *token) {
+    if (token->done) {
+        token->done(NULL, token->arg);
+    }
+    free(token);
+}
+
+/**
+ * Process connections resumed by ad_conn_resume().
+ */
+static void resume_conns(ad_server_t *server) {
+    // Take the whole queue at once and restore the order of arrival.
+    ad_conn_token_t *list = __sync_lock_test_and_set(&server->resumeq, NULL);
+    ad_conn_token_t *token = NULL;
+    while (list) {
+        ad_conn_token_t *next = list->next;
+        list->next = token;
+        token = list;
+        list = next;
+    }
+
+    while (token) {
+        ad_conn_token_t *next = token->next;
+        ad_conn_t *conn = token->conn;
+        if (conn == NULL) {
+            DEBUG("Connection was closed while suspended.");
+            release_token(token);
+            token = next;
+            continue;
+        }
+        conn->token = NULL;
+
+        int status = token->status;
+        if (token->done) {
+            status = token->done(conn, token->arg);
+        }
+        free(token);
+        token = next;
+
+        DEBUG("Connection resumed. status:%d", status);
+        if (conn->status == AD_CLOSE) {
+            // Got EOF or an error while suspended. Close it through.
+            conn_cb(conn, AD_EVENT_CLOSE);
+            continue;
+        }
+        bufferevent_enable(conn->buffer, EV_READ);
+        if (status == AD_OK) {
+            conn->status = AD_OK;
+            conn_cb(conn, AD_EVENT_READ | AD_EVENT_RESUME);
+        } else {
+            conn->status = status;
+            conn_cb(conn, AD_EVENT_RESUME);
+        }
+    }
+}
+
+static void *server_loop(void *instance) {
+    ad_server_t *server = (ad_server_t *)instance;
+
+    int *retval = NEW_OBJECT(int);
+    DEBUG("Loop start");
+    event_base_loop(server->evbase, 0);
+    DEBUG("Loop finished");
+    *retval = (event_base_got_break(server->evbase)) ? -1 : 0;
+
+    return retval;
+}
+
+static void close_server(ad_server_t *server) {
+    DEBUG("Closing server.");
+
+    if (server->thread) {
+        void *retval = NULL;
+        DEBUG("Waiting server's last loop to finish.");
+        pthread_join(*(server->thread), &retval);
+        free(retval);
+        free(server->thread);
+        server->thread = NULL;
+    }
+
+    // Let the workers finish queued jobs before the connections and the
+    // notification channel they report back through go away. Whatever they
+    // queue from here on is released below.
+    if (server->pool) {
+        pool_free(server->pool);
+        server->pool = NULL;
+    }
+    if (server->hspool) {
+        pool_free(server->hspool);
+        server->hspool = NULL;
+    }
+
+    // Connections left over by drain timeout.
+    server->draining = false;
+    while (server->conns) {
+        conn_free(server->conns);
+    }
+
+    notify_close(server);
+
+    ad_listener_t *listener;
+    for (listener = server->listeners; listener; listener = listener->next) {
+        if (listener->listener) {
+            evconnlistener_free(listener->listener);
+            listener->listener = NULL;
+        }
+    }
+    server->listener = NULL;
+
+    if (server->handoff) {
+        evconnlistener_free(server->handoff);
+        server->handoff = NULL;
+    }
+
+    // Deliver messages posted after the loop had finished.
+    if (server->msgq) {
+        ad_msg_t msg;
+        while (msgq_pop(server->msgq, &msg)) {
+            if (msg.type == AD_MSG_USER) {
+                msg.cb(server, msg.arg);
+            }
+        }
+        msgq_free(server->msgq);
+        server->msgq = NULL;
+    }
+
+    // Release tokens resumed after the loop had finished.
+    ad_conn_token_t *token = __sync_lock_test_and_set(&server->resumeq, NULL);
+    while (token) {
+        ad_conn_token_t *next = token->next;
+        release_token(token);
+        token = next;
+    }
+
+    // Connections handshaked after the loop had finished.
+    ad_handshake_t *hs = __sync_lock_test_and_set(&server->handshakeq, NULL);
+    while (hs) {
+        ad_handshake_t *next = hs->next;
+        handshake_free(hs);
+        hs = next;
+    }
+    INFO("Server closed.");
+}
+
+static ad_pool_t *pool_new(int nworkers) {
+    ad_pool_t *pool = NEW_OBJECT(ad_pool_t);
+    if (pool == NULL) {
+        return NULL;
+    }
+    pool->workers = (ad_worker_t *)calloc(nworkers, sizeof(ad_worker_t));
+    if (pool->workers == NULL) {
+        free(pool);
+        return NULL;
+    }
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->cond, NULL);
+
+    for (int i = 0; i < nworkers; i++) {
+        ad_worker_t *worker = &pool->workers[i];
+        worker->pool = pool;
+        pthread_mutex_init(&worker->lock, NULL);
+        if (pthread_create(&worker->thread, NULL, pool_worker, (void *)worker)) {
+            ERROR("Failed to create a pool thread.");
+            pthread_mutex_destroy(&worker->lock);
+            break;
+        }
+        pool->nworkers++;
+    }
+
+    if (pool->nworkers == 0) {
+        pool_free(pool);
+        return NULL;
+    }
+    return pool;
+}
+
+static int pool_submit(ad_pool_t *pool, ad_job_cb fn, void *arg) {
+    ad_job_t *job = NEW_OBJECT(ad_job_t);
+    if (job == NULL) {
+        return -1;
+    }
+    job->fn = fn;
+    job->arg = arg;
+
+    unsigned int idx = __sync_fetch_and_add(&pool->next, 1) % pool->nworkers;
+    ad_worker_t *worker = &pool->workers[idx];
+    pthread_mutex_lock(&worker->lock);
+    if (worker->tail) {
+        worker->tail->next = job;
+    } else {
+        worker->head = job;
+    }
+    worker->tail = job;
+    pthread_mutex_unlock(&worker->lock);
+
+    pthread_mutex_lock(&pool->lock);
+    pool->pending++;
+    pthread_cond_signal(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+    return 0;
+}
+
+/**
+ * Stop the pool. Workers finish all queued jobs before exiting.
+ */
+static void pool_free(ad_pool_t *pool) {
+    pthread_mutex_lock(&pool->lock);
+    pool->shutdown = true;
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (int i = 0; i < pool->nworkers; i++) {
+        pthread_join(pool->workers[i].thread, NULL);
+        pthread_mutex_destroy(&pool->workers[i].lock);
+    }
+    pthread_cond_destroy(&pool->cond);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->workers);
+    free(pool);
+}
+
+static void *pool_worker(void *instance) {
+    ad_worker_t *worker = (ad_worker_t *)instance;
+    ad_pool_t *pool = worker->pool;
+
+    for (;;) {
+        ad_job_t *job = pool_take(worker);
+        if (job) {
+            job->fn(job->arg);
+            free(job);
+            continue;
+        }
+
+        pthread_mutex_lock(&pool->lock);
+        while (pool->pending == 0 && ! pool->shutdown) {
+            pthread_cond_wait(&pool->cond, &pool->lock);
+        }
+        bool done = (pool->shutdown && pool->pending == 0);
+        pthread_mutex_unlock(&pool->lock);
+        if (done) {
+            break;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Take a job from the worker's own queue, or steal one from the others.
+ */
+static ad_job_t *pool_take(ad_worker_t *worker) {
+    ad_pool_t *pool = worker->pool;
+    ad_job_t *job = NULL;
+
+    // Own queue first, then the siblings starting from the next one.
+    int self = worker - pool->workers;
+    for (int i = 0; job == NULL && i < pool->nworkers; i++) {
+        ad_worker_t *victim = &pool->workers[(self + i) % pool->nworkers];
+        pthread_mutex_lock(&victim->lock);
+        if ((job = victim->head)) {
+            victim->head = job->next;
+            if (victim->head == NULL) {
+                victim->tail = NULL;
+            }
+        }
+        pthread_mutex_unlock(&victim->lock);
+    }
+
+    if (job) {
+        pthread_mutex_lock(&pool->lock);
+        pool->pending--;
+        pthread_mutex_unlock(&pool->lock);
+        job->next = NULL;
+    }
+    return job;
+}
+
+static void offload_job(void *arg) {
+    ad_conn_token_t *token = (ad_conn_token_t *)arg;
+    token->job(token->arg);
+    ad_conn_resume(token, AD_OK);
+}
+
+static void mem_buffer_cb(struct evbuffer *buffer, const struct evbuffer_cb_info *info,
+                          void *userdata) {
+    ssize_t bytes = (ssize_t)info->n_added - (ssize_t)info->n_deleted;
+    if (bytes != 0) {
+        ad_conn_track_mem((ad_conn_t *)userdata, bytes);
+    }
+}
+
+/**
+ * Update memory usage and apply the limits.
+ */
+static void mem_update(ad_server_t *server, ssize_t bytes) {
+    server->mem += bytes;
+    if (server->mystats) {
+        __atomic_store_n(&server->mystats->mem, server->mem, __ATOMIC_RELAXED);
+    }
+
+    if (server->mem_limit > 0) {
+        if (! server->mem_pressure && server->mem >= server->mem_limit) {
+            WARN("Memory limit reached, pausing new connections. (%zu bytes)", server->mem);
+            server->mem_pressure = true;
+            accept_update(server);
+        } else if (server->mem_pressure && server->mem < server->mem_limit / 8 * 7) {
+            INFO("Memory usage is back under the limit. (%zu bytes)", server->mem);
+            server->mem_pressure = false;
+            accept_update(server);
+        }
+    }
+
+    // Not from here, the connection may be in use up in the stack.
+    if (server->mem_hard_limit > 0 && server->mem > server->mem_hard_limit) {
+        event_active(server->mem_event, EV_TIMEOUT, 0);
+    }
+}
+
+/**
+ * Close the largest connections until the usage is under the hard limit.
+ */
+static void mem_shed_cb(evutil_socket_t fd, short what, void *userdata) {
+    ad_server_t *server = (ad_server_t *)userdata;
+    while (server->mem > server->mem_hard_limit) {
+        ad_conn_t *largest = NULL;
+        ad_conn_t *conn;
+        for (conn = server->conns; conn; conn = conn->next) {
+            if (largest == NULL || conn->mem > largest->mem) {
+                largest = conn;
+            }
+        }
+        if (largest == NULL || largest->mem == 0) {
+            break;
+        }
+        WARN("Closing connection over memory limit. (%zu bytes)", largest->mem);
+        conn_free(largest);
+    }
+}
+
+/**
+ * Accept new connections or not, by the state of the server.
+ */
+static void accept_update(ad_server_t *server) {
+    bool enable = (! server->draining && ! server->mem_pressure
+                   && ! server->accept_backoff && ! accept_full(server));
+    if (server->prefork && server->prefork->worker < 0) {
+        enable = false;  // The supervisor never accepts.
+    }
+    ad_listener_t *listener;
+    for (listener = server->listeners; listener; listener = listener->next) {
+        if (listener->listener) {
+            if (enable) {
+                evconnlistener_enable(listener->listener);
+            } else {
+                evconnlistener_disable(listener->listener);
+            }
+        }
+    }
+}
+
+/**
+ * Check the connection limits.
+ */
+static bool accept_full(ad_server_t *server) {
+    if (server->max_conns > 0 && server->nconns >= server->max_conns) {
+        return true;
+    }
+    if (server->max_conns_global > 0 && server->shmstats) {
+        size_t total = 0;
+        for (uint32_t i = 0; i < server->shmstats->nworkers; i++) {
+            total += __atomic_load_n(&server->shmstats->workers[i].conns, __ATOMIC_RELAXED);
+        }
+        if (total >= server->max_conns_global) {
+            // Other workers closing theirs don't wake us up. Check again later.
+            if (server->accept_event && ! evtimer_pending(server->accept_event, NULL)) {
+                struct timeval tm = { 0, AD_ACCEPT_BACKOFF * 1000 };
+                evtimer_add(server->accept_event, &tm);
+            }
+            return true;
+        }
+    } else if (server->max_conns_global > 0 && server->nconns >= server->max_conns_global) {
+        return true;
+    }
+    return false;
+}
+
+/**
+ * Stop accepting for a while when accept() fails for lack of descriptors,
+ * otherwise the listener keeps waking up on the pending connections.
+ */
+static void accept_error_cb(struct evconnlistener *evlistener, void *userdata) {
+    ad_listener_t *listener = (ad_listener_t *)userdata;
+    ad_server_t *server = listener->server;
+    int err = EVUTIL_SOCKET_ERROR();
+    if (err != EMFILE && err != ENFILE) {
+        WARN("Failed to accept a connection. (%s)", evutil_socket_error_to_string(err));
+        return;
+    }
+    WARN("Out of file descriptors, pausing new connections. (connections:%zu)",
+         server->nconns);
+
+    // Give the spare descriptor to take one off the queue and close it,
+    // so the client gets an answer instead of waiting in the backlog.
+    if (server->spare_fd >= 0) {
+        close(server->spare_fd);
+        evutil_socket_t fd = accept(evconnlistener_get_fd(evlistener), NULL, NULL);
+        if (fd >= 0) {
+            evutil_closesocket(fd);
+        }
+        server->spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    }
+
+    server->accept_backoff = true;
+    accept_update(server);
+    struct timeval tm = { 0, AD_ACCEPT_BACKOFF * 1000 };
+    evtimer_add(server->accept_event, &tm);
+}
+
+static void accept_resume_cb(evutil_socket_t fd, short what, void *userdata) {
+    ad_server_t *server = (ad_server_t *)userdata;
+    server->accept_backoff = false;
+    if (server->spare_fd < 0) {
+        server->spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    }
+    accept_update(server);
+}
+
+/**
+ * Pass a new SSL connection to the handshake thread pool.
+ */
+static int handshake_start(ad_listener_t *listener, evutil_socket_t fd) {
+    ad_server_t *server = listener->server;
+    ad_handshake_t *hs = NEW_OBJECT(ad_handshake_t);
+    if (hs == NULL) {
+        return -1;
+    }
+    hs->server = server;
+    hs->listener = listener;
+    hs->fd = fd;
+    hs->ssl = SSL_new(listener->sslctx);
+    hs->timeout = (listener->timeout >= 0) ? listener->timeout
+                  : ad_server_get_option_int(server, "server.timeout");
+    if (hs->timeout <= 0) {
+        hs->timeout = AD_HANDSHAKE_TIMEOUT;
+    }
+
+    if (hs->ssl == NULL || pool_submit(server->hspool, handshake_job, hs)) {
+        if (hs->ssl) SSL_free(hs->ssl);
+        free(hs);
+        return -1;
+    }
+
+    // Count it against the limits and draining until it comes back.
+    server->nconns++;
+    if (server->mystats) {
+        __atomic_store_n(&server->mystats->conns, server->nconns, __ATOMIC_RELAXED);
+    }
+    if (server->max_conns > 0 || server->max_conns_global > 0) {
+        accept_update(server);
+    }
+    return 0;
+}
+
+/**
+ * Run the handshake in a pool thread and queue the connection to its loop.
+ */
+static void handshake_job(void *arg) {
+    ad_handshake_t *hs = (ad_handshake_t *)arg;
+    ad_server_t *server = hs->server;
+
+    // Non-blocking against one deadline for the whole handshake, so a
+    // client trickling bytes can't hold the thread either.
+    struct timespec deadline, now;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += hs->timeout;
+    evutil_make_socket_nonblocking(hs->fd);
+
+    int ret = 0, err = SSL_ERROR_SYSCALL;
+    if (SSL_set_fd(hs->ssl, hs->fd) == 1) {
+        while ((ret = SSL_accept(hs->ssl)) != 1) {
+            err = SSL_get_error(hs->ssl, ret);
+            struct pollfd pfd = { hs->fd, 0, 0 };
+            if (err == SSL_ERROR_WANT_READ) {
+                pfd.events = POLLIN;
+            } else if (err == SSL_ERROR_WANT_WRITE) {
+                pfd.events = POLLOUT;
+            } else {
+                break;
+            }
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            long msec = (deadline.tv_sec - now.tv_sec) * 1000
+                        + (deadline.tv_nsec - now.tv_nsec) / 1000000;
+            if (msec <= 0) {
+                break;
+            }
+            if (poll(&pfd, 1, msec) < 0 && errno != EINTR) {
+                break;
+            }
+        }
+    }
+    hs->ok = (ret == 1);
+    if (! hs->ok) {
+        DEBUG("SSL handshake failed. (err:%d)", err);
+        ERR_clear_error();
+    }
+
+    // Push to the lock-free handshake queue, failed ones too so the loop
+    // takes them off the count.
+    ad_handshake_t *head;
+    do {
+        head = server->handshakeq;
+        hs->next = head;
+    } while (! __sync_bool_compare_and_swap(&server->handshakeq, head, hs));
+
+    notify_wakeup(server);
+}
+
+/**
+ * Set up connections handshaked by the handshake thread pool.
+ */
+static void accept_handshakes(ad_server_t *server) {
+    // Take the whole queue at once and restore the order of arrival.
+    ad_handshake_t *list = __sync_lock_test_and_set(&server->handshakeq, NULL);
+    ad_handshake_t *hs = NULL;
+    while (list) {
+        ad_handshake_t *next = list->next;
+        list->next = hs;
+        hs = list;
+        list = next;
+    }
+
+    bool taken = (hs != NULL);
+    while (hs) {
+        ad_handshake_t *next = hs->next;
+        server->nconns--;  // conn_new() counts it again.
+        if (! hs->ok || server->draining) {
+            if (hs->ok) {
+                DEBUG("Closing handshaked connection. Server is draining.");
+            }
+            handshake_free(hs);
+            hs = next;
+            continue;
+        }
+
+        ad_listener_t *listener = hs->listener;
+        struct bufferevent *buffer = bufferevent_openssl_socket_new(server->evbase, hs->fd, hs->ssl,
+                                                                    BUFFEREVENT_SSL_OPEN,
+                                                                    BEV_OPT_CLOSE_ON_FREE);
+        ad_conn_t *conn = NULL;
+        if (buffer == NULL) {
+            handshake_free(hs);
+        } else {
+            free(hs);  // SSL and socket belong to the buffer now.
+            listener_set_timeouts(listener, buffer);
+            conn = conn_new(server, listener, buffer);
+            if (conn == NULL) {
+                bufferevent_free(buffer);
+            }
+        }
+        hs = next;
+
+        if (conn == NULL) {
+            ERROR("Failed to create a connection handler.");
+            continue;
+        }
+        if (server->mystats) {
+            __atomic_fetch_add(&server->mystats->accepted, 1, __ATOMIC_RELAXED);
+        }
+        DEBUG("SSL handshake done.");
+        conn_ktls(conn);
+    }
+
+    if (taken) {
+        if (server->mystats) {
+            __atomic_store_n(&server->mystats->conns, server->nconns, __ATOMIC_RELAXED);
+        }
+        if (server->max_conns > 0 || server->max_conns_global > 0) {
+            accept_update(server);
+        }
+        drain_check(server);
+    }
+}
+
+static void handshake_free(ad_handshake_t *hs) {
+    SSL_free(hs->ssl);
+    evutil_closesocket(hs->fd);
+    free(hs);
+}
+
+/**
+ * Fork workers and supervise them.
+ *
+ * @return 0 in a worker, 1 in the supervisor after all the workers are
+ *         finished, -1 on error.
+ */
+static int prefork(ad_server_t *server, int nworkers) {
+    ad_prefork_t *prefork = NEW_OBJECT(ad_prefork_t);
+    if (prefork == NULL) {
+        return -1;
+    }
+    prefork->nworkers = nworkers;
+    prefork->worker = -1;
+    prefork->pids = (pid_t *)calloc(nworkers, sizeof(pid_t));
+    prefork->started = (time_t *)calloc(nworkers, sizeof(time_t));
+    prefork->sigchld = evsignal_new(server->evbase, SIGCHLD, prefork_sigchld_cb, server);
+    prefork->sigterm = evsignal_new(server->evbase, SIGTERM, prefork_sigterm_cb, server);
+    server->prefork = prefork;
+    if (! prefork->pids || ! prefork->started || ! prefork->sigchld || ! prefork->sigterm) {
+        ERROR("Failed to initialize worker processes.");
+        return -1;
+    }
+    event_add(prefork->sigchld, NULL);
+    event_add(prefork->sigterm, NULL);
+
+    // The supervisor keeps the sockets but doesn't accept.
+    ad_listener_t *listener;
+    for (listener = server->listeners; listener; listener = listener->next) {
+        if (listener->listener) {
+            evconnlistener_disable(listener->listener);
+        }
+    }
+
+    while (true) {
+        for (int i = 0; i < nworkers && ! server->draining; i++) {
+            if (prefork->pids[i] > 0) {
+                continue;
+            }
+            pid_t pid = fork();
+            if (pid == 0) {
+                return prefork_worker_init(server, i);
+            } else if (pid < 0) {
+                ERROR("Failed to fork a worker. (%s)", strerror(errno));
+                struct timeval tm = { AD_RESPAWN_DELAY, 0 };
+                event_base_once(server->evbase, -1, EV_TIMEOUT, prefork_respawn_cb, server, &tm);
+                break;
+            }
+            prefork->pids[i] = pid;
+            prefork->started[i] = time(NULL);
+            if (server->shmstats) {
+                server->shmstats->workers[i].pid = pid;
+                server->shmstats->workers[i].starts++;
+            }
+            DEBUG("Worker %d started. (pid:%d)", i, pid);
+        }
+
+        // Comes out to restart workers or when all the workers are gone.
+        if (server->draining && prefork_running(prefork) == 0) {
+            break;
+        }
+        event_base_loop(server->evbase, 0);
+        if (server->draining && prefork_running(prefork) == 0) {
+            break;
+        }
+    }
+    DEBUG("All workers are finished.");
+    return 1;
+}
+
+/**
+ * Turn the forked process into a worker.
+ */
+static int prefork_worker_init(ad_server_t *server, int worker) {
+    ad_prefork_t *prefork = server->prefork;
+    prefork->worker = worker;
+
+    if (event_reinit(server->evbase)) {
+        ERROR("Failed to reinitialize event base in worker %d.", worker);
+        return -1;
+    }
+
+    // Leave the supervisor's business.
+    event_free(prefork->sigchld);
+    prefork->sigchld = NULL;
+    free(prefork->pids);
+    prefork->pids = NULL;
+    free(prefork->started);
+    prefork->started = NULL;
+    if (server->handoff) {
+        evconnlistener_free(server->handoff);
+        server->handoff = NULL;
+    }
+
+    // Own channel, the supervisor's is inherited.
+    notify_close(server);
+    msgq_free(server->msgq);
+    server->msgq = NULL;
+    if (notify_open(server)) {
+        return -1;
+    }
+
+    if (server->shmstats) {
+        server->mystats = &server->shmstats->workers[worker];
+    }
+
+    ad_listener_t *listener;
+    for (listener = server->listeners; listener; listener = listener->next) {
+        if (listener->listener) {
+            evconnlistener_enable(listener->listener);
+        }
+    }
+    INFO("Worker %d started. (pid:%d)", worker, getpid());
+    return 0;
+}
+
+static int prefork_running(ad_prefork_t *prefork) {
+    int running = 0;
+    for (int i = 0; i < prefork->nworkers; i++) {
+        if (prefork->pids[i] > 0) {
+            running++;
+        }
+    }
+    return running;
+}
+
+/**
+ * Tell the workers to drain and exit the loop when they're all gone.
+ */
+static void prefork_drain(ad_server_t *server) {
+    ad_prefork_t *prefork = server->prefork;
+    DEBUG("Draining %d worker(s).", prefork_running(prefork));
+    for (int i = 0; i < prefork->nworkers; i++) {
+        if (prefork->pids[i] > 0) {
+            kill(prefork->pids[i], SIGTERM);
+        }
+    }
+
+    if (prefork_running(prefork) == 0) {
+        event_base_loopexit(server->evbase, NULL);
+        return;
+    }
+
+    // Workers exit by their own drain timeout, this is the last resort.
+    int timeout = ad_server_get_option_int(server, "server.drain_timeout");
+    if (timeout > 0) {
+        struct timeval tm;
+        bzero((void *)&tm, sizeof(struct timeval));
+        tm.tv_sec = timeout + AD_RESPAWN_DELAY;
+        event_base_once(server->evbase, -1, EV_TIMEOUT, prefork_kill_cb, server, &tm);
+    }
+}
+
+static void prefork_free(ad_server_t *server) {
+    ad_prefork_t *prefork = server->prefork;
+    if (prefork->sigchld) {
+        event_free(prefork->sigchld);
+    }
+    if (prefork->sigterm) {
+        event_free(prefork->sigterm);
+    }
+    if (prefork->pids) {
+        free(prefork->pids);
+    }
+    if (prefork->started) {
+        free(prefork->started);
+    }
+    free(prefork);
+    server->prefork = NULL;
+}
+
+static void prefork_sigchld_cb(evutil_socket_t sig, short what, void *userdata) {
+    ad_server_t *server = (ad_server_t *)userdata;
+    ad_prefork_t *prefork = server->prefork;
+
+    bool respawn = false;
+    bool crashloop = false;
+    for (int i = 0; i < prefork->nworkers; i++) {
+        int status;
+        if (prefork->pids[i] <= 0 || waitpid(prefork->pids[i], &status, WNOHANG) <= 0) {
+            continue;
+        }
+        if (! server->draining) {
+            if (WIFSIGNALED(status)) {
+                WARN("Worker %d was killed by signal %d. (pid:%d)",
+                     i, WTERMSIG(status), prefork->pids[i]);
+            } else {
+                WARN("Worker %d exited with status %d. (pid:%d)",
+                     i, WEXITSTATUS(status), prefork->pids[i]);
+            }
+            if (time(NULL) - prefork->started[i] < AD_RESPAWN_DELAY) {
+                crashloop = true;
+            }
+            respawn = true;
+        }
+        prefork->pids[i] = 0;
+        if (server->shmstats) {
+            server->shmstats->workers[i].pid = 0;
+            server->shmstats->workers[i].conns = 0;
+            server->shmstats->workers[i].mem = 0;
+        }
+    }
+
+    if (server->draining) {
+        if (prefork_running(prefork) == 0) {
+            event_base_loopexit(server->evbase, NULL);
+        }
+    } else if (crashloop) {
+        struct timeval tm = { AD_RESPAWN_DELAY, 0 };
+        event_base_once(server->evbase, -1, EV_TIMEOUT, prefork_respawn_cb, server, &tm);
+    } else if (respawn) {
+        event_base_loopbreak(server->evbase);
+    }
+}
+
+static void prefork_sigterm_cb(evutil_socket_t sig, short what, void *userdata) {
+    ad_server_t *server = (ad_server_t *)userdata;
+    DEBUG("Received SIGTERM.");
+    drain_server(server);
+}
+
+static void prefork_respawn_cb(evutil_socket_t fd, short what, void *userdata) {
+    ad_server_t *server = (ad_server_t *)userdata;
+    event_base_loopbreak(server->evbase);
+}
+
+static void prefork_kill_cb(evutil_socket_t fd, short what, void *userdata) {
+    ad_server_t *server = (ad_server_t *)userdata;
+    ad_prefork_t *prefork = server->prefork;
+    for (int i = 0; i < prefork->nworkers; i++) {
+        if (prefork->pids[i] > 0) {
+            WARN("Killing worker %d. (pid:%d)", i, prefork->pids[i]);
+            kill(prefork->pids[i], SIGKILL);
+        }
+    }
+}
+
+/**
+ * Create shared stats, named by "server.stats_shm" or anonymous.
+ */
+static int shmstats_new(ad_server_t *server, int nslots) {
+    size_t size = sizeof(ad_shmstats_t) + sizeof(ad_worker_stats_t) * nslots;
+    char *name = ad_server_get_option(server, "server.stats_shm");
+
+    void *map = MAP_FAILED;
+    if (IS_EMPTY_STR(name)) {
+        map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    } else {
+        int fd = shm_open(name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            return -1;
+        }
+        if (ftruncate(fd, size) == 0) {
+            map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        }
+        close(fd);
+    }
+    if (map == MAP_FAILED) {
+        return -1;
+    }
+
+    server->shmstats = (ad_shmstats_t *)map;
+    server->shmstats->nworkers = nslots;
+    return 0;
+}
+
+static void shmstats_free(ad_server_t *server) {
+    // Workers leave the name to the supervisor.
+    char *name = ad_server_get_option(server, "server.stats_shm");
+    if (! IS_EMPTY_STR(name) && (! server->prefork || server->prefork->worker < 0)) {
+        shm_unlink(name);
+    }
+    ad_shmstats_close(server->shmstats);
+    server->shmstats = NULL;
+    server->mystats = NULL;
+}
+
+static void sslctx_index_init(void) {
+    sslctx_index = SSL_CTX_get_ex_new_index(0, NULL, NULL, NULL, NULL);
+}
+
+/**
+ * Set up SSL context of a listener or a hostname.
+ */
+static void sslctx_setup(ad_server_t *server, SSL_CTX *sslctx) {
+    SSL_CTX_set_ex_data(sslctx, sslctx_index, server);
+    sslcache_setup(server, sslctx);
+    SSL_CTX_set_tlsext_servername_callback(sslctx, sni_cb);
+    SSL_CTX_set_tlsext_servername_arg(sslctx, server);
+
+    // Let OpenSSL free record buffers while connections are idle.
+    SSL_CTX_set_mode(sslctx, SSL_MODE_RELEASE_BUFFERS);
+
+    if (ad_server_get_option_int(server, "server.ssl_ktls")) {
+#ifdef SSL_OP_ENABLE_KTLS
+        SSL_CTX_set_options(sslctx, SSL_OP_ENABLE_KTLS);
+#else
+        WARN("kTLS is not supported by this OpenSSL.");
+#endif
+    }
+}
+
+/**
+ * Normalize hostname into lowercase without trailing dot.
+ */
+static int sni_name(char *name, const char *hostname) {
+    size_t len = (hostname) ? strlen(hostname) : 0;
+    if (len > 0 && hostname[len - 1] == '.') {
+        len--;
+    }
+    if (len == 0 || len > AD_SNI_NAME_MAX) {
+        return -1;
+    }
+    for (size_t i = 0; i < len; i++) {
+        name[i] = tolower((unsigned char)hostname[i]);
+    }
+    name[len] = '\0';
+    return 0;
+}
+
+/**
+ * Find SSL_CTX by exact hostname. Must be called with the lock.
+ */
+static SSL_CTX *sni_lookup(ad_sni_t *sni, const char *name) {
+    SSL_CTX **ctx = (SSL_CTX **)sni->ctxs->get(sni->ctxs, name, NULL, false);
+    return (ctx) ? *ctx : NULL;
+}
+
+/**
+ * Switch to the hostname's SSL_CTX, exact match first then wildcard.
+ */
+static int sni_cb(SSL *ssl, int *alert, void *userdata) {
+    ad_server_t *server = (ad_server_t *)userdata;
+    char name[AD_SNI_NAME_MAX + 2];
+    if (sni_name(name + 1, SSL_get_servername(ssl, TLSEXT_NAMETYPE_host_name))) {
+        return SSL_TLSEXT_ERR_OK;  // No SNI, listener's context.
+    }
+
+    ad_sni_t *sni = server->sni;
+    pthread_rwlock_rdlock(&sni->lock);
+    SSL_CTX *sslctx = sni_lookup(sni, name + 1);
+    if (sslctx == NULL) {
+        char *dot = strchr(name + 1, '.');
+        if (dot) {
+            dot[-1] = '*';
+            sslctx = sni_lookup(sni, dot - 1);
+        }
+    }
+    if (sslctx) {
+        SSL_set_SSL_CTX(ssl, sslctx);  // Holds its own reference.
+    }
+    pthread_rwlock_unlock(&sni->lock);
+    return SSL_TLSEXT_ERR_OK;
+}
+
+static void sni_free(ad_sni_t *sni) {
+    if (sni->ctxs) {
+        qhashtbl_obj_t obj;
+        bzero((void *)&obj, sizeof(qhashtbl_obj_t));
+        while (sni->ctxs->getnext(sni->ctxs, &obj, false)) {
+            SSL_CTX_free(*(SSL_CTX **)obj.data);
+        }
+        sni->ctxs->free(sni->ctxs);
+    }
+    pthread_rwlock_destroy(&sni->lock);
+    free(sni);
+}
+
+/**
+ * Create session cache and ticket keys if any listener does SSL.
+ */
+static int sslcache_init(ad_server_t *server) {
+    pthread_once(&sslctx_index_once, sslctx_index_init);
+    if (sslctx_index < 0) {
+        return -1;
+    }
+
+    if (! server->sslcache) {
+        ad_listener_t *listener;
+        for (listener = server->listeners; listener; listener = listener->next) {
+            if (listener->sslctx) break;
+        }
+        if (! listener) {
+            return 0;  // No SSL.
+        }
+
+        ad_sslcache_t *cache = NEW_OBJECT(ad_sslcache_t);
+        if (cache == NULL) {
+            return -1;
+        }
+        server->sslcache = cache;
+        pthread_rwlock_init(&cache->keylock, NULL);
+        for (int i = 0; i < AD_SSLCACHE_SHARDS; i++) {
+            pthread_mutex_init(&cache->shards[i].lock, NULL);
+        }
+
+        int max = ad_server_get_option_int(server, "server.ssl_session_cache");
+        if (max > 0) {
+            cache->max = (max + AD_SSLCACHE_SHARDS - 1) / AD_SSLCACHE_SHARDS;
+            size_t nslots = 16;
+            while (nslots < cache->max) {
+                nslots <<= 1;
+            }
+            for (int i = 0; i < AD_SSLCACHE_SHARDS; i++) {
+                cache->shards[i].mask = nslots - 1;
+                cache->shards[i].slots = (ad_sslcache_sess_t **)calloc(nslots, sizeof(ad_sslcache_sess_t *));
+                if (cache->shards[i].slots == NULL) {
+                    return -1;
+                }
+            }
+        }
+
+        cache->rotate = ad_server_get_option_int(server, "server.ssl_ticket_rotate");
+        if (cache->rotate > 0) {
+            if (RAND_bytes(cache->seed, sizeof(cache->seed)) != 1) {
+                return -1;
+            }
+            cache->timer = evtimer_new(server->evbase, sslcache_rotate_cb, server);
+            if (cache->timer == NULL) {
+                return -1;
+            }
+            sslcache_rotate_cb(-1, EV_TIMEOUT, server);
+        }
+    }
+    return 0;
+}
+
+static void sslcache_setup(ad_server_t *server, SSL_CTX *sslctx) {
+    ad_sslcache_t *cache = server->sslcache;
+
+    static const unsigned char sid_ctx[] = "libasyncd";
+    SSL_CTX_set_session_id_context(sslctx, sid_ctx, sizeof(sid_ctx) - 1);
+    SSL_CTX_set_timeout(sslctx, ad_server_get_option_int(server, "server.ssl_session_timeout"));
+
+    if (cache->max > 0) {
+        SSL_CTX_set_session_cache_mode(sslctx, SSL_SESS_CACHE_SERVER | SSL_SESS_CACHE_NO_INTERNAL);
+        SSL_CTX_sess_set_new_cb(sslctx, sslcache_new_cb);
+        SSL_CTX_sess_set_get_cb(sslctx, sslcache_get_cb);
+        SSL_CTX_sess_set_remove_cb(sslctx, sslcache_remove_cb);
+    }
+
+    if (cache->rotate > 0) {
+        SSL_CTX_clear_options(sslctx, SSL_OP_NO_TICKET);
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+        SSL_CTX_set_tlsext_ticket_key_evp_cb(sslctx, sslcache_ticket_cb);
+#else
+        SSL_CTX_set_tlsext_ticket_key_cb(sslctx, sslcache_ticket_cb);
+#endif
+    } else {
+        SSL_CTX_set_options(sslctx, SSL_OP_NO_TICKET);
+    }
+}
+
+static void sslcache_free(ad_server_t *server) {
+    ad_sslcache_t *cache = server->sslcache;
+    if (cache->timer) {
+        event_free(cache->timer);
+    }
+    for (int i = 0; i < AD_SSLCACHE_SHARDS; i++) {
+        ad_sslcache_shard_t *shard = &cache->shards[i];
+        while (shard->oldest) {
+            sslcache_unlink(shard, shard->oldest);
+        }
+        if (shard->slots) {
+            free(shard->slots);
+        }
+        pthread_mutex_destroy(&shard->lock);
+    }
+    pthread_rwlock_destroy(&cache->keylock);
+    OPENSSL_cleanse(cache->seed, sizeof(cache->seed));
+    OPENSSL_cleanse(cache->keys, sizeof(cache->keys));
+    free(cache);
+    server->sslcache = NULL;
+}
+
+static ad_sslcache_t *sslcache_get(SSL *ssl) {
+    ad_server_t *server = SSL_CTX_get_ex_data(SSL_get_SSL_CTX(ssl), sslctx_index);
+    return (server) ? server->sslcache : NULL;
 }
 
-static void *server_loop(void *instance) {
-    ad_server_t *server = (ad_server_t *)instance;
+static unsigned int sslcache_hash(const unsigned char *id, unsigned int idlen) {
+    unsigned int hash = 2166136261u;  // FNV-1a
+    for (unsigned int i = 0; i < idlen; i++) {
+        hash = (hash ^ id[i]) * 16777619u;
+    }
+    return hash;
+}
 
-    int *retval = NEW_OBJECT(int);
-    DEBUG("Loop start");
-    event_base_loop(server->evbase, 0);
-    DEBUG("Loop finished");
-    *retval = (event_base_got_break(server->evbase)) ? -1 : 0;
+/**
+ * Add a session replacing the one with the same id. Expired and
+ * overflowing sessions are dropped from the oldest.
+ */
+static void sslcache_insert(ad_sslcache_t *cache, ad_sslcache_sess_t *sess) {
+    ad_sslcache_shard_t *shard = &cache->shards[sess->hash % AD_SSLCACHE_SHARDS];
+    time_t now = time(NULL);
+
+    pthread_mutex_lock(&shard->lock);
+    ad_sslcache_sess_t *old = sslcache_find(shard, sess->hash, sess->id, sess->idlen);
+    if (old) {
+        sslcache_unlink(shard, old);
+    }
 
-    return retval;
+    size_t slot = (sess->hash / AD_SSLCACHE_SHARDS) & shard->mask;
+    sess->hnext = shard->slots[slot];
+    shard->slots[slot] = sess;
+    sess->prev = shard->newest;
+    sess->next = NULL;
+    if (shard->newest) {
+        shard->newest->next = sess;
+    } else {
+        shard->oldest = sess;
+    }
+    shard->newest = sess;
+    shard->num++;
+
+    while (shard->oldest && (shard->num > cache->max || shard->oldest->expire <= now)) {
+        sslcache_unlink(shard, shard->oldest);
+    }
+    pthread_mutex_unlock(&shard->lock);
 }
 
-static void close_server(ad_server_t *server) {
-    DEBUG("Closing server.");
+static void sslcache_unlink(ad_sslcache_shard_t *shard, ad_sslcache_sess_t *sess) {
+    ad_sslcache_sess_t **link = &shard->slots[(sess->hash / AD_SSLCACHE_SHARDS) & shard->mask];
+    while (*link != sess) {
+        link = &(*link)->hnext;
+    }
+    *link = sess->hnext;
 
-    if (server->notify_buffer) {
-        bufferevent_free(server->notify_buffer);
-        server->notify_buffer = NULL;
+    if (sess->prev) {
+        sess->prev->next = sess->next;
+    } else {
+        shard->oldest = sess->next;
+    }
+    if (sess->next) {
+        sess->next->prev = sess->prev;
+    } else {
+        shard->newest = sess->prev;
     }
+    shard->num--;
+    free(sess);
+}
 
-    if (server->listener) {
-            evconnlistener_free(server->listener);
-            server->listener = NULL;
+static ad_sslcache_sess_t *sslcache_find(ad_sslcache_shard_t *shard, unsigned int hash,
+                                         const unsigned char *id, unsigned int idlen) {
+    ad_sslcache_sess_t *sess = shard->slots[(hash / AD_SSLCACHE_SHARDS) & shard->mask];
+    for (; sess; sess = sess->hnext) {
+        if (sess->hash == hash && sess->idlen == idlen && ! memcmp(sess->id, id, idlen)) {
+            return sess;
+        }
     }
+    return NULL;
+}
 
-    if (server->thread) {
-        void *retval = NULL;
-        DEBUG("Waiting server's last loop to finish.");
-        pthread_join(*(server->thread), &retval);
-        free(retval);
-        free(server->thread);
-        server->thread = NULL;
+static int sslcache_new_cb(SSL *ssl, SSL_SESSION *session) {
+    ad_sslcache_t *cache = sslcache_get(ssl);
+    if (cache == NULL || cache->max == 0) {
+        return 0;
     }
-    INFO("Server closed.");
+    unsigned int idlen;
+    const unsigned char *id = SSL_SESSION_get_id(session, &idlen);
+    int derlen = i2d_SSL_SESSION(session, NULL);
+    if (idlen == 0 || idlen > SSL_MAX_SSL_SESSION_ID_LENGTH || derlen <= 0) {
+        return 0;
+    }
+
+    ad_sslcache_sess_t *sess = (ad_sslcache_sess_t *)malloc(sizeof(ad_sslcache_sess_t) + derlen);
+    if (sess == NULL) {
+        return 0;
+    }
+    unsigned char *p = sess->der;
+    sess->derlen = i2d_SSL_SESSION(session, &p);
+    memcpy(sess->id, id, idlen);
+    sess->idlen = idlen;
+    sess->hash = sslcache_hash(id, idlen);
+    sess->expire = time(NULL) + SSL_SESSION_get_timeout(session);
+    sslcache_insert(cache, sess);
+
+    return 0;  // We keep our own copy.
+}
+
+static SSL_SESSION *sslcache_get_cb(SSL *ssl, ad_sslsess_id_t *id, int idlen, int *copy) {
+    *copy = 0;
+    ad_sslcache_t *cache = sslcache_get(ssl);
+    if (cache == NULL || cache->max == 0 || idlen <= 0) {
+        return NULL;
+    }
+    unsigned int hash = sslcache_hash(id, idlen);
+    ad_sslcache_shard_t *shard = &cache->shards[hash % AD_SSLCACHE_SHARDS];
+
+    unsigned char der[16 * 1024];
+    int derlen = 0;
+    pthread_mutex_lock(&shard->lock);
+    ad_sslcache_sess_t *sess = sslcache_find(shard, hash, id, idlen);
+    if (sess && sess->expire <= time(NULL)) {
+        sslcache_unlink(shard, sess);
+    } else if (sess && sess->derlen <= sizeof(der)) {
+        derlen = sess->derlen;
+        memcpy(der, sess->der, derlen);
+    }
+    pthread_mutex_unlock(&shard->lock);
+
+    if (derlen == 0) {
+        return NULL;
+    }
+    const unsigned char *p = der;
+    return d2i_SSL_SESSION(NULL, &p, derlen);
+}
+
+static void sslcache_remove_cb(SSL_CTX *sslctx, SSL_SESSION *session) {
+    ad_server_t *server = SSL_CTX_get_ex_data(sslctx, sslctx_index);
+    ad_sslcache_t *cache = (server) ? server->sslcache : NULL;
+    if (cache == NULL || cache->max == 0) {
+        return;
+    }
+    unsigned int idlen;
+    const unsigned char *id = SSL_SESSION_get_id(session, &idlen);
+    unsigned int hash = sslcache_hash(id, idlen);
+    ad_sslcache_shard_t *shard = &cache->shards[hash % AD_SSLCACHE_SHARDS];
+
+    pthread_mutex_lock(&shard->lock);
+    ad_sslcache_sess_t *sess = sslcache_find(shard, hash, id, idlen);
+    if (sess) {
+        sslcache_unlink(shard, sess);
+    }
+    pthread_mutex_unlock(&shard->lock);
+}
+
+static void sslcache_derive_key(ad_sslcache_t *cache, uint64_t period, ad_ticket_key_t *key) {
+    unsigned char msg[9];
+    for (int i = 0; i < 8; i++) {
+        msg[1 + i] = (unsigned char)(period >> (56 - i * 8));
+    }
+    unsigned char md[EVP_MAX_MD_SIZE];
+    unsigned int mdlen;
+
+    msg[0] = 'n';
+    HMAC(EVP_sha256(), cache->seed, sizeof(cache->seed), msg, sizeof(msg), md, &mdlen);
+    memcpy(key->name, md, sizeof(key->name));
+    msg[0] = 'a';
+    HMAC(EVP_sha256(), cache->seed, sizeof(cache->seed), msg, sizeof(msg), key->aes, &mdlen);
+    msg[0] = 'h';
+    HMAC(EVP_sha256(), cache->seed, sizeof(cache->seed), msg, sizeof(msg), key->hmac, &mdlen);
+    OPENSSL_cleanse(md, sizeof(md));
+}
+
+/**
+ * Switch to the current period's ticket key.
+ */
+static void sslcache_rotate(ad_sslcache_t *cache) {
+    uint64_t period = time(NULL) / cache->rotate;
+    if (period == cache->period) {
+        return;
+    }
+    ad_ticket_key_t keys[2];
+    sslcache_derive_key(cache, period, &keys[0]);
+    sslcache_derive_key(cache, period - 1, &keys[1]);
+
+    pthread_rwlock_wrlock(&cache->keylock);
+    memcpy(cache->keys, keys, sizeof(keys));
+    cache->period = period;
+    pthread_rwlock_unlock(&cache->keylock);
+    OPENSSL_cleanse(keys, sizeof(keys));
+    DEBUG("Session ticket key rotated.");
+}
+
+static void sslcache_rotate_cb(evutil_socket_t fd, short what, void *userdata) {
+    ad_server_t *server = (ad_server_t *)userdata;
+    ad_sslcache_t *cache = server->sslcache;
+    sslcache_rotate(cache);
+
+    // Wake up at the start of the next period.
+    struct timeval tm;
+    bzero((void *)&tm, sizeof(struct timeval));
+    tm.tv_sec = cache->rotate - (time(NULL) % cache->rotate);
+    evtimer_add(cache->timer, &tm);
+}
+
+static int sslcache_ticket_cb(SSL *ssl, unsigned char *name, unsigned char *iv,
+                              EVP_CIPHER_CTX *ectx, ad_ticket_mac_t *hctx, int enc) {
+    ad_sslcache_t *cache = sslcache_get(ssl);
+    if (cache == NULL || cache->rotate <= 0) {
+        return -1;
+    }
+
+    int ret = 0;
+    pthread_rwlock_rdlock(&cache->keylock);
+    if (enc) {
+        ad_ticket_key_t *key = &cache->keys[0];
+        if (RAND_bytes(iv, EVP_CIPHER_iv_length(EVP_aes_256_cbc())) == 1
+            && EVP_EncryptInit_ex(ectx, EVP_aes_256_cbc(), NULL, key->aes, iv) == 1
+            && sslcache_ticket_mac(hctx, key) == 0) {
+            memcpy(name, key->name, sizeof(key->name));
+            ret = 1;
+        } else {
+            ret = -1;
+        }
+    } else {
+        for (int i = 0; i < 2; i++) {
+            ad_ticket_key_t *key = &cache->keys[i];
+            if (! memcmp(name, key->name, sizeof(key->name))) {
+                if (sslcache_ticket_mac(hctx, key)
+                    || EVP_DecryptInit_ex(ectx, EVP_aes_256_cbc(), NULL, key->aes, iv) != 1) {
+                    ret = -1;
+                } else {
+                    ret = (i == 0) ? 1 : 2;  // 2 to renew the ticket.
+                }
+                break;
+            }
+        }
+    }
+    pthread_rwlock_unlock(&cache->keylock);
+    return ret;
+}
+
+/**
+ * Set up the ticket HMAC with the key.
+ */
+static int sslcache_ticket_mac(ad_ticket_mac_t *hctx, ad_ticket_key_t *key) {
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+    OSSL_PARAM params[] = {
+        OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, "SHA256", 0),
+        OSSL_PARAM_construct_end()
+    };
+    return (EVP_MAC_init(hctx, key->hmac, sizeof(key->hmac), params) == 1) ? 0 : -1;
+#else
+    return (HMAC_Init_ex(hctx, key->hmac, sizeof(key->hmac), EVP_sha256(), NULL) == 1) ? 0 : -1;
+#endif
 }
 
 static void libevent_log_cb(int severity, const char *msg) {
@@ -645,16 +3124,23 @@ static SSL_CTX *init_ssl(const char *cert_path, const char *pkey_path) {
     return sslctx;
 }
 
-static void listener_cb(struct evconnlistener *listener, evutil_socket_t socket,
+static void listener_cb(struct evconnlistener *evlistener, evutil_socket_t socket,
                         struct sockaddr *sockaddr, int socklen, void *userdata) {
     DEBUG("New connection.");
-    ad_server_t *server = (ad_server_t *)userdata;
+    ad_listener_t *listener = (ad_listener_t *)userdata;
+    ad_server_t *server = listener->server;
 
-    // Create a new buffer.
+    // Handshake in the pool, the connection comes back to the loop after.
     struct bufferevent *buffer = NULL;
-    if (server->sslctx) {
+    if (listener->sslctx && server->hspool) {
+        if (handshake_start(listener, socket)) goto error;
+        return;
+    }
+
+    // Create a new buffer.
+    if (listener->sslctx) {
         buffer = bufferevent_openssl_socket_new(server->evbase, socket,
-                                                SSL_new(server->sslctx),
+                                                SSL_new(listener->sslctx),
                                                 BUFFEREVENT_SSL_ACCEPTING,
                                                 BEV_OPT_CLOSE_ON_FREE);
     } else {
@@ -662,29 +3148,375 @@ static void listener_cb(struct evconnlistener *listener, evutil_socket_t socket,
     }
     if (buffer == NULL) goto error;
 
-    // Set read timeout.
-    int timeout = ad_server_get_option_int(server, "server.timeout");
-    if (timeout > 0) {
-        struct timeval tm;
-        bzero((void *)&tm, sizeof(struct timeval));
-        tm.tv_sec = timeout;
-        bufferevent_set_timeouts(buffer, &tm, NULL);
-    }
+    // Set timeouts.
+    listener_set_timeouts(listener, buffer);
 
     // Create a connection.
-    void *conn = conn_new(server, buffer);
+    void *conn = conn_new(server, listener, buffer);
     if (! conn) goto error;
+    if (server->mystats) {
+        __atomic_fetch_add(&server->mystats->accepted, 1, __ATOMIC_RELAXED);
+    }
 
     return;
 
   error:
-    if (buffer) bufferevent_free(buffer);
+    // Drop this one, the server keeps serving the others.
+    if (buffer) {
+        bufferevent_free(buffer);
+    } else {
+        evutil_closesocket(socket);
+    }
     ERROR("Failed to create a connection handler.");
-    event_base_loopbreak(server->evbase);
-    server->errcode = ENOMEM;
 }
 
-static ad_conn_t *conn_new(ad_server_t *server, struct bufferevent *buffer) {
+static void listener_set_timeouts(ad_listener_t *listener, struct bufferevent *buffer) {
+    int timeout = (listener->timeout >= 0) ? listener->timeout
+                  : ad_server_get_option_int(listener->server, "server.timeout");
+    if (timeout > 0 || listener->write_timeout > 0) {
+        struct timeval rtm, wtm;
+        bzero((void *)&rtm, sizeof(struct timeval));
+        bzero((void *)&wtm, sizeof(struct timeval));
+        rtm.tv_sec = timeout;
+        wtm.tv_sec = listener->write_timeout;
+        bufferevent_set_timeouts(buffer, (timeout > 0) ? &rtm : NULL,
+                                 (listener->write_timeout > 0) ? &wtm : NULL);
+    }
+}
+
+/**
+ * Bind the listener on its address.
+ */
+static int listener_bind(ad_listener_t *listener) {
+    ad_server_t *server = listener->server;
+    const char *addr = listener->addr;
+    int port = listener->port;
+
+    struct sockaddr_storage sockaddr;
+    bzero((void *) &sockaddr, sizeof(sockaddr));
+    size_t sockaddr_len = 0;
+    if (addr[0] == '/') {  // Unix socket.
+        struct sockaddr_un *unixaddr = (struct sockaddr_un *) &sockaddr;
+        if (strlen(addr) >= sizeof(unixaddr->sun_path)) {
+            errno = EINVAL;
+            DEBUG("Too long unix socket name. '%s'", addr);
+            return -1;
+        }
+        unixaddr->sun_family = AF_UNIX;
+        strcpy(unixaddr->sun_path, addr);  // no need of strncpy()
+        sockaddr_len = sizeof(struct sockaddr_un);
+    } else if (strstr(addr, ":")) {  // IPv6
+        struct sockaddr_in6 *ipv6addr = (struct sockaddr_in6 *) &sockaddr;
+        ipv6addr->sin6_family = AF_INET6;
+        ipv6addr->sin6_port = htons(port);
+        evutil_inet_pton(AF_INET6, addr, &ipv6addr->sin6_addr);
+        sockaddr_len = sizeof(struct sockaddr_in6);
+    } else {  // IPv4
+        struct sockaddr_in *ipv4addr = (struct sockaddr_in *) &sockaddr;
+        ipv4addr->sin_family = AF_INET;
+        ipv4addr->sin_port = htons(port);
+        ipv4addr->sin_addr.s_addr =
+                (IS_EMPTY_STR(addr)) ? INADDR_ANY : inet_addr(addr);
+        sockaddr_len = sizeof(struct sockaddr_in);
+    }
+
+    int backlog = (listener->backlog >= 0) ? listener->backlog
+                  : ad_server_get_option_int(server, "server.backlog");
+    listener->listener = evconnlistener_new_bind(
+            server->evbase, listener_cb, (void *)listener,
+            LEV_OPT_THREADSAFE | LEV_OPT_REUSEABLE | LEV_OPT_CLOSE_ON_FREE,
+            backlog, (struct sockaddr *) &sockaddr, sockaddr_len);
+
+
+    if (listener->listener == NULL) {
+        return -1;
+    }
+    evconnlistener_set_error_cb(listener->listener, accept_error_cb);
+    return 0;
+}
+
+/**
+ * Create the listener on an already bound socket.
+ */
+static int listener_new_fd(ad_listener_t *listener, evutil_socket_t fd) {
+    ad_server_t *server = listener->server;
+    int backlog = (listener->backlog >= 0) ? listener->backlog
+                  : ad_server_get_option_int(server, "server.backlog");
+
+    evutil_make_socket_nonblocking(fd);
+    evutil_make_socket_closeonexec(fd);
+    listener->listener = evconnlistener_new(
+            server->evbase, listener_cb, (void *)listener,
+            LEV_OPT_THREADSAFE | LEV_OPT_REUSEABLE | LEV_OPT_CLOSE_ON_FREE,
+            backlog, fd);
+
+
+    if (listener->listener == NULL) {
+        return -1;
+    }
+    evconnlistener_set_error_cb(listener->listener, accept_error_cb);
+    return 0;
+}
+
+/**
+ * Assign bound sockets to the listeners in the added order. Sockets left
+ * over are closed.
+ */
+static int listeners_adopt(ad_server_t *server, int *fds, int nfds) {
+    int i = 0;
+    ad_listener_t *listener;
+    for (listener = server->listeners; listener && i < nfds; listener = listener->next) {
+        if (listener->listener) {
+            continue;
+        }
+        if (listener_new_fd(listener, fds[i])) {
+            break;
+        }
+        i++;
+    }
+    if (i < nfds) {
+        if (listener) {
+            ERROR("Failed to listen on socket %d.", fds[i]);
+        } else {
+            WARN("%d socket(s) left without listener.", nfds - i);
+        }
+        for (; i < nfds; i++) {
+            close(fds[i]);
+        }
+        return (listener) ? -1 : 0;
+    }
+    return 0;
+}
+
+static void listener_free(ad_listener_t *listener) {
+    if (listener->listener) {
+        evconnlistener_free(listener->listener);
+    }
+    if (listener->sslctx && listener->sslctx != listener->server->sslctx) {
+        SSL_CTX_free(listener->sslctx);
+    }
+    if (listener->hooks) {
+        ad_hooks_free(listener->hooks);
+    }
+    free(listener->addr);
+    free(listener);
+}
+
+/**
+ * Find listening sockets opened by the parent process, either given by
+ * "server.listen_fd" option or by systemd socket activation.
+ *
+ * @return number of sockets, 0 if there's none.
+ */
+static int inherited_fds(ad_server_t *server, int *fds, int maxfds) {
+    int fd = ad_server_get_option_int(server, "server.listen_fd");
+    if (fd >= 0) {
+        fds[0] = fd;
+        return 1;
+    }
+
+    if (ad_server_get_option_int(server, "server.socket_activation")) {
+        const char *pid = getenv("LISTEN_PID");
+        const char *listen_fds = getenv("LISTEN_FDS");
+        if (pid && listen_fds && atoi(pid) == getpid() && atoi(listen_fds) > 0) {
+            int nfds = atoi(listen_fds);
+            if (nfds > maxfds) {
+                WARN("Only %d of %d passed sockets are used.", maxfds, nfds);
+                nfds = maxfds;
+            }
+            for (int i = 0; i < nfds; i++) {
+                fds[i] = AD_LISTEN_FDS_START + i;
+            }
+            // Don't pass them down to our children.
+            unsetenv("LISTEN_PID");
+            unsetenv("LISTEN_FDS");
+            unsetenv("LISTEN_FDNAMES");
+            return nfds;
+        }
+        DEBUG("No socket passed by socket activation.");
+    }
+    return 0;
+}
+
+/**
+ * Receive listening sockets from the running process.
+ *
+ * @return number of listeners taken over, 0 if there's no one to take over
+ *         from, -1 on error.
+ */
+static int handoff_receive(ad_server_t *server, const char *path) {
+    struct sockaddr_un unixaddr;
+    bzero((void *) &unixaddr, sizeof(struct sockaddr_un));
+    if (strlen(path) >= sizeof(unixaddr.sun_path)) {
+        ERROR("Too long handoff socket name. '%s'", path);
+        return -1;
+    }
+    unixaddr.sun_family = AF_UNIX;
+    strcpy(unixaddr.sun_path, path);
+
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock < 0) {
+        return -1;
+    }
+    if (connect(sock, (struct sockaddr *) &unixaddr, sizeof(unixaddr))) {
+        DEBUG("No process to take over from. (%s)", strerror(errno));
+        close(sock);
+        return 0;
+    }
+    struct timeval tm = { AD_HANDOFF_TIMEOUT, 0 };
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tm, sizeof(tm));
+
+    // Receive descriptors.
+    char byte;
+    struct iovec iov = { .iov_base = &byte, .iov_len = 1 };
+    char cmsgbuf[CMSG_SPACE(sizeof(int) * AD_LISTEN_FDS_MAX)];
+    struct msghdr msg;
+    bzero((void *) &msg, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cmsgbuf;
+    msg.msg_controllen = sizeof(cmsgbuf);
+    if (recvmsg(sock, &msg, 0) <= 0) {
+        ERROR("Failed to receive listening sockets. (%s)", strerror(errno));
+        close(sock);
+        return -1;
+    }
+
+    // Take whatever descriptors did arrive, so none of them leaks.
+    int nfds = 0;
+    bool overflow = false;
+    int fds[AD_LISTEN_FDS_MAX];
+    struct cmsghdr *cmsg;
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+            continue;
+        }
+        int n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for (int i = 0; i < n; i++) {
+            int fd;
+            memcpy(&fd, CMSG_DATA(cmsg) + sizeof(int) * i, sizeof(int));
+            if (nfds < AD_LISTEN_FDS_MAX) {
+                fds[nfds++] = fd;
+            } else {
+                close(fd);
+                overflow = true;
+            }
+        }
+    }
+    if ((msg.msg_flags & MSG_CTRUNC) || overflow) {
+        ERROR("Too many listening sockets to take over. (max:%d)", AD_LISTEN_FDS_MAX);
+        for (int i = 0; i < nfds; i++) {
+            close(fds[i]);
+        }
+        close(sock);
+        return -1;
+    }
+    if (nfds == 0) {
+        ERROR("No listening socket received.");
+        close(sock);
+        return -1;
+    }
+
+    if (listeners_adopt(server, fds, nfds)) {
+        ERROR("Failed to take over listening sockets.");
+        close(sock);
+        return -1;
+    }
+
+    // Tell the old process we're accepting now.
+    byte = AD_HANDOFF_ACK;
+    if (write(sock, &byte, 1) != 1) {
+        WARN("Failed to acknowledge handoff. (%s)", strerror(errno));
+    }
+    close(sock);
+
+    INFO("Took over %d listening socket(s) from the running process.", nfds);
+    return nfds;
+}
+
+/**
+ * Open the channel the next process will take over from.
+ */
+static int handoff_listen(ad_server_t *server, const char *path) {
+    struct sockaddr_un unixaddr;
+    bzero((void *) &unixaddr, sizeof(struct sockaddr_un));
+    if (strlen(path) >= sizeof(unixaddr.sun_path)) {
+        return -1;
+    }
+    unixaddr.sun_family = AF_UNIX;
+    strcpy(unixaddr.sun_path, path);
+
+    // The previous process, if any, is already handed off.
+    unlink(path);
+    mode_t mask = umask(0077);
+    server->handoff = evconnlistener_new_bind(
+            server->evbase, handoff_cb, (void *)server,
+            LEV_OPT_CLOSE_ON_FREE | LEV_OPT_CLOSE_ON_EXEC, 1,
+            (struct sockaddr *) &unixaddr, sizeof(unixaddr));
+    umask(mask);
+
+    return (server->handoff) ? 0 : -1;
+}
+
+static void handoff_cb(struct evconnlistener *listener, evutil_socket_t sock,
+                       struct sockaddr *sockaddr, int socklen, void *userdata) {
+    ad_server_t *server = (ad_server_t *)userdata;
+    int nfds = 0;
+    int fds[AD_LISTEN_FDS_MAX];
+    ad_listener_t *l;
+    for (l = server->listeners; l && nfds < AD_LISTEN_FDS_MAX; l = l->next) {
+        if (l->listener) {
+            fds[nfds++] = evconnlistener_get_fd(l->listener);
+        }
+    }
+    if (server->draining || nfds == 0) {
+        close(sock);
+        return;
+    }
+    DEBUG("Handing off %d listening socket(s).", nfds);
+
+    char byte = 0;
+    struct iovec iov = { .iov_base = &byte, .iov_len = 1 };
+    char cmsgbuf[CMSG_SPACE(sizeof(int) * AD_LISTEN_FDS_MAX)];
+    bzero((void *) cmsgbuf, sizeof(cmsgbuf));
+    struct msghdr msg;
+    bzero((void *) &msg, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cmsgbuf;
+    msg.msg_controllen = sizeof(cmsgbuf);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * nfds);
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * nfds);
+    msg.msg_controllen = CMSG_SPACE(sizeof(int) * nfds);
+
+    if (sendmsg(sock, &msg, 0) <= 0) {
+        ERROR("Failed to send listening sockets. (%s)", strerror(errno));
+        close(sock);
+        return;
+    }
+
+    // Keep serving until the new process says it's accepting.
+    struct timeval tm = { AD_HANDOFF_TIMEOUT, 0 };
+    event_base_once(server->evbase, sock, EV_READ, handoff_ack_cb, server, &tm);
+}
+
+static void handoff_ack_cb(evutil_socket_t sock, short what, void *userdata) {
+    ad_server_t *server = (ad_server_t *)userdata;
+    char byte = 0;
+    if ((what & EV_READ) && read(sock, &byte, 1) == 1 && byte == AD_HANDOFF_ACK) {
+        INFO("Listening socket is taken over by the new process. Draining.");
+        drain_server(server);
+    } else {
+        WARN("Handoff is not acknowledged. Keep serving.");
+    }
+    close(sock);
+}
+
+static ad_conn_t *conn_new(ad_server_t *server, ad_listener_t *listener,
+                           struct bufferevent *buffer) {
     if (server == NULL || buffer == NULL) {
         return NULL;
     }
@@ -695,11 +3527,28 @@ static ad_conn_t *conn_new(ad_server_t *server, struct bufferevent *buffer) {
 
     // Initialize with default values.
     conn->server = server;
+    conn->listener = listener;
     conn->buffer = buffer;
     conn->in = bufferevent_get_input(buffer);
     conn->out = bufferevent_get_output(buffer);
+    ad_conn_track_buffer(conn, conn->in);
+    ad_conn_track_buffer(conn, conn->out);
     conn_reset(conn);
 
+    // Link to the server.
+    conn->next = server->conns;
+    if (server->conns) {
+        server->conns->prev = conn;
+    }
+    server->conns = conn;
+    server->nconns++;
+    if (server->mystats) {
+        __atomic_store_n(&server->mystats->conns, server->nconns, __ATOMIC_RELAXED);
+    }
+    if (server->max_conns > 0 || server->max_conns_global > 0) {
+        accept_update(server);
+    }
+
     // Bind callback
     bufferevent_setcb(buffer, conn_read_cb, conn_write_cb, conn_event_cb, (void *)conn);
     bufferevent_setwatermark(buffer, EV_WRITE, 0, 0);
@@ -714,6 +3563,7 @@ static ad_conn_t *conn_new(ad_server_t *server, struct bufferevent *buffer) {
 
 static void conn_reset(ad_conn_t *conn) {
     conn->status = AD_OK;
+    conn->busy = false;
 
     for(int i = 0; i < AD_NUM_USERDATA; i++) {
         if (conn->userdata[i]) {
@@ -732,24 +3582,105 @@ static void conn_reset(ad_conn_t *conn) {
     }
 }
 
+/**
+ * Switch to a plain socket once the kernel does TLS records both ways,
+ * so data no longer goes through OpenSSL's buffers and files can be sent
+ * with sendfile().
+ */
+static void conn_ktls(ad_conn_t *conn) {
+#ifdef SSL_OP_ENABLE_KTLS
+    SSL *ssl = bufferevent_openssl_get_ssl(conn->buffer);
+    if (ssl == NULL || ! BIO_get_ktls_send(SSL_get_wbio(ssl))
+        || ! BIO_get_ktls_recv(SSL_get_rbio(ssl)) || SSL_pending(ssl) > 0) {
+        return;
+    }
+
+    evutil_socket_t fd = dup(bufferevent_getfd(conn->buffer));
+    if (fd < 0) {
+        return;
+    }
+    struct bufferevent *buffer = bufferevent_socket_new(conn->server->evbase, fd,
+                                                        BEV_OPT_CLOSE_ON_FREE);
+    if (buffer == NULL) {
+        close(fd);
+        return;
+    }
+    ad_conn_track_buffer(conn, bufferevent_get_input(buffer));
+    ad_conn_track_buffer(conn, bufferevent_get_output(buffer));
+    evbuffer_add_buffer(bufferevent_get_input(buffer), conn->in);
+    evbuffer_add_buffer(bufferevent_get_output(buffer), conn->out);
+    listener_set_timeouts(conn->listener, buffer);
+
+    // The session stays resumable, the kernel carries on from here.
+    SSL_set_shutdown(ssl, SSL_SENT_SHUTDOWN | SSL_RECEIVED_SHUTDOWN);
+    bufferevent_free(conn->buffer);
+
+    conn->buffer = buffer;
+    conn->in = bufferevent_get_input(buffer);
+    conn->out = bufferevent_get_output(buffer);
+    bufferevent_setcb(buffer, conn_read_cb, conn_write_cb, conn_event_cb, (void *)conn);
+    bufferevent_setwatermark(buffer, EV_WRITE, 0, 0);
+    bufferevent_enable(buffer, (conn->token) ? EV_WRITE : EV_WRITE | EV_READ);
+    DEBUG("Switched to kTLS. (fd:%d)", fd);
+
+    if (evbuffer_get_length(conn->in) > 0) {
+        conn_cb(conn, AD_EVENT_READ);
+    }
+#endif
+}
+
 static void conn_free(ad_conn_t *conn) {
     if (conn) {
+        if (conn->token) {
+            // Let the pending ad_conn_resume() know we're gone.
+            conn->token->conn = NULL;
+            conn->token = NULL;
+        }
         if (conn->status != AD_CLOSE) {
             call_hooks(AD_EVENT_CLOSE | AD_EVENT_SHUTDOWN , conn);
         }
         conn_reset(conn);
         if (conn->buffer) {
-            if (conn->server->sslctx) {
+            if (conn->listener && conn->listener->sslctx) {
                 int sslerr = bufferevent_get_openssl_error(conn->buffer);
                 if (sslerr) {
                     char errmsg[256];
                     ERR_error_string_n(sslerr, errmsg, sizeof(errmsg));
                     ERROR("SSL %s (err:%d)", errmsg, sslerr);
+                } else {
+                    // Otherwise SSL_free() takes it as broken and drops
+                    // the session from the cache.
+                    SSL *ssl = bufferevent_openssl_get_ssl(conn->buffer);
+                    if (ssl && SSL_is_init_finished(ssl)) {
+                        SSL_set_shutdown(ssl, SSL_SENT_SHUTDOWN | SSL_RECEIVED_SHUTDOWN);
+                    }
                 }
             }
             bufferevent_free(conn->buffer);
         }
+
+        // Unlink from the server.
+        ad_server_t *server = conn->server;
+        mem_update(server, -(ssize_t)conn->mem);
+        if (conn->prev) {
+            conn->prev->next = conn->next;
+        } else {
+            server->conns = conn->next;
+        }
+        if (conn->next) {
+            conn->next->prev = conn->prev;
+        }
+        server->nconns--;
+        if (server->mystats) {
+            __atomic_fetch_add(&server->mystats->closed, 1, __ATOMIC_RELAXED);
+            __atomic_store_n(&server->mystats->conns, server->nconns, __ATOMIC_RELAXED);
+        }
+        if (server->max_conns > 0 || server->max_conns_global > 0) {
+            accept_update(server);
+        }
         free(conn);
+
+        drain_check(server);
     }
 }
 
@@ -770,7 +3701,17 @@ static void conn_event_cb(struct bufferevent *buffer, short what, void *userdata
     DEBUG("event_cb 0x%x", what);
     ad_conn_t *conn = userdata;
 
+    if (what & BEV_EVENT_CONNECTED) {
+        DEBUG("SSL handshake done.");
+        conn_ktls(conn);
+        return;
+    }
+
     if (what & BEV_EVENT_EOF || what & BEV_EVENT_ERROR || what & BEV_EVENT_TIMEOUT) {
+        if (what & BEV_EVENT_ERROR || (what & BEV_EVENT_TIMEOUT && what & BEV_EVENT_WRITING)) {
+            // Whatever is left in the out-buffer is not going anywhere.
+            bufferevent_disable(buffer, EV_WRITE);
+        }
         conn->status = AD_CLOSE;
         conn_cb(conn, AD_EVENT_CLOSE | ((what & BEV_EVENT_TIMEOUT) ? AD_EVENT_TIMEOUT : 0));
     }
@@ -778,6 +3719,11 @@ static void conn_event_cb(struct bufferevent *buffer, short what, void *userdata
 
 static void conn_cb(ad_conn_t *conn, int event) {
     DEBUG("conn_cb: status:0x%x, event:0x%x", conn->status, event)
+    if (conn->token && !(event & AD_EVENT_CLOSE)) {
+        DEBUG("Connection is suspended.");
+        return;
+    }
+
     if(conn->status == AD_OK || conn->status == AD_TAKEOVER) {
         int status = call_hooks(event, conn);
         // Update status only when it's higher then before.
@@ -786,6 +3732,11 @@ static void conn_cb(ad_conn_t *conn, int event) {
         }
     }
 
+    if (conn->status == AD_DONE && conn->server->draining) {
+        DEBUG("Closing connection. Server is draining.");
+        conn->status = AD_CLOSE;
+    }
+
     if(conn->status == AD_DONE) {
         if (ad_server_get_option_int(conn->server, "server.request_pipelining")) {
             call_hooks(AD_EVENT_CLOSE , conn);
@@ -800,7 +3751,9 @@ static void conn_cb(ad_conn_t *conn, int event) {
         }
         return;
     } else if(conn->status == AD_CLOSE) {
-        if (evbuffer_get_length(conn->out) <= 0) {
+        // Don't wait for output that can't be written anymore.
+        if (evbuffer_get_length(conn->out) <= 0
+            || ! (bufferevent_get_enabled(conn->buffer) & EV_WRITE)) {
             int newevent = (event & AD_EVENT_CLOSE) ? event : AD_EVENT_CLOSE;
             call_hooks(newevent, conn);
             conn_free(conn);
@@ -813,22 +3766,10 @@ static void conn_cb(ad_conn_t *conn, int event) {
 static int call_hooks(short event, ad_conn_t *conn) {
     DEBUG("call_hooks: event 0x%x", event);
     qlist_t *hooks = conn->server->hooks;
-
-    qlist_obj_t obj;
-    bzero((void *)&obj, sizeof(qlist_obj_t));
-    while (hooks->getnext(hooks, &obj, false) == true) {
-        ad_hook_t *hook = (ad_hook_t *)obj.data;
-        if (hook->cb) {
-            if (hook->method && conn->method && strcmp(hook->method, conn->method)) {
-                continue;
-            }
-            int status = hook->cb(event, conn, hook->userdata);
-            if (status != AD_OK) {
-                return status;
-            }
-        }
+    if (conn->listener && conn->listener->hooks) {
+        hooks = conn->listener->hooks;
     }
-    return AD_OK;
+    return ad_hooks_call(hooks, event, conn);
 }
 
 static void *set_userdata(ad_conn_t *conn, int index, const void *userdata, ad_userdata_free_cb free_cb) {